@@ -0,0 +1,312 @@
+/*********************************************************************
+ * asyncWriter.cpp
+ *
+ * Writes feature files and overlay images on a background thread, so
+ * that a tracking loop does not wait on the disk.  Each request takes
+ * a snapshot of the feature list (and of the image, for overlays)
+ * and goes into a bounded queue; what happens when the queue is full
+ * is set by the writer's policy:
+ *
+ *   KLT_OUTPUT_WAIT         the caller waits for room (nothing is lost)
+ *   KLT_OUTPUT_DROP_NEWEST  the new request is dropped
+ *   KLT_OUTPUT_DROP_OLDEST  the oldest queued request is dropped
+ *
+ * With either drop policy, enqueueing never blocks on I/O.
+ *********************************************************************/
+
+/* Standard includes */
+#include <stdlib.h>  /* malloc() */
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Our includes */
+extern "C" {
+#include "error.h"
+}
+#include "klt.h"
+
+
+struct _OutputRequest  {
+  KLT_FeatureList fl;			/* snapshot of x, y and val */
+  std::vector<KLT_PixelType> img;	/* for overlays only */
+  int ncols, nrows;
+  bool overlay;
+  bool binary;
+  bool hasFname, hasBmpfname;		/* else NULL is passed on */
+  std::string fname;			/* feature file or PPM file */
+  std::string bmpfname;
+  std::string fmt;
+};
+
+struct _AsyncWriterState  {
+  std::mutex lock;
+  std::condition_variable notEmpty;	/* signalled on new requests */
+  std::condition_variable notFull;	/* ... when a request is taken */
+  std::condition_variable idle;		/* ... when the queue has drained */
+  std::deque<_OutputRequest *> queue;
+  bool busy;				/* writer thread is writing */
+  bool stop;
+  int nDropped;
+  std::thread thread;
+};
+
+
+/* Returns a name kept by a request, or NULL if none was given */
+static char *_name(
+  bool has,
+  std::string &name)
+{
+  return has ? (char *) name.c_str() : NULL;
+}
+
+
+static void _freeRequest(
+  _OutputRequest *req)
+{
+  KLTFreeFeatureList(req->fl);
+  delete req;
+}
+
+
+/*********************************************************************
+ * _writerLoop
+ *
+ * Body of the writer thread: takes requests one at a time and writes
+ * them with the synchronous functions, outside the lock.
+ */
+
+static void _writerLoop(
+  _AsyncWriterState *st)
+{
+  _OutputRequest *req;
+
+  for (;;)  {
+    {
+      std::unique_lock<std::mutex> guard(st->lock);
+      st->busy = false;
+      if (st->queue.empty())  st->idle.notify_all();
+      while (st->queue.empty() && !st->stop)
+        st->notEmpty.wait(guard);
+      if (st->queue.empty())  return;	/* stopped and drained */
+      req = st->queue.front();
+      st->queue.pop_front();
+      st->busy = true;
+      st->notFull.notify_one();
+    }
+
+    if (req->overlay)
+      KLTWriteFeatureListToPPMandBMP(req->fl, &req->img[0],
+                                     req->ncols, req->nrows,
+                                     _name(req->hasFname, req->fname),
+                                     _name(req->hasBmpfname, req->bmpfname));
+    else
+      KLTWriteFeatureList(req->fl, _name(req->hasFname, req->fname),
+                          req->binary ? NULL : (char *) req->fmt.c_str());
+    _freeRequest(req);
+  }
+}
+
+
+/*********************************************************************
+ * _enqueue
+ *
+ * Hands a request to the writer thread, applying the policy if the
+ * queue is full.
+ */
+
+static void _enqueue(
+  KLT_AsyncWriter aw,
+  _OutputRequest *req)
+{
+  _AsyncWriterState *st = (_AsyncWriterState *) aw->state;
+  _OutputRequest *dropped = NULL;
+
+  {
+    std::unique_lock<std::mutex> guard(st->lock);
+    if ((int) st->queue.size() >= aw->queueLength)  {
+      if (aw->policy == KLT_OUTPUT_DROP_NEWEST)  {
+        dropped = req;
+        req = NULL;
+      } else if (aw->policy == KLT_OUTPUT_DROP_OLDEST)  {
+        dropped = st->queue.front();
+        st->queue.pop_front();
+      } else  {
+        while ((int) st->queue.size() >= aw->queueLength)
+          st->notFull.wait(guard);
+      }
+      if (dropped != NULL)  st->nDropped++;
+    }
+    if (req != NULL)  {
+      st->queue.push_back(req);
+      st->notEmpty.notify_one();
+    }
+  }
+
+  if (dropped != NULL)  _freeRequest(dropped);
+}
+
+
+static _OutputRequest *_snapshot(
+  KLT_FeatureList fl)
+{
+  _OutputRequest *req = new _OutputRequest;
+  int i;
+
+  req->fl = KLTCreateFeatureList(fl->nFeatures);
+  for (i = 0 ; i < fl->nFeatures ; i++)  {
+    req->fl->feature[i]->x = fl->feature[i]->x;
+    req->fl->feature[i]->y = fl->feature[i]->y;
+    req->fl->feature[i]->val = fl->feature[i]->val;
+  }
+  req->ncols = req->nrows = 0;
+  req->overlay = false;
+  req->binary = false;
+  req->hasFname = req->hasBmpfname = false;
+  return req;
+}
+
+
+/*********************************************************************
+ * KLTCreateAsyncWriter
+ *
+ * Starts a writer thread with a queue of queueLength requests.
+ */
+
+KLT_AsyncWriter KLTCreateAsyncWriter(
+  int queueLength,
+  int policy)
+{
+  KLT_AsyncWriter aw;
+  _AsyncWriterState *st;
+
+  if (queueLength < 1)
+    KLTError("(KLTCreateAsyncWriter) Queue length must be at least 1, "
+             "not %d", queueLength);
+  if (policy != KLT_OUTPUT_WAIT && policy != KLT_OUTPUT_DROP_NEWEST &&
+      policy != KLT_OUTPUT_DROP_OLDEST)
+    KLTError("(KLTCreateAsyncWriter) Unknown queue policy %d", policy);
+
+  aw = (KLT_AsyncWriter) malloc(sizeof(KLT_AsyncWriterRec));
+  if (aw == NULL)
+    KLTError("(KLTCreateAsyncWriter)  Out of memory");
+  st = new _AsyncWriterState;
+  st->busy = false;
+  st->stop = false;
+  st->nDropped = 0;
+
+  aw->queueLength = queueLength;
+  aw->policy = policy;
+  aw->state = st;
+  st->thread = std::thread(_writerLoop, st);
+
+  return aw;
+}
+
+
+/*********************************************************************
+ * KLTWriteFeatureListAsync
+ * KLTWriteFeatureListToPPMandBMPAsync
+ *
+ * Same as KLTWriteFeatureList and KLTWriteFeatureListToPPMandBMP,
+ * but return once the data are copied.  fl and greyimg may be
+ * changed right away.  A NULL name means the same as there (stderr
+ * for the feature list, no file for an overlay).
+ */
+
+void KLTWriteFeatureListAsync(
+  KLT_AsyncWriter aw,
+  KLT_FeatureList fl,
+  char *fname,
+  char *fmt)
+{
+  _OutputRequest *req = _snapshot(fl);
+
+  req->hasFname = (fname != NULL);
+  if (fname != NULL)  req->fname = fname;
+  req->binary = (fmt == NULL);
+  if (fmt != NULL)  req->fmt = fmt;
+  _enqueue(aw, req);
+}
+
+
+void KLTWriteFeatureListToPPMandBMPAsync(
+  KLT_AsyncWriter aw,
+  KLT_FeatureList fl,
+  KLT_PixelType *greyimg,
+  int ncols,
+  int nrows,
+  char *fname,
+  char *bmpfname)
+{
+  _OutputRequest *req = _snapshot(fl);
+
+  req->overlay = true;
+  req->ncols = ncols;
+  req->nrows = nrows;
+  req->img.assign(greyimg, greyimg + (size_t) ncols * nrows);
+  req->hasFname = (fname != NULL);
+  req->hasBmpfname = (bmpfname != NULL);
+  if (fname != NULL)  req->fname = fname;
+  if (bmpfname != NULL)  req->bmpfname = bmpfname;
+  _enqueue(aw, req);
+}
+
+
+/*********************************************************************
+ * KLTFlushAsyncWriter
+ *
+ * Waits until every queued request has been written.
+ */
+
+void KLTFlushAsyncWriter(
+  KLT_AsyncWriter aw)
+{
+  _AsyncWriterState *st = (_AsyncWriterState *) aw->state;
+  std::unique_lock<std::mutex> guard(st->lock);
+
+  while (!st->queue.empty() || st->busy)
+    st->idle.wait(guard);
+}
+
+
+/*********************************************************************
+ * KLTCountDroppedOutputs
+ *
+ * Returns the number of requests dropped because the queue was full.
+ */
+
+int KLTCountDroppedOutputs(
+  KLT_AsyncWriter aw)
+{
+  _AsyncWriterState *st = (_AsyncWriterState *) aw->state;
+  std::lock_guard<std::mutex> guard(st->lock);
+
+  return st->nDropped;
+}
+
+
+/*********************************************************************
+ * KLTFreeAsyncWriter
+ *
+ * Writes what is still queued, then stops the thread.
+ */
+
+void KLTFreeAsyncWriter(
+  KLT_AsyncWriter aw)
+{
+  _AsyncWriterState *st = (_AsyncWriterState *) aw->state;
+
+  {
+    std::lock_guard<std::mutex> guard(st->lock);
+    st->stop = true;
+    st->notEmpty.notify_one();
+  }
+  st->thread.join();
+
+  delete st;
+  free(aw);
+}
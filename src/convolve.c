@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdlib.h>   /* malloc(), realloc() */
+#include <string.h>   /* memset() */
 
 /* Our includes */
 #include "base.h"
@@ -31,25 +32,32 @@ static float sigma_last = -10.0;
  * _KLTToFloatImage
  *
  * Given a pointer to image data (probably unsigned chars), copy
- * data to a float image.
+ * data to a float image.  Rows of img are stride pixels apart.
  */
 
 void _KLTToFloatImage(
   KLT_PixelType *img,
   int ncols, int nrows,
+  int stride,
   _KLT_FloatImage floatimg)
 {
-  KLT_PixelType *ptrend = img + ncols*nrows;
-  float *ptrout = floatimg->data;
+  KLT_PixelType *ptr;
+  float *ptrout;
+  int i, j;
 
   /* Output image must be large enough to hold result */
   assert(floatimg->ncols >= ncols);
   assert(floatimg->nrows >= nrows);
+  assert(stride >= ncols);
 
   floatimg->ncols = ncols;
   floatimg->nrows = nrows;
 
-  while (img < ptrend)  *ptrout++ = (float) *img++;
+  for (j = 0 ; j < nrows ; j++)  {
+    ptr = img + (size_t) j * stride;
+    ptrout = floatimg->data + j * floatimg->stride;
+    for (i = 0 ; i < ncols ; i++)  *ptrout++ = (float) *ptr++;
+  }
 }
 
 
@@ -140,7 +148,7 @@ static void _convolveImageHoriz(
   _KLT_FloatImage imgout)
 {
   float *ptrrow = imgin->data;           /* Points to row's first pixel */
-  register float *ptrout = imgout->data, /* Points to next output pixel */
+  register float *ptrout,                /* Points to next output pixel */
     *ppp;
   register float sum;
   register int radius = kernel.width / 2;
@@ -159,6 +167,7 @@ static void _convolveImageHoriz(
 
   /* For each row, do ... */
   for (j = 0 ; j < nrows ; j++)  {
+    ptrout = imgout->data + j * imgout->stride;
 
     /* Zero leftmost columns */
     for (i = 0 ; i < radius ; i++)
@@ -177,7 +186,7 @@ static void _convolveImageHoriz(
     for ( ; i < ncols ; i++)
       *ptrout++ = 0.0;
 
-    ptrrow += ncols;
+    ptrrow += imgin->stride;
   }
 }
 
@@ -192,11 +201,12 @@ static void _convolveImageVert(
   _KLT_FloatImage imgout)
 {
   float *ptrcol = imgin->data;            /* Points to row's first pixel */
-  register float *ptrout = imgout->data,  /* Points to next output pixel */
+  register float *ptrout,                 /* Points to next output pixel */
     *ppp;
   register float sum;
   register int radius = kernel.width / 2;
   register int ncols = imgin->ncols, nrows = imgin->nrows;
+  register int instride = imgin->stride, outstride = imgout->stride;
   register int i, j, k;
 
   /* Kernel width must be odd */
@@ -211,33 +221,33 @@ static void _convolveImageVert(
 
   /* For each column, do ... */
   for (i = 0 ; i < ncols ; i++)  {
+    ptrout = imgout->data + i;
 
     /* Zero topmost rows */
     for (j = 0 ; j < radius ; j++)  {
       *ptrout = 0.0;
-      ptrout += ncols;
+      ptrout += outstride;
     }
 
     /* Convolve middle rows with kernel */
     for ( ; j < nrows - radius ; j++)  {
-      ppp = ptrcol + ncols * (j - radius);
+      ppp = ptrcol + instride * (j - radius);
       sum = 0.0;
       for (k = kernel.width-1 ; k >= 0 ; k--)  {
         sum += *ppp * kernel.data[k];
-        ppp += ncols;
+        ppp += instride;
       }
       *ptrout = sum;
-      ptrout += ncols;
+      ptrout += outstride;
     }
 
     /* Zero bottommost rows */
     for ( ; j < nrows ; j++)  {
       *ptrout = 0.0;
-      ptrout += ncols;
+      ptrout += outstride;
     }
 
     ptrcol++;
-    ptrout -= nrows * ncols - 1;
   }
 }
 
@@ -293,6 +303,104 @@ void _KLTComputeGradients(
 }
 	
 
+/*********************************************************************
+ * _KLTToSmoothedFloatImage
+ *
+ * Same result as _KLTToFloatImage followed by _KLTComputeSmoothedImage
+ * (up to the rounding of the kernel to fixed point), but convolves the
+ * 8-bit image directly with 16-bit integer taps and emits the smoothed
+ * float image in a single pass.  Horizontally filtered rows are kept in
+ * a ring buffer of kernel-width rows, so no full-size float
+ * intermediate is needed.  Rows of img are stride pixels apart.
+ */
+
+#define KLT_KERNEL_FRACBITS 15
+
+void _KLTToSmoothedFloatImage(
+  KLT_PixelType *img,
+  int ncols, int nrows,
+  int stride,
+  float sigma,
+  _KLT_FloatImage smooth)
+{
+  int ikernel[MAX_KERNEL_WIDTH];   /* horizontal taps, sum = 2^FRACBITS */
+  float vkernel[MAX_KERNEL_WIDTH]; /* vertical taps, rescaled */
+  int *ring, *rowout;
+  KLT_PixelType *ppp;
+  float *ptrout;
+  float sum;
+  int isum, width, radius, center;
+  int i, j, k, y;
+
+  /* Output image must be large enough to hold result */
+  assert(smooth->ncols >= ncols);
+  assert(smooth->nrows >= nrows);
+  assert(stride >= ncols);
+  assert(sizeof(KLT_PixelType) == 1);
+
+  smooth->ncols = ncols;
+  smooth->nrows = nrows;
+
+  /* Compute kernel, if necessary; gauss_deriv is not used */
+  if (fabs(sigma - sigma_last) > 0.05)
+    _computeKernels(sigma, &gauss_kernel, &gaussderiv_kernel);
+
+  width = gauss_kernel.width;
+  radius = width / 2;
+  center = radius;
+  assert(width % 2 == 1);
+
+  /* Round kernel to fixed point, putting any rounding residue into */
+  /* the center tap so that flat regions are reproduced exactly */
+  isum = 0;
+  for (k = 0 ; k < width ; k++)  {
+    ikernel[k] = (int) (gauss_kernel.data[k] * (1 << KLT_KERNEL_FRACBITS) + 0.5f);
+    isum += ikernel[k];
+  }
+  ikernel[center] += (1 << KLT_KERNEL_FRACBITS) - isum;
+  for (k = 0 ; k < width ; k++)
+    vkernel[k] = gauss_kernel.data[k] / (1 << KLT_KERNEL_FRACBITS);
+
+  /* Zero whole output; only the interior is written below, exactly */
+  /* as the separable float convolution leaves zeros at the border */
+  memset(smooth->data, 0, (size_t) smooth->stride * nrows * sizeof(float));
+  if (ncols < width || nrows < width)  return;
+
+  ring = (int *) malloc(width * ncols * sizeof(int));
+  if (ring == NULL)
+    KLTError("(_KLTToSmoothedFloatImage) Out of memory");
+
+  for (y = 0 ; y < nrows ; y++)  {
+
+    /* Convolve row y horizontally into its slot of the ring */
+    rowout = ring + (y % width) * ncols;
+    for (i = radius ; i < ncols - radius ; i++)  {
+      ppp = img + (size_t) y * stride + i - radius;
+      isum = 0;
+      for (k = width-1 ; k >= 0 ; k--)
+        isum += *ppp++ * ikernel[k];
+      rowout[i] = isum;
+    }
+
+    /* Once enough rows are available, convolve vertically to */
+    /* produce output row j */
+    j = y - 2*radius;
+    if (j < 0)  continue;
+    ptrout = smooth->data + (j + radius) * smooth->stride;
+    for (i = radius ; i < ncols - radius ; i++)  {
+      sum = 0.0;
+      for (k = width-1 ; k >= 0 ; k--)
+        sum += ring[((j + width-1-k) % width) * ncols + i] * vkernel[k];
+      ptrout[i] = sum;
+    }
+  }
+
+  free(ring);
+}
+
+#undef KLT_KERNEL_FRACBITS
+
+
 /*********************************************************************
  * _KLTComputeSmoothedImage
  */
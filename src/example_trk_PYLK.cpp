@@ -36,6 +36,7 @@ int RunExample_trk_PYLK(int argc, char* argv[])
 		unsigned char *img1, *img2;
 		KLT_TrackingContext tc;
 		KLT_FeatureList fl;
+		KLT_AsyncWriter aw;
 		int nFeatures = 100;
 		int ncols, nrows;
 		
@@ -68,8 +69,8 @@ int RunExample_trk_PYLK(int argc, char* argv[])
 			strcpy(fltype_1, ".bmp");
 
 			//vsԣǲbatűexe޸·ɣ"../../pic/"
-			img1 = bmpGrayReadFile("../pic/1.bmp", NULL, &ncols, &nrows);
-			img2 = bmpGrayReadFile("../pic/2.bmp", NULL, &ncols, &nrows);
+			img1 = bmpReadFileGrey("../pic/1.bmp", NULL, &ncols, &nrows, NULL);
+			img2 = bmpReadFileGrey("../pic/2.bmp", NULL, &ncols, &nrows, NULL);
 		}
 		//ļ.bmp/.pgm
 		else if (argc == 3){
@@ -104,8 +105,8 @@ int RunExample_trk_PYLK(int argc, char* argv[])
 
 			if (0 == strcmp(fltype_1, ".bmp"))
 			{				
-				img1 = bmpGrayReadFile(argv[1], NULL, &ncols, &nrows);
-				img2 = bmpGrayReadFile(argv[2], NULL, &ncols, &nrows);
+				img1 = bmpReadFileGrey(argv[1], NULL, &ncols, &nrows, NULL);
+				img2 = bmpReadFileGrey(argv[2], NULL, &ncols, &nrows, NULL);
 			}
 			else if (0 == strcmp(fltype_1, ".pgm"))
 			{				
@@ -141,11 +142,13 @@ int RunExample_trk_PYLK(int argc, char* argv[])
 			//KLTError("create output dir failed\n");
 			return 0;
 		}
+		//ļɺ̨߳дٲȴ
+		aw = KLTCreateAsyncWriter(4, KLT_OUTPUT_WAIT);
 		sprintf(out_ppmfile, "%s/%s_feat.ppm", dir_result, fileName_1);
 		sprintf(out_bmpfile, "%s/%s_feat.bmp", dir_result, fileName_1);
-		KLTWriteFeatureListToPPMandBMP(fl, img1, ncols, nrows, out_ppmfile, out_bmpfile); // "pic/1.ppm");
+		KLTWriteFeatureListToPPMandBMPAsync(aw, fl, img1, ncols, nrows, out_ppmfile, out_bmpfile); // "pic/1.ppm");
 		sprintf(out_feature, "%s/%s_feat.txt", dir_result, fileName_1);
-		KLTWriteFeatureList(fl, out_feature, "%3d");
+		KLTWriteFeatureListAsync(aw, fl, out_feature, "%3d");
 
 		//ýLKimg2׷㣺img2ƥ䵽img1ϡ
 		KLTTrackFeatures(tc, img1, img2, ncols, nrows, fl, dir_result,fileName_1, fileName_2);
@@ -160,9 +163,10 @@ int RunExample_trk_PYLK(int argc, char* argv[])
 
 		sprintf(out_ppmfile, "%s/%s_feat_trked.ppm", dir_result, fileName_2);
 		sprintf(out_bmpfile, "%s/%s_feat_trked.bmp", dir_result, fileName_2);
-		KLTWriteFeatureListToPPMandBMP(fl, img2, ncols, nrows, out_ppmfile, out_bmpfile);
+		KLTWriteFeatureListToPPMandBMPAsync(aw, fl, img2, ncols, nrows, out_ppmfile, out_bmpfile);
 		sprintf(out_feature, "%s/%s_feat_trked.txt", dir_result, fileName_2);
-		KLTWriteFeatureList(fl, out_feature, "%5.1f");  // text file  
+		KLTWriteFeatureListAsync(aw, fl, out_feature, "%5.1f");  // text file  
+		KLTFreeAsyncWriter(aw);	//деļ
 		
 		if (img1 != NULL)
 			free(img1);
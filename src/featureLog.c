@@ -0,0 +1,636 @@
+/*********************************************************************
+ * featureLog.c
+ *
+ * Append-only feature logs, for sequences too long to hold in a
+ * KLT_FeatureTable.  Each frame's feature list is appended as one
+ * record, so that writing needs the same memory whatever the length
+ * of the sequence, and any frame or feature history can be read
+ * back later without loading the rest.
+ *
+ * File layout (all numbers little-endian):
+ *
+ *   header:  "KLTLG1\0\0", nFeatures (int32), keyframeInterval (int32)
+ *   records: type (1 byte), frame (uint32), length (uint32), payload
+ *   trailer: "KLTLGEND", last checkpoint offset (uint64), nFrames (int32)
+ *
+ * Record types are
+ *
+ *   'K'  keyframe:  x, y (float) and val (int32) of every feature
+ *   'D'  delta:     the bits of x, y and val of every feature XORed
+ *                   with those of the previous frame, as varints
+ *   'C'  checkpoint: offset of the previous checkpoint (uint64, 0 if
+ *                   none), count (uint32), and count pairs of keyframe
+ *                   number (uint32) and offset (uint64)
+ *
+ * Every keyframeInterval-th frame is a keyframe, and a checkpoint
+ * lists the keyframes since the one before it.  A reader follows the
+ * checkpoints back from the trailer; if the trailer is missing (the
+ * writer did not close the log) it scans the records instead, and
+ * ignores a truncated last record.
+ *********************************************************************/
+
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64	/* fseeko() beyond 2 GB */
+#endif
+
+/* Standard includes */
+#include <stdio.h>		/* fopen(), fread(), fwrite() */
+#include <stdlib.h>		/* malloc() */
+#include <string.h>		/* memcpy(), memcmp() */
+#ifndef _WIN32
+#include <sys/types.h>		/* off_t */
+#endif
+
+/* Our includes */
+#include "base.h"
+#include "error.h"
+#include "klt.h"
+
+#define LOGHEADERLENGTH		16
+#define LOGTRAILERLENGTH	20
+#define LOGRECORDHEADER		9
+#define LOGCHECKPOINT		16	/* keyframes listed per checkpoint */
+#define LOGMAXVARINT		5	/* bytes of a varint-coded uint32 */
+
+extern int KLT_verbose;
+
+static char logheader[8] = "KLTLG1\0";
+static char logtrailer[8] = {'K', 'L', 'T', 'L', 'G', 'E', 'N', 'D'};
+
+typedef unsigned int uint32;
+typedef long long int64;
+
+typedef struct  {
+  FILE *fp;
+  KLT_BOOL writing;
+  uint32 *cur;		/* x, y, val bits of frame 'frame', per feature */
+  unsigned char *record;	/* one record's payload */
+  int frame;		/* frame held in cur, or -1 */
+  int nKeys;		/* keyframes in the index */
+  int maxKeys;
+  int *keyFrame;	/* writer: since the last checkpoint; reader: all */
+  int64 *keyOffset;
+  int64 lastCheckpoint;	/* writer only */
+}  _FeatureLogState;
+
+
+/*********************************************************************
+ * Byte helpers
+ */
+
+static void _put32(
+  unsigned char *p,
+  uint32 u)
+{
+  p[0] = (unsigned char) u;
+  p[1] = (unsigned char) (u >> 8);
+  p[2] = (unsigned char) (u >> 16);
+  p[3] = (unsigned char) (u >> 24);
+}
+
+static uint32 _get32(
+  const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+static void _put64(
+  unsigned char *p,
+  int64 u)
+{
+  _put32(p, (uint32) u);
+  _put32(p + 4, (uint32) (u >> 32));
+}
+
+static int64 _get64(
+  const unsigned char *p)
+{
+  return (int64) _get32(p) | ((int64) _get32(p + 4) << 32);
+}
+
+
+static int64 _tellLog(
+  FILE *fp)
+{
+#ifdef _WIN32
+  return _ftelli64(fp);
+#else
+  return (int64) ftello(fp);
+#endif
+}
+
+static void _seekLog(
+  FILE *fp,
+  int64 offset)
+{
+#ifdef _WIN32
+  _fseeki64(fp, offset, SEEK_SET);
+#else
+  fseeko(fp, (off_t) offset, SEEK_SET);
+#endif
+}
+
+
+static void _addKey(
+  _FeatureLogState *st,
+  int frame,
+  int64 offset)
+{
+  if (st->nKeys == st->maxKeys)  {
+    st->maxKeys = (st->maxKeys > 0) ? 2 * st->maxKeys : LOGCHECKPOINT;
+    st->keyFrame = (int *) realloc(st->keyFrame, st->maxKeys * sizeof(int));
+    st->keyOffset = (int64 *) realloc(st->keyOffset,
+                                      st->maxKeys * sizeof(int64));
+    if (st->keyFrame == NULL || st->keyOffset == NULL)
+      KLTError("(KLTFeatureLog)  Out of memory");
+  }
+  st->keyFrame[st->nKeys] = frame;
+  st->keyOffset[st->nKeys] = offset;
+  st->nKeys++;
+}
+
+
+static KLT_FeatureLog _createLog(
+  FILE *fp,
+  int nFeatures,
+  int keyframeInterval,
+  KLT_BOOL writing)
+{
+  KLT_FeatureLog log;
+  _FeatureLogState *st;
+  int n = (nFeatures > 0) ? nFeatures : 1;
+
+  log = (KLT_FeatureLog) malloc(sizeof(KLT_FeatureLogRec));
+  st = (_FeatureLogState *) calloc(1, sizeof(_FeatureLogState));
+  if (log == NULL || st == NULL)
+    KLTError("(KLTFeatureLog)  Out of memory");
+  st->fp = fp;
+  st->writing = writing;
+  st->frame = -1;
+  st->cur = (uint32 *) calloc(3 * n, sizeof(uint32));
+  st->record = (unsigned char *) malloc(3 * LOGMAXVARINT * n);
+  if (st->cur == NULL || st->record == NULL)
+    KLTError("(KLTFeatureLog)  Out of memory");
+
+  log->nFrames = 0;
+  log->nFeatures = nFeatures;
+  log->keyframeInterval = keyframeInterval;
+  log->state = st;
+  return log;
+}
+
+
+/*********************************************************************
+ * _writeRecord
+ */
+
+static void _writeRecord(
+  FILE *fp,
+  char type,
+  int frame,
+  const unsigned char *payload,
+  int length)
+{
+  unsigned char header[LOGRECORDHEADER];
+
+  header[0] = (unsigned char) type;
+  _put32(header + 1, (uint32) frame);
+  _put32(header + 5, (uint32) length);
+  if (fwrite(header, 1, LOGRECORDHEADER, fp) != LOGRECORDHEADER ||
+      fwrite(payload, 1, length, fp) != (size_t) length)
+    KLTError("(KLTAppendFeatureLog)  Can't write to feature log");
+}
+
+
+/* Lists the keyframes since the last checkpoint, and flushes the */
+/* file, so that everything up to here survives a crash */
+static void _writeCheckpoint(
+  KLT_FeatureLog log)
+{
+  _FeatureLogState *st = (_FeatureLogState *) log->state;
+  unsigned char *payload;
+  int64 offset = _tellLog(st->fp);
+  int length = 12 + 12 * st->nKeys;
+  int k;
+
+  payload = (unsigned char *) malloc(length);
+  if (payload == NULL)
+    KLTError("(KLTAppendFeatureLog)  Out of memory");
+  _put64(payload, st->lastCheckpoint);
+  _put32(payload + 8, (uint32) st->nKeys);
+  for (k = 0 ; k < st->nKeys ; k++)  {
+    _put32(payload + 12 + 12*k, (uint32) st->keyFrame[k]);
+    _put64(payload + 16 + 12*k, st->keyOffset[k]);
+  }
+  _writeRecord(st->fp, 'C', log->nFrames, payload, length);
+  free(payload);
+
+  st->lastCheckpoint = offset;
+  st->nKeys = 0;
+  fflush(st->fp);
+}
+
+
+/*********************************************************************
+ * KLTCreateFeatureLog
+ *
+ * Creates a log for lists of nFeatures features.  Every
+ * keyframeInterval-th frame is stored whole, and the others as
+ * deltas from the frame before; an interval of 1 stores every frame
+ * whole.
+ */
+
+KLT_FeatureLog KLTCreateFeatureLog(
+  char *fname,
+  int nFeatures,
+  int keyframeInterval)
+{
+  FILE *fp;
+  unsigned char header[LOGHEADERLENGTH];
+
+  if (nFeatures < 0)
+    KLTError("(KLTCreateFeatureLog) Bad number of features: %d", nFeatures);
+  if (keyframeInterval < 1)
+    KLTError("(KLTCreateFeatureLog) Keyframe interval must be at least 1, "
+             "not %d", keyframeInterval);
+  if (KLT_verbose >= 1)
+    fprintf(stderr, "(KLT) Writing feature log to '%s'\n", fname);
+
+  fp = fopen(fname, "wb");
+  if (fp == NULL)
+    KLTError("(KLTCreateFeatureLog) Can't open file '%s' for writing", fname);
+
+  memcpy(header, logheader, 8);
+  _put32(header + 8, (uint32) nFeatures);
+  _put32(header + 12, (uint32) keyframeInterval);
+  if (fwrite(header, 1, LOGHEADERLENGTH, fp) != LOGHEADERLENGTH)
+    KLTError("(KLTCreateFeatureLog) Can't write to file '%s'", fname);
+
+  return _createLog(fp, nFeatures, keyframeInterval, TRUE);
+}
+
+
+/*********************************************************************
+ * KLTAppendFeatureLog
+ *
+ * Appends fl as the next frame of the log.
+ */
+
+void KLTAppendFeatureLog(
+  KLT_FeatureLog log,
+  KLT_FeatureList fl)
+{
+  _FeatureLogState *st = (_FeatureLogState *) log->state;
+  unsigned char *p = st->record;
+  KLT_BOOL key = (log->nFrames % log->keyframeInterval == 0);
+  uint32 bits[3], delta;
+  int j, k;
+
+  if (!st->writing)
+    KLTError("(KLTAppendFeatureLog) The feature log was opened for reading");
+  if (fl->nFeatures != log->nFeatures)
+    KLTError("(KLTAppendFeatureLog) The feature list passed "
+             "does not contain the same number of features as "
+             "the feature log (%d vs. %d)", fl->nFeatures, log->nFeatures);
+
+  if (key)  {
+    if (st->nKeys == LOGCHECKPOINT)  _writeCheckpoint(log);
+    _addKey(st, log->nFrames, _tellLog(st->fp));
+  }
+
+  for (j = 0 ; j < fl->nFeatures ; j++)  {
+    memcpy(&bits[0], &(fl->feature[j]->x), 4);
+    memcpy(&bits[1], &(fl->feature[j]->y), 4);
+    memcpy(&bits[2], &(fl->feature[j]->val), 4);
+    for (k = 0 ; k < 3 ; k++)  {
+      if (key)  {
+        _put32(p, bits[k]);
+        p += 4;
+      } else  {
+        /* Coordinates that barely moved share their high bits */
+        delta = bits[k] ^ st->cur[3*j+k];
+        while (delta >= 0x80)  {
+          *p++ = (unsigned char) (delta | 0x80);
+          delta >>= 7;
+        }
+        *p++ = (unsigned char) delta;
+      }
+      st->cur[3*j+k] = bits[k];
+    }
+  }
+  _writeRecord(st->fp, key ? 'K' : 'D', log->nFrames,
+               st->record, (int) (p - st->record));
+  st->frame = log->nFrames;
+  log->nFrames++;
+}
+
+
+/*********************************************************************
+ * KLTOpenFeatureLog
+ *
+ * Opens a log for KLTReadFeatureLogFrame and KLTReadFeatureLogHistory.
+ * Only the keyframe index is kept in memory.
+ */
+
+/* Reads the index from the checkpoints; returns FALSE if the log */
+/* has no trailer */
+static KLT_BOOL _readCheckpoints(
+  KLT_FeatureLog log,
+  int64 size)
+{
+  _FeatureLogState *st = (_FeatureLogState *) log->state;
+  unsigned char trailer[LOGTRAILERLENGTH];
+  unsigned char header[LOGRECORDHEADER + 12], *payload;
+  int64 offset;
+  int count, length, k;
+
+  if (size < LOGHEADERLENGTH + LOGTRAILERLENGTH)  return FALSE;
+  _seekLog(st->fp, size - LOGTRAILERLENGTH);
+  if (fread(trailer, 1, LOGTRAILERLENGTH, st->fp) != LOGTRAILERLENGTH ||
+      memcmp(trailer, logtrailer, 8) != 0)
+    return FALSE;
+  offset = _get64(trailer + 8);
+  log->nFrames = (int) _get32(trailer + 16);
+
+  /* Walk back from the last checkpoint, collecting keyframes */
+  /* newest first */
+  while (offset != 0)  {
+    _seekLog(st->fp, offset);
+    if (fread(header, 1, LOGRECORDHEADER + 12, st->fp) !=
+        LOGRECORDHEADER + 12 || header[0] != 'C')
+      KLTError("(KLTOpenFeatureLog) Feature log is corrupted -- "
+               "(No checkpoint at offset %.0f)", (double) offset);
+    offset = _get64(header + LOGRECORDHEADER);
+    count = (int) _get32(header + LOGRECORDHEADER + 8);
+    length = 12 * count;
+    payload = (unsigned char *) malloc(length > 0 ? length : 1);
+    if (payload == NULL)
+      KLTError("(KLTOpenFeatureLog)  Out of memory");
+    if (fread(payload, 1, length, st->fp) != (size_t) length)
+      KLTError("(KLTOpenFeatureLog) Feature log is corrupted -- "
+               "(Truncated checkpoint)");
+    for (k = count - 1 ; k >= 0 ; k--)
+      _addKey(st, (int) _get32(payload + 12*k), _get64(payload + 4 + 12*k));
+    free(payload);
+  }
+
+  /* Put them oldest first */
+  for (k = 0 ; k < st->nKeys / 2 ; k++)  {
+    int f = st->keyFrame[k];
+    int64 o = st->keyOffset[k];
+    st->keyFrame[k] = st->keyFrame[st->nKeys-1-k];
+    st->keyOffset[k] = st->keyOffset[st->nKeys-1-k];
+    st->keyFrame[st->nKeys-1-k] = f;
+    st->keyOffset[st->nKeys-1-k] = o;
+  }
+  return TRUE;
+}
+
+
+/* Builds the index by reading every record header */
+static void _scanRecords(
+  KLT_FeatureLog log,
+  int64 size)
+{
+  _FeatureLogState *st = (_FeatureLogState *) log->state;
+  unsigned char header[LOGRECORDHEADER];
+  int64 offset = LOGHEADERLENGTH;
+  int64 length;
+  int frame;
+
+  for ( ; ; )  {
+    _seekLog(st->fp, offset);
+    if (fread(header, 1, LOGRECORDHEADER, st->fp) != LOGRECORDHEADER)
+      break;
+    frame = (int) _get32(header + 1);
+    length = _get32(header + 5);
+    if (offset + LOGRECORDHEADER + length > size)
+      break;
+    if (header[0] == 'K' || header[0] == 'D')  {
+      if (frame != log->nFrames)
+        KLTError("(KLTOpenFeatureLog) Feature log is corrupted -- "
+                 "(Expected frame %d, found %d)", log->nFrames, frame);
+      if (header[0] == 'K')  _addKey(st, frame, offset);
+      log->nFrames++;
+    } else if (header[0] != 'C')
+      break;	/* the trailer, or garbage left by a crash */
+    offset += LOGRECORDHEADER + length;
+  }
+}
+
+
+KLT_FeatureLog KLTOpenFeatureLog(
+  char *fname)
+{
+  FILE *fp;
+  KLT_FeatureLog log;
+  _FeatureLogState *st;
+  unsigned char header[LOGHEADERLENGTH];
+  int64 size;
+
+  if (KLT_verbose >= 1)
+    fprintf(stderr, "(KLT) Reading feature log from '%s'\n", fname);
+  fp = fopen(fname, "rb");
+  if (fp == NULL)
+    KLTError("(KLTOpenFeatureLog) Can't open file '%s' for reading", fname);
+  if (fread(header, 1, LOGHEADERLENGTH, fp) != LOGHEADERLENGTH ||
+      memcmp(header, logheader, 8) != 0)
+    KLTError("(KLTOpenFeatureLog) File '%s' is not a feature log", fname);
+
+  log = _createLog(fp, (int) _get32(header + 8), (int) _get32(header + 12),
+                   FALSE);
+  st = (_FeatureLogState *) log->state;
+
+  fseek(fp, 0, SEEK_END);
+  size = _tellLog(fp);
+  if (!_readCheckpoints(log, size))  {
+    if (KLT_verbose >= 1)
+      fprintf(stderr, "(KLT) Feature log '%s' was not closed; "
+              "scanning it\n", fname);
+    log->nFrames = 0;
+    st->nKeys = 0;
+    _scanRecords(log, size);
+  }
+  if (log->nFrames > 0 && (st->nKeys == 0 || st->keyFrame[0] != 0))
+    KLTError("(KLTOpenFeatureLog) Feature log '%s' is corrupted -- "
+             "(Frame 0 is not a keyframe)", fname);
+
+  return log;
+}
+
+
+/*********************************************************************
+ * _decodeFrame
+ *
+ * Brings frame into st->cur, starting from the nearest keyframe
+ * before it unless the frame held already is on the way.
+ */
+
+static void _readRecord(
+  KLT_FeatureLog log,
+  const char *caller)
+{
+  _FeatureLogState *st = (_FeatureLogState *) log->state;
+  unsigned char header[LOGRECORDHEADER];
+  unsigned char *p, *end;
+  uint32 length, delta;
+  int shift, j;
+
+  /* Skip checkpoints */
+  do  {
+    if (fread(header, 1, LOGRECORDHEADER, st->fp) != LOGRECORDHEADER)
+      KLTError("%s Feature log is corrupted -- (Truncated record)", caller);
+    length = _get32(header + 5);
+    if (header[0] == 'C')  fseek(st->fp, (long) length, SEEK_CUR);
+  } while (header[0] == 'C');
+
+  if ((header[0] != 'K' && header[0] != 'D') ||
+      length > (uint32) (3 * LOGMAXVARINT * log->nFeatures) ||
+      fread(st->record, 1, length, st->fp) != length)
+    KLTError("%s Feature log is corrupted -- (Bad record)", caller);
+  if ((int) _get32(header + 1) != st->frame + 1)
+    KLTError("%s Feature log is corrupted -- (Frame %d follows %d)",
+             caller, (int) _get32(header + 1), st->frame);
+
+  p = st->record;
+  end = p + length;
+  if (header[0] == 'K')  {
+    if (length != 12 * (uint32) log->nFeatures)
+      KLTError("%s Feature log is corrupted -- (Bad keyframe)", caller);
+    for (j = 0 ; j < 3 * log->nFeatures ; j++, p += 4)
+      st->cur[j] = _get32(p);
+  } else  {
+    for (j = 0 ; j < 3 * log->nFeatures ; j++)  {
+      delta = 0;
+      shift = 0;
+      do  {
+        if (p == end || shift > 28)
+          KLTError("%s Feature log is corrupted -- (Bad delta)", caller);
+        delta |= (uint32) (*p & 0x7f) << shift;
+        shift += 7;
+      } while (*p++ & 0x80);
+      st->cur[j] ^= delta;
+    }
+  }
+  st->frame = (int) _get32(header + 1);
+}
+
+
+static void _decodeFrame(
+  KLT_FeatureLog log,
+  int frame,
+  const char *caller)
+{
+  _FeatureLogState *st = (_FeatureLogState *) log->state;
+  int lo = 0, hi = st->nKeys - 1, mid;
+
+  if (st->writing)
+    KLTError("%s The feature log was created for writing", caller);
+  if (frame < 0 || frame >= log->nFrames)
+    KLTError("%s Frame %d is not in the log (%d frames)",
+             caller, frame, log->nFrames);
+
+  /* Last keyframe at or before frame */
+  while (lo < hi)  {
+    mid = (lo + hi + 1) / 2;
+    if (st->keyFrame[mid] <= frame)  lo = mid;
+    else  hi = mid - 1;
+  }
+
+  if (st->frame < st->keyFrame[lo] || st->frame > frame)  {
+    _seekLog(st->fp, st->keyOffset[lo]);
+    st->frame = st->keyFrame[lo] - 1;
+  }
+  while (st->frame < frame)
+    _readRecord(log, caller);
+}
+
+
+/*********************************************************************
+ * KLTReadFeatureLogFrame
+ *
+ * Reads one frame of the log into fl.  Reading frames in increasing
+ * order decodes each record once.
+ */
+
+void KLTReadFeatureLogFrame(
+  KLT_FeatureLog log,
+  int frame,
+  KLT_FeatureList fl)
+{
+  _FeatureLogState *st = (_FeatureLogState *) log->state;
+  int j;
+
+  if (fl->nFeatures != log->nFeatures)
+    KLTError("(KLTReadFeatureLogFrame) The feature list passed "
+             "does not contain the same number of features as "
+             "the feature log (%d vs. %d)", fl->nFeatures, log->nFeatures);
+
+  _decodeFrame(log, frame, "(KLTReadFeatureLogFrame)");
+  for (j = 0 ; j < log->nFeatures ; j++)  {
+    memcpy(&(fl->feature[j]->x), &(st->cur[3*j]), 4);
+    memcpy(&(fl->feature[j]->y), &(st->cur[3*j+1]), 4);
+    memcpy(&(fl->feature[j]->val), &(st->cur[3*j+2]), 4);
+  }
+}
+
+
+/*********************************************************************
+ * KLTReadFeatureLogHistory
+ *
+ * Reads the history of one feature over fh->nFrames frames, starting
+ * at firstFrame, into fh.
+ */
+
+void KLTReadFeatureLogHistory(
+  KLT_FeatureLog log,
+  int feature,
+  int firstFrame,
+  KLT_FeatureHistory fh)
+{
+  _FeatureLogState *st = (_FeatureLogState *) log->state;
+  int i;
+
+  if (feature < 0 || feature >= log->nFeatures)
+    KLTError("(KLTReadFeatureLogHistory) Feature %d is not in the log "
+             "(%d features)", feature, log->nFeatures);
+
+  for (i = 0 ; i < fh->nFrames ; i++)  {
+    _decodeFrame(log, firstFrame + i, "(KLTReadFeatureLogHistory)");
+    memcpy(&(fh->feature[i]->x), &(st->cur[3*feature]), 4);
+    memcpy(&(fh->feature[i]->y), &(st->cur[3*feature+1]), 4);
+    memcpy(&(fh->feature[i]->val), &(st->cur[3*feature+2]), 4);
+  }
+}
+
+
+/*********************************************************************
+ * KLTCloseFeatureLog
+ *
+ * Closes a log; one being written gets its last checkpoint and
+ * trailer.
+ */
+
+void KLTCloseFeatureLog(
+  KLT_FeatureLog log)
+{
+  _FeatureLogState *st = (_FeatureLogState *) log->state;
+  unsigned char trailer[LOGTRAILERLENGTH];
+
+  if (st->writing)  {
+    _writeCheckpoint(log);
+    memcpy(trailer, logtrailer, 8);
+    _put64(trailer + 8, st->lastCheckpoint);
+    _put32(trailer + 16, (uint32) log->nFrames);
+    if (fwrite(trailer, 1, LOGTRAILERLENGTH, st->fp) != LOGTRAILERLENGTH)
+      KLTError("(KLTCloseFeatureLog)  Can't write to feature log");
+  }
+  fclose(st->fp);
+
+  free(st->cur);
+  free(st->record);
+  free(st->keyFrame);
+  free(st->keyOffset);
+  free(st);
+  free(log);
+}
@@ -11,6 +11,7 @@
 void _KLTToFloatImage(
   KLT_PixelType *img,
   int ncols, int nrows,
+  int stride,
   _KLT_FloatImage floatimg);
 
 void _KLTComputeGradients(
@@ -24,6 +25,13 @@ void _KLTGetKernelWidths(
   int *gauss_width,
   int *gaussderiv_width);
 
+void _KLTToSmoothedFloatImage(
+  KLT_PixelType *img,
+  int ncols, int nrows,
+  int stride,
+  float sigma,
+  _KLT_FloatImage smooth);
+
 void _KLTComputeSmoothedImage(
   _KLT_FloatImage img,
   float sigma,
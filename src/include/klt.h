@@ -10,6 +10,7 @@ extern "C" {
 #ifndef _KLT_H_
 #define _KLT_H_
 
+#include <stddef.h>	/* size_t */
 
 
 
@@ -33,6 +34,12 @@ typedef unsigned char KLT_PixelType;
 #define KLT_MAX_ITERATIONS   -3
 #define KLT_OOB              -4
 #define KLT_LARGE_RESIDUE    -5
+#define KLT_LARGE_FB_ERROR   -6
+
+/* What an asynchronous writer does when its queue is full */
+#define KLT_OUTPUT_WAIT         0
+#define KLT_OUTPUT_DROP_NEWEST  1
+#define KLT_OUTPUT_DROP_OLDEST  2
 
 #include "klt_util.h" /* for affine mapping */
 
@@ -44,6 +51,9 @@ typedef struct  {
   /* Available to user */
 	int Count_Feature_Former;//ҪʾǰN㣨ڽ,ͼ·"./pic/pyramid"
   int mindist;			/* min distance b/w features */
+  int gridCellSize;		/* if positive, select features per grid cell of this size */
+  int featuresPerCell;		/* max. features per grid cell (0 = spread nFeatures evenly) */
+  KLT_BOOL incrementalReplace;	/* whether replacing only searches the regions that lost their features */
   int window_width, window_height;
   KLT_BOOL sequentialMode;	/* whether to save most recent image to save time */
   /* can set to TRUE manually, but don't set to */
@@ -53,6 +63,9 @@ typedef struct  {
   KLT_BOOL writeInternalImages;	/* whether to write internal images */
   /* tracking features */
   KLT_BOOL lighting_insensitive;  /* whether to normalize for gain and bias (not in original algorithm) */
+  KLT_BOOL fixedPointPyramids;  /* whether to store pyramids as 16-bit fixed point while tracking */
+  KLT_BOOL forwardBackwardCheck;  /* whether to track each feature back to the first image */
+  KLT_BOOL adaptivePyramidLevels;  /* whether to choose the pyramid levels to track at per feature */
   
   /* Available, but hopefully can ignore */
   int min_eigenvalue;		/* smallest eigenvalue allowed for selecting */
@@ -60,6 +73,7 @@ typedef struct  {
   float min_displacement;	/* th for stopping tracking when pixel changes little */
   int max_iterations;		/* th for stopping tracking when too many iterations */
   float max_residue;		/* th for stopping tracking when residue is large */
+  float max_fb_error;		/* th for forward-backward distance, in pixels */
   float grad_sigma;
   float smooth_sigma_fact;
   float pyramid_sigma_fact;
@@ -89,6 +103,9 @@ typedef struct  {
   void *pyramid_last;
   void *pyramid_last_gradx;
   void *pyramid_last_grady;
+  void *feature_index;		/* features by location, kept between selections */
+  float motion_estimate;	/* expected displacement from the last call (-1 if unknown) */
+  int nLevelsSaved;		/* # of pyramid levels skipped by features tracked in the last call */
 }  KLT_TrackingContextRec, *KLT_TrackingContext;
 
 
@@ -106,11 +123,22 @@ typedef struct  {
   KLT_locType aff_Ayx;
   KLT_locType aff_Axy;
   KLT_locType aff_Ayy;
+  /* predicted location in the next image (-1 if none); used */
+  /* as the starting guess by the next call to KLTTrackFeatures */
+  KLT_locType pred_x;
+  KLT_locType pred_y;
+  /* last location of a feature lost by KLTTrackFeatures (-1 if */
+  /* none); incremental replacement rescans the tile around it */
+  KLT_locType lost_x;
+  KLT_locType lost_y;
 }  KLT_FeatureRec, *KLT_Feature;
 
 typedef struct  {
   int nFeatures;
   KLT_Feature *feature;
+  /* for affine mapping: slots for aff_img and its gradients */
+  /* (user must not touch) */
+  _KLT_TemplatePool aff_pool;
 }  KLT_FeatureListRec, *KLT_FeatureList;
 
 typedef struct  {
@@ -124,6 +152,74 @@ typedef struct  {
   KLT_Feature **feature;
 }  KLT_FeatureTableRec, *KLT_FeatureTable;
 
+/* A feature table that keeps only x, y and val, in one block with */
+/* the features of each frame next to each other: feature j of frame */
+/* i is cell[i*nFeatures + j] */
+typedef struct  {
+  KLT_locType x;
+  KLT_locType y;
+  int val;
+}  KLT_FeatureCell;
+
+typedef struct  {
+  int nFrames;
+  int nFeatures;
+  KLT_FeatureCell *cell;
+}  KLT_CompactFeatureTableRec, *KLT_CompactFeatureTable;
+
+/* A KLTFT2 feature table file, mapped into memory for random */
+/* access (see KLTOpenFeatureTableFile) */
+typedef struct  {
+  int nFrames;
+  int nFeatures;
+  /* User must not touch these */
+  const unsigned char *data;
+  size_t size;
+  int columnBytes;
+  void *file;
+  void *mapping;
+}  KLT_FeatureTableFileRec, *KLT_FeatureTableFile;
+
+/* An append-only log of feature lists, written and read one frame */
+/* at a time (see KLTCreateFeatureLog) */
+typedef struct  {
+  int nFrames;
+  int nFeatures;
+  int keyframeInterval;
+  /* User must not touch this */
+  void *state;
+}  KLT_FeatureLogRec, *KLT_FeatureLog;
+
+/* A thread writing feature files and images in the background */
+/* (see KLTCreateAsyncWriter) */
+typedef struct  {
+  int queueLength;	/* max # of requests waiting */
+  int policy;		/* KLT_OUTPUT_WAIT, _DROP_NEWEST or _DROP_OLDEST */
+  /* User must not touch this */
+  void *state;
+}  KLT_AsyncWriterRec, *KLT_AsyncWriter;
+
+/* An image smoothed, downsampled and differentiated once, for both */
+/* selecting and tracking (see KLTPrepareImage) */
+typedef struct  {
+  int ncols, nrows;
+  /* parameters it was computed with */
+  int nPyramidLevels;
+  int subsampling;
+  float smooth_sigma;
+  float grad_sigma;
+  float pyramid_sigma_fact;
+  /* User must not touch these */
+  void *pyramid;
+  void *pyramid_gradx;
+  void *pyramid_grady;
+  /* level 0 as floats, for selection, if the pyramids are stored */
+  /* in fixed point (see tc->fixedPointPyramids); NULL otherwise */
+  void *select_img;
+  void *select_gradx;
+  void *select_grady;
+}  KLT_PreparedImageRec, *KLT_PreparedImage;
+
 
 
 /*******************
@@ -139,6 +235,20 @@ KLT_FeatureHistory KLTCreateFeatureHistory(
 KLT_FeatureTable KLTCreateFeatureTable(
   int nFrames,
   int nFeatures);
+KLT_CompactFeatureTable KLTCreateCompactFeatureTable(
+  int nFrames,
+  int nFeatures);
+KLT_PreparedImage KLTPrepareImage(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img,
+  int ncols,
+  int nrows);
+KLT_PreparedImage KLTPrepareImageStrided(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img,
+  int ncols,
+  int nrows,
+  int stride);
 
 /* Free */
 void KLTFreeTrackingContext(
@@ -149,6 +259,10 @@ void KLTFreeFeatureHistory(
   KLT_FeatureHistory fh);
 void KLTFreeFeatureTable(
   KLT_FeatureTable ft);
+void KLTFreeCompactFeatureTable(
+  KLT_CompactFeatureTable ct);
+void KLTFreePreparedImage(
+  KLT_PreparedImage prep);
 
 /* Processing */
 void KLTSelectGoodFeatures(
@@ -173,6 +287,49 @@ void KLTReplaceLostFeatures(
   int ncols,
   int nrows,
   KLT_FeatureList fl);
+void KLTSelectGoodFeaturesPrepared(
+  KLT_TrackingContext tc,
+  KLT_PreparedImage prep,
+  KLT_FeatureList fl);
+void KLTTrackPreparedFeatures(
+	KLT_TrackingContext tc,
+	KLT_PreparedImage prep1,
+	KLT_PreparedImage prep2,
+	KLT_FeatureList featurelist,
+	const char *dir,
+	const char *infilename_1,
+	const char *infilename_2);
+void KLTReplaceLostFeaturesPrepared(
+  KLT_TrackingContext tc,
+  KLT_PreparedImage prep,
+  KLT_FeatureList fl);
+
+/* Processing images whose rows are stride pixels apart */
+void KLTSelectGoodFeaturesStrided(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img,
+  int ncols,
+  int nrows,
+  int stride,
+  KLT_FeatureList fl);
+void KLTTrackFeaturesStrided(
+	KLT_TrackingContext tc,
+	KLT_PixelType *img1,
+	KLT_PixelType *img2,
+	int ncols,
+	int nrows,
+	int stride,
+	KLT_FeatureList featurelist,
+	const char *dir,
+	const char *infilename_1,
+	const char *infilename_2);
+void KLTReplaceLostFeaturesStrided(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img,
+  int ncols,
+  int nrows,
+  int stride,
+  KLT_FeatureList fl);
 
 /* Utilities */
 int KLTCountRemainingFeatures(
@@ -190,6 +347,18 @@ void KLTSetVerbosity(
   int verbosity);
 float _KLTComputeSmoothSigma(
   KLT_TrackingContext tc);
+void _KLTAcquireAffineTemplate(
+  KLT_FeatureList fl,
+  int indx,
+  int ncols,
+  int nrows);
+void _KLTReleaseAffineTemplate(
+  KLT_FeatureList fl,
+  int indx);
+void _KLTCheckPreparedImage(
+  KLT_TrackingContext tc,
+  KLT_PreparedImage prep,
+  const char *caller);
 
 /* Storing/Extracting Features */
 void KLTStoreFeatureList(
@@ -208,6 +377,30 @@ void KLTExtractFeatureHistory(
   KLT_FeatureHistory fh,
   KLT_FeatureTable ft,
   int feat);
+void KLTPredictFeatureList(
+  KLT_FeatureList fl,
+  KLT_FeatureTable ft,
+  int frame);
+void KLTStoreFeatureListCompact(
+  KLT_FeatureList fl,
+  KLT_CompactFeatureTable ct,
+  int frame);
+void KLTExtractFeatureListCompact(
+  KLT_FeatureList fl,
+  KLT_CompactFeatureTable ct,
+  int frame);
+void KLTStoreFeatureHistoryCompact(
+  KLT_FeatureHistory fh,
+  KLT_CompactFeatureTable ct,
+  int feat);
+void KLTExtractFeatureHistoryCompact(
+  KLT_FeatureHistory fh,
+  KLT_CompactFeatureTable ct,
+  int feat);
+void KLTPredictFeatureListCompact(
+  KLT_FeatureList fl,
+  KLT_CompactFeatureTable ct,
+  int frame);
 
 /* Writing/Reading */
 void KLTWriteFeatureListToPPMandBMP(
@@ -217,6 +410,15 @@ void KLTWriteFeatureListToPPMandBMP(
   int nrows,
   char *filename,
   char *bmpfilename);
+void KLTWriteFeatureTrailsToPPMandBMP(
+  KLT_FeatureTable ft,
+  int frame,
+  int nTrail,
+  KLT_PixelType *greyimg,
+  int ncols,
+  int nrows,
+  char *filename,
+  char *bmpfilename);
 void KLTWriteFeatureList(
   KLT_FeatureList fl,
   char *filename,
@@ -238,6 +440,67 @@ KLT_FeatureHistory KLTReadFeatureHistory(
 KLT_FeatureTable KLTReadFeatureTable(
   KLT_FeatureTable ft,
   char *filename);
+void KLTWriteFeatureTableColumnar(
+  KLT_FeatureTable ft,
+  char *filename);
+KLT_FeatureTableFile KLTOpenFeatureTableFile(
+  char *filename);
+void KLTReadFeatureTableFrame(
+  KLT_FeatureTableFile tf,
+  int frame,
+  KLT_FeatureList fl);
+void KLTReadFeatureTableHistory(
+  KLT_FeatureTableFile tf,
+  int feature,
+  KLT_FeatureHistory fh);
+void KLTCloseFeatureTableFile(
+  KLT_FeatureTableFile tf);
+
+/* Feature logs */
+KLT_FeatureLog KLTCreateFeatureLog(
+  char *filename,
+  int nFeatures,
+  int keyframeInterval);
+void KLTAppendFeatureLog(
+  KLT_FeatureLog log,
+  KLT_FeatureList fl);
+KLT_FeatureLog KLTOpenFeatureLog(
+  char *filename);
+void KLTReadFeatureLogFrame(
+  KLT_FeatureLog log,
+  int frame,
+  KLT_FeatureList fl);
+void KLTReadFeatureLogHistory(
+  KLT_FeatureLog log,
+  int feature,
+  int firstFrame,
+  KLT_FeatureHistory fh);
+void KLTCloseFeatureLog(
+  KLT_FeatureLog log);
+
+/* Asynchronous writing */
+KLT_AsyncWriter KLTCreateAsyncWriter(
+  int queueLength,
+  int policy);
+void KLTWriteFeatureListAsync(
+  KLT_AsyncWriter aw,
+  KLT_FeatureList fl,
+  char *filename,
+  char *fmt);
+void KLTWriteFeatureListToPPMandBMPAsync(
+  KLT_AsyncWriter aw,
+  KLT_FeatureList fl,
+  KLT_PixelType *greyimg,
+  int ncols,
+  int nrows,
+  char *filename,
+  char *bmpfilename);
+void KLTFlushAsyncWriter(
+  KLT_AsyncWriter aw);
+int KLTCountDroppedOutputs(
+  KLT_AsyncWriter aw);
+void KLTFreeAsyncWriter(
+  KLT_AsyncWriter aw);
 
 #endif
 
@@ -5,16 +5,30 @@
 #ifndef _KLT_UTIL_H_
 #define _KLT_UTIL_H_
 
+/* Rows of images made by _KLTCreateFloatImage start on this boundary */
+#define KLT_ROW_ALIGNMENT	64
+
 typedef struct  {
   int ncols;
   int nrows;
+  int stride;		/* pixels from one row to the next (at least ncols) */
   float *data;
+  /* for 16-bit fixed-point storage (data is NULL when fixdata is set) */
+  short *fixdata;
+  float fixstep;	/* value of one fixed-point unit */
 }  _KLT_FloatImageRec, *_KLT_FloatImage;
 
 _KLT_FloatImage _KLTCreateFloatImage(
   int ncols, 
   int nrows);
 
+_KLT_FloatImage _KLTToFixedPointImage(
+  _KLT_FloatImage floatimg);
+
+float _KLTGetFloatImagePixel(
+  _KLT_FloatImage img,
+  int offset);
+
 void _KLTFreeFloatImage(
   _KLT_FloatImage);
 	
@@ -29,6 +43,64 @@ void _KLTWriteFloatImageToPGM(
   char *bmpflname);
 
 /* for affine mapping */
+typedef struct  {
+  int ncols, nrows;	/* size of each image */
+  int nslots;
+  int nfree;
+  int *freelist;	/* stack of free slot indices */
+  char *slab;		/* nslots slots of an image and its two gradients */
+  int imgbytes;		/* bytes per image, record included */
+}  _KLT_TemplatePoolRec, *_KLT_TemplatePool;
+
+_KLT_TemplatePool _KLTCreateTemplatePool(
+  int nslots,
+  int ncols,
+  int nrows);
+
+void _KLTFreeTemplatePool(
+  _KLT_TemplatePool pool);
+
+void _KLTAcquireTemplate(
+  _KLT_TemplatePool pool,
+  _KLT_FloatImage *img,
+  _KLT_FloatImage *gradx,
+  _KLT_FloatImage *grady);
+
+void _KLTReleaseTemplate(
+  _KLT_TemplatePool pool,
+  _KLT_FloatImage img);
+
+/* for selecting features: features by grid cell, for checking mindist */
+typedef struct  {
+  int ncols, nrows;	/* size of image */
+  int mindist;
+  int cellsize;		/* side of a cell (mindist, at least one) */
+  int ncellx, ncelly;
+  int nslots;		/* one entry per feature list slot */
+  int *head;		/* first slot in each cell, or -1 */
+  int *next;		/* next slot in the same cell, or -1 */
+  int *cell;		/* cell of each slot, or -1 if empty */
+  int *x, *y;		/* location of each slot */
+}  _KLT_FeatureIndexRec, *_KLT_FeatureIndex;
+
+_KLT_FeatureIndex _KLTCreateFeatureIndex(
+  int ncols,
+  int nrows,
+  int mindist,
+  int nslots);
+
+void _KLTFreeFeatureIndex(
+  _KLT_FeatureIndex index);
+
+void _KLTMoveFeatureInIndex(
+  _KLT_FeatureIndex index,
+  int indx,
+  int x, int y);
+
+int _KLTIsCloseToFeature(
+  _KLT_FeatureIndex index,
+  int x, int y);
+
 void _KLTWriteAbsFloatImageToPGM(
   _KLT_FloatImage img,
   char *filename,float scale);
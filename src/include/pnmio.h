@@ -60,6 +60,19 @@ void ppmWrite(
   int ncols,
   int nrows);
 
+/**********
+ * Reads the header of a PGM/PPM image, leaving fp at the first pixel
+ */
+void pnmReadHeader(
+  FILE *fp,
+  int *magic,
+  int *ncols, int *nrows,
+  int *maxval);
+void pnmReadHeaderRest(	/* after the magic number */
+  FILE *fp,
+  int *ncols, int *nrows,
+  int *maxval);
+
 int WriteRGBBMP_Head(FILE *BMPfp, int ImageWidth, int ImageHeight, PixelType pxlTyp);
 int WriteGrayBMP_Head(FILE *BMPfp, int ImageWidth, int ImageHeight, PixelType pxlTyp);
 void bmpWrite(
@@ -76,6 +89,21 @@ void bmpWriteFileRGB(
 	unsigned char *blueimg,
 	int ncols,
 	int nrows);
+/**********
+ * Write an image already laid out as the file stores it: ppm, RGB
+ * rows top-down; bmp, BGR rows bottom-up, each padded to a multiple
+ * of 4 bytes
+ */
+void ppmWriteFileInterleaved(
+	char *fname,
+	unsigned char *rgb,
+	int ncols,
+	int nrows);
+void bmpWriteFileInterleaved(
+	char *fname,
+	unsigned char *bgr,
+	int ncols,
+	int nrows);
 void bmpGrayWriteFile(
 	char *fname,
 	unsigned char *img,
@@ -85,6 +113,16 @@ unsigned char *bmpGrayReadFile(
 	char *fname,
 	unsigned char *img,
 	int *ncols, int *nrows);
+void bmpReadHeaderFile(
+	char *fname,
+	int *ncols,
+	int *nrows);
+unsigned char *bmpReadFileGrey(
+	char *fname,
+	unsigned char *img,
+	int *ncols,
+	int *nrows,
+	int *stride);
 #endif
 
 #ifdef __cplusplus
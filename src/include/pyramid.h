@@ -21,11 +21,30 @@ _KLT_Pyramid _KLTCreatePyramid(
   int subsampling,
   int nlevels);
 
+_KLT_Pyramid _KLTCreateEmptyPyramid(
+  int ncols,
+  int nrows,
+  int subsampling,
+  int nlevels);
+
 void _KLTComputePyramid(
   _KLT_FloatImage floatimg, 
   _KLT_Pyramid pyramid,
   float sigma_fact);
 
+void _KLTToFixedPointPyramid(
+  _KLT_Pyramid pyramid);
+
+void _KLTComputeFixedPointPyramids(
+  _KLT_FloatImage img,
+  _KLT_FloatImage gradx0,
+  _KLT_FloatImage grady0,
+  float sigma_fact,
+  float grad_sigma,
+  _KLT_Pyramid pyramid,
+  _KLT_Pyramid pyramid_gradx,
+  _KLT_Pyramid pyramid_grady);
+
 void _KLTFreePyramid(
   _KLT_Pyramid pyramid);
 
@@ -0,0 +1,45 @@
+/*********************************************************************
+ * trackKernels.h
+ *********************************************************************/
+
+#ifndef _TRACKKERNELS_H_
+#define _TRACKKERNELS_H_
+
+#include "klt_util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Window kernels of the translational tracker, for one window size */
+typedef struct  {
+  void (*gradientMatrixAndErrorVector)(
+    _KLT_FloatImage img1, _KLT_FloatImage gradx1, _KLT_FloatImage grady1,
+    _KLT_FloatImage img2, _KLT_FloatImage gradx2, _KLT_FloatImage grady2,
+    float x1, float y1, float x2, float y2,
+    float step_factor,
+    float *gxx, float *gxy, float *gyy, float *ex, float *ey);
+  float (*residue)(
+    _KLT_FloatImage img1, _KLT_FloatImage img2,
+    float x1, float y1, float x2, float y2);
+  /* the same, with the windows of img1 already sampled */
+  void (*gradientMatrixAndErrorVectorFromTemplate)(
+    const float *tmpl, const float *tmpl_gradx, const float *tmpl_grady,
+    _KLT_FloatImage img2, _KLT_FloatImage gradx2, _KLT_FloatImage grady2,
+    float x2, float y2,
+    float step_factor,
+    float *gxx, float *gxy, float *gyy, float *ex, float *ey);
+  float (*residueFromTemplate)(
+    const float *tmpl, _KLT_FloatImage img2,
+    float x2, float y2);
+}  _KLT_WindowKernelsRec, *_KLT_WindowKernels;
+
+_KLT_WindowKernels _KLTGetWindowKernels(
+  int width,
+  int height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+/*********************************************************************
+ * videoReader.h
+ *********************************************************************/
+
+#ifndef _VIDEOREADER_H_
+#define _VIDEOREADER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum  {
+  VIDEO_AUTO,		/* Y4M or PGM from the file's magic, else raw */
+  VIDEO_RAW_GREY8,	/* headerless 8-bit frames of a given size */
+  VIDEO_Y4M,		/* YUV4MPEG2; only the luma plane is kept */
+  VIDEO_PGM		/* P5 images one after another */
+}  VideoFormat;
+
+/**********
+ * A video file read one frame at a time into a ring of buffers.
+ * The last nHeld frames returned by videoReadFrame stay valid;
+ * with readAhead > 0, a thread decodes up to readAhead frames
+ * ahead of the caller.
+ */
+typedef struct  {
+  int ncols, nrows;
+  VideoFormat format;
+  int nFramesRead;	/* frames returned so far */
+  /* User must not touch this */
+  void *state;
+}  VideoReaderRec, *VideoReader;
+
+VideoReader videoOpenFile(
+  char *fname,
+  VideoFormat format,
+  int ncols,		/* frame size; only needed for raw files */
+  int nrows,
+  int nHeld,
+  int readAhead);
+unsigned char *videoReadFrame(
+  VideoReader vr);	/* returns NULL at the end of the file */
+void videoCloseFile(
+  VideoReader vr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,18 +18,25 @@
 
 static const int Count_Feature_Former = 1;
 static const int mindist = 10;
+static const int gridCellSize = 0;
+static const int featuresPerCell = 0;
+static const KLT_BOOL incrementalReplace = FALSE;
 static const int window_size = 7;
 static const int min_eigenvalue = 1;
 static const float min_determinant = 0.01f;
 static const float min_displacement = 0.1f;
 static const int max_iterations = 10;
 static const float max_residue = 10.0f;
+static const float max_fb_error = 1.0f;
 static const float grad_sigma = 1.0f;
 static const float smooth_sigma_fact = 0.1f;
 static const float pyramid_sigma_fact = 0.9f;
 static const float step_factor = 1.0f;
 static const KLT_BOOL sequentialMode = FALSE;
 static const KLT_BOOL lighting_insensitive = FALSE;
+static const KLT_BOOL fixedPointPyramids = FALSE;
+static const KLT_BOOL forwardBackwardCheck = FALSE;
+static const KLT_BOOL adaptivePyramidLevels = FALSE;
 /* for affine mapping*/
 static const int affineConsistencyCheck = -1;
 static const int affine_window_size = 15;
@@ -97,17 +104,24 @@ KLT_TrackingContext KLTCreateTrackingContext()
   /* Set values to default values */
   tc->Count_Feature_Former = Count_Feature_Former;
   tc->mindist = mindist;
+  tc->gridCellSize = gridCellSize;
+  tc->featuresPerCell = featuresPerCell;
+  tc->incrementalReplace = incrementalReplace;
   tc->window_width = window_size;
   tc->window_height = window_size;
   tc->sequentialMode = sequentialMode;
   tc->smoothBeforeSelecting = smoothBeforeSelecting;
   tc->writeInternalImages = writeInternalImages;
   tc->lighting_insensitive = lighting_insensitive;
+  tc->fixedPointPyramids = fixedPointPyramids;
+  tc->forwardBackwardCheck = forwardBackwardCheck;
+  tc->adaptivePyramidLevels = adaptivePyramidLevels;
   tc->min_eigenvalue = min_eigenvalue;
   tc->min_determinant = min_determinant;
   tc->max_iterations = max_iterations;
   tc->min_displacement = min_displacement;
   tc->max_residue = max_residue;
+  tc->max_fb_error = max_fb_error;
   tc->grad_sigma = grad_sigma;
   tc->smooth_sigma_fact = smooth_sigma_fact;
   tc->pyramid_sigma_fact = pyramid_sigma_fact;
@@ -116,6 +130,9 @@ KLT_TrackingContext KLTCreateTrackingContext()
   tc->pyramid_last = NULL;
   tc->pyramid_last_gradx = NULL;
   tc->pyramid_last_grady = NULL;
+  tc->feature_index = NULL;
+  tc->motion_estimate = -1.0f;
+  tc->nLevelsSaved = 0;
   /* for affine mapping */
   tc->affineConsistencyCheck = affineConsistencyCheck;
   tc->affine_window_width = affine_window_size;
@@ -156,6 +173,7 @@ KLT_FeatureList KLTCreateFeatureList(
 	
   /* Set parameters */
   fl->nFeatures = nFeatures; 
+  fl->aff_pool = NULL;
 
   /* Set pointers */
   fl->feature = (KLT_Feature *) (fl + 1);
@@ -165,12 +183,68 @@ KLT_FeatureList KLTCreateFeatureList(
     fl->feature[i]->aff_img = NULL;           /* initialization fixed by Sinisa Segvic */
     fl->feature[i]->aff_img_gradx = NULL;
     fl->feature[i]->aff_img_grady = NULL;
+    fl->feature[i]->pred_x = -1.0;
+    fl->feature[i]->pred_y = -1.0;
+    fl->feature[i]->lost_x = -1.0;
+    fl->feature[i]->lost_y = -1.0;
   }
   /* Return feature list */
   return(fl);
 }
 
 
+/*********************************************************************
+ * _KLTAcquireAffineTemplate
+ * _KLTReleaseAffineTemplate
+ *
+ * Give a feature an image window and two gradient windows of size
+ * ncols by nrows for affine mapping, and take them back.  The windows
+ * come from the feature list's pool, which has a slot per feature and
+ * is created on first use.  Releasing a feature without windows does
+ * nothing.
+ */
+
+void _KLTAcquireAffineTemplate(
+  KLT_FeatureList fl,
+  int indx,
+  int ncols,
+  int nrows)
+{
+  KLT_Feature f = fl->feature[indx];
+
+  if (f->aff_img)
+    _KLTReleaseAffineTemplate(fl, indx);
+
+  /* The pool can only be resized when no feature holds windows */
+  if (fl->aff_pool &&
+      (fl->aff_pool->ncols != ncols || fl->aff_pool->nrows != nrows))  {
+    if (fl->aff_pool->nfree != fl->aff_pool->nslots)
+      KLTError("(_KLTAcquireAffineTemplate)  Affine window size changed "
+               "while features are being tracked with affine mapping");
+    _KLTFreeTemplatePool(fl->aff_pool);
+    fl->aff_pool = NULL;
+  }
+  if (fl->aff_pool == NULL)
+    fl->aff_pool = _KLTCreateTemplatePool(fl->nFeatures, ncols, nrows);
+
+  _KLTAcquireTemplate(fl->aff_pool, &f->aff_img, &f->aff_img_gradx,
+                      &f->aff_img_grady);
+}
+
+void _KLTReleaseAffineTemplate(
+  KLT_FeatureList fl,
+  int indx)
+{
+  KLT_Feature f = fl->feature[indx];
+
+  if (f->aff_img)
+    _KLTReleaseTemplate(fl->aff_pool, f->aff_img);
+  f->aff_img = NULL;
+  f->aff_img_gradx = NULL;
+  f->aff_img_grady = NULL;
+}
+
+
 /*********************************************************************
  * KLTCreateFeatureHistory
  *
@@ -237,6 +311,35 @@ KLT_FeatureTable KLTCreateFeatureTable(
 }
 
 
+/*********************************************************************
+ * KLTCreateCompactFeatureTable
+ *
+ * Twelve bytes per cell, against the full KLT_FeatureRec and pointer
+ * of KLTCreateFeatureTable.
+ */
+
+KLT_CompactFeatureTable KLTCreateCompactFeatureTable(
+  int nFrames,
+  int nFeatures)
+{
+  KLT_CompactFeatureTable ct;
+  size_t ncells = (size_t) nFrames * nFeatures;
+
+  ct = (KLT_CompactFeatureTable) malloc(sizeof(KLT_CompactFeatureTableRec));
+  if (ct == NULL)
+    KLTError("(KLTCreateCompactFeatureTable)  Out of memory");
+  ct->nFrames = nFrames;
+  ct->nFeatures = nFeatures;
+  ct->cell = (KLT_FeatureCell *)
+    calloc(ncells > 0 ? ncells : 1, sizeof(KLT_FeatureCell));
+  if (ct->cell == NULL)
+    KLTError("(KLTCreateCompactFeatureTable)  Out of memory for %d frames "
+             "of %d features", nFrames, nFeatures);
+
+  return(ct);
+}
+
+
 /*********************************************************************
  * KLTPrintTrackingContext
  */
@@ -246,6 +349,10 @@ void KLTPrintTrackingContext(
 {
   fprintf(stderr, "\n\nTracking context:\n\n");
   fprintf(stderr, "\tmindist = %d\n", tc->mindist);
+  fprintf(stderr, "\tgridCellSize = %d\n", tc->gridCellSize);
+  fprintf(stderr, "\tfeaturesPerCell = %d\n", tc->featuresPerCell);
+  fprintf(stderr, "\tincrementalReplace = %s\n",
+          tc->incrementalReplace ? "TRUE" : "FALSE");
   fprintf(stderr, "\twindow_width = %d\n", tc->window_width);
   fprintf(stderr, "\twindow_height = %d\n", tc->window_height);
   fprintf(stderr, "\tsequentialMode = %s\n",
@@ -254,12 +361,19 @@ void KLTPrintTrackingContext(
           tc->smoothBeforeSelecting ? "TRUE" : "FALSE");
   fprintf(stderr, "\twriteInternalImages = %s\n",
           tc->writeInternalImages ? "TRUE" : "FALSE");
+  fprintf(stderr, "\tfixedPointPyramids = %s\n",
+          tc->fixedPointPyramids ? "TRUE" : "FALSE");
+  fprintf(stderr, "\tforwardBackwardCheck = %s\n",
+          tc->forwardBackwardCheck ? "TRUE" : "FALSE");
+  fprintf(stderr, "\tadaptivePyramidLevels = %s\n",
+          tc->adaptivePyramidLevels ? "TRUE" : "FALSE");
 
   fprintf(stderr, "\tmin_eigenvalue = %d\n", tc->min_eigenvalue);
   fprintf(stderr, "\tmin_determinant = %f\n", tc->min_determinant);
   fprintf(stderr, "\tmin_displacement = %f\n", tc->min_displacement);
   fprintf(stderr, "\tmax_iterations = %d\n", tc->max_iterations);
   fprintf(stderr, "\tmax_residue = %f\n", tc->max_residue);
+  fprintf(stderr, "\tmax_fb_error = %f\n", tc->max_fb_error);
   fprintf(stderr, "\tgrad_sigma = %f\n", tc->grad_sigma);
   fprintf(stderr, "\tsmooth_sigma_fact = %f\n", tc->smooth_sigma_fact);
   fprintf(stderr, "\tpyramid_sigma_fact = %f\n", tc->pyramid_sigma_fact);
@@ -437,6 +551,8 @@ void KLTUpdateTCBorder(
  * KLTFreeFeatureList
  * KLTFreeFeatureHistory
  * KLTFreeFeatureTable
+ * KLTFreeCompactFeatureTable
+ * KLTFreePreparedImage
  */
 
 void KLTFreeTrackingContext(
@@ -448,23 +564,17 @@ void KLTFreeTrackingContext(
     _KLTFreePyramid((_KLT_Pyramid) tc->pyramid_last_gradx);
   if (tc->pyramid_last_grady)  
     _KLTFreePyramid((_KLT_Pyramid) tc->pyramid_last_grady);
+  if (tc->feature_index)
+    _KLTFreeFeatureIndex((_KLT_FeatureIndex) tc->feature_index);
   free(tc);
 }
 
 void KLTFreeFeatureList(
   KLT_FeatureList fl)
 {
-  /* for affine mapping */
-  int indx;
-  for (indx = 0 ; indx < fl->nFeatures ; indx++)  {
-    /* free image and gradient  */
-    _KLTFreeFloatImage(fl->feature[indx]->aff_img);
-    _KLTFreeFloatImage(fl->feature[indx]->aff_img_gradx);
-    _KLTFreeFloatImage(fl->feature[indx]->aff_img_grady);
-    fl->feature[indx]->aff_img = NULL;
-    fl->feature[indx]->aff_img_gradx = NULL;
-    fl->feature[indx]->aff_img_grady = NULL;
-  }
+  /* for affine mapping: free images and gradients */
+  if (fl->aff_pool)
+    _KLTFreeTemplatePool(fl->aff_pool);
   
   free(fl);
 }
@@ -483,6 +593,27 @@ void KLTFreeFeatureTable(
   free(ft);
 }
 
+void KLTFreeCompactFeatureTable(
+  KLT_CompactFeatureTable ct)
+{
+  free(ct->cell);
+  free(ct);
+}
+
+void KLTFreePreparedImage(
+  KLT_PreparedImage prep)
+{
+  _KLTFreePyramid((_KLT_Pyramid) prep->pyramid);
+  _KLTFreePyramid((_KLT_Pyramid) prep->pyramid_gradx);
+  _KLTFreePyramid((_KLT_Pyramid) prep->pyramid_grady);
+  if (prep->select_img != NULL)  {
+    _KLTFreeFloatImage((_KLT_FloatImage) prep->select_img);
+    _KLTFreeFloatImage((_KLT_FloatImage) prep->select_gradx);
+    _KLTFreeFloatImage((_KLT_FloatImage) prep->select_grady);
+  }
+  free(prep);
+}
+
 
 /*********************************************************************
  * KLTStopSequentialMode
@@ -63,6 +63,24 @@ void pnmReadHeader(
     KLTError("(pnmReadHeader) Magic number does not begin with 'P', "
              "but with a '%c'", line[0]);
   sscanf(line, "P%d", magic);
+
+  pnmReadHeaderRest(fp, ncols, nrows, maxval);
+}
+
+
+/*********************************************************************
+ * pnmReadHeaderRest
+ *
+ * Reads the rest of a header whose magic number has already been
+ * read, e.g. to tell the format of a stream that cannot be rewound.
+ */
+
+void pnmReadHeaderRest(
+  FILE *fp, 
+  int *ncols, int *nrows, 
+  int *maxval)
+{
+  char line[LENGTH];
 	
   /* Read size, skipping comments */
   _getNextString(fp, line);
@@ -545,6 +563,48 @@ void bmpWriteFileRGB(
 	fclose(fp);
 }
 
+/*********************************************************************
+ * ppmWriteFileInterleaved
+ * bmpWriteFileInterleaved
+ *
+ * Write the header, then the pixels in one fwrite().
+ */
+
+void ppmWriteFileInterleaved(
+	char *fname,
+	unsigned char *rgb,
+	int ncols,
+	int nrows)
+{
+	FILE *fp;
+
+	if ((fp = fopen(fname, "wb")) == NULL)
+		KLTError("(ppmWriteFileInterleaved) Can't open file named '%s' for writing\n", fname);
+
+	fprintf(fp, "P6\n%d %d\n255\n", ncols, nrows);
+	fwrite(rgb, 1, (size_t)3 * ncols * nrows, fp);
+
+	fclose(fp);
+}
+
+void bmpWriteFileInterleaved(
+	char *fname,
+	unsigned char *bgr,
+	int ncols,
+	int nrows)
+{
+	FILE *fp;
+	int rowBytes;
+
+	if ((fp = fopen(fname, "wb")) == NULL)
+		KLTError("(bmpWriteFileInterleaved) Can't open file named '%s' for writing\n", fname);
+
+	rowBytes = WriteRGBBMP_Head(fp, ncols, nrows, RGB);
+	fwrite(bgr, 1, (size_t)rowBytes * nrows, fp);
+
+	fclose(fp);
+}
+
 void bmpGrayWriteFile(
 	char *fname,
 	unsigned char *img,
@@ -643,6 +703,249 @@ unsigned char *bmpGrayReadFile(
 }
 
 
+/*********************************************************************
+ * bmpReadFileGrey
+ *
+ * Reads an uncompressed 8-, 24- or 32-bit BMP, bottom-up or top-down,
+ * as grey levels.  Unlike bmpGrayReadFile, ncols is the true width:
+ * the padding at the end of each file row is skipped.
+ */
+
+#define BMPMAXHEADER	124	/* BITMAPV5HEADER */
+
+typedef struct  {
+	int ncols, nrows;
+	bool topDown;
+	int bitCount;
+	long rowBytes;		/* bytes per file row, with padding */
+	int ir, ig, ib;		/* offsets of red, green, blue in a pixel */
+	bool greyPalette;	/* 8-bit palette entry i is grey level i */
+	unsigned char luma[256];	/* 8-bit: grey level of each entry */
+} _BmpInfo;
+
+static unsigned int _le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int _le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/* ITU-R BT.601 weights in 8-bit fixed point; they sum to 256 */
+#define LUMA(r, g, b)	((unsigned char)((77 * (r) + 150 * (g) + 29 * (b) + 128) >> 8))
+
+/* Byte of a 32-bit pixel selected by a BI_BITFIELDS mask */
+static int _maskByte(
+	unsigned int mask,
+	char *fname)
+{
+	for (int k = 0; k < 4; k++)
+		if (mask == 0xFFu << (8 * k))  return k;
+	KLTError("(bmpReadFileGrey) '%s' has a channel mask 0x%08x that is "
+	         "not one whole byte", fname, mask);
+	return 0;
+}
+
+
+static void _bmpReadInfo(
+	FILE *fp,
+	char *fname,
+	_BmpInfo *bi)
+{
+	unsigned char head[14 + BMPMAXHEADER + 12], pal[4 * 256];
+	unsigned int hdrSize, compression, nColors, i;
+	long offBits;
+	int width, height;
+
+	if (fread(head, 1, 18, fp) != 18 || head[0] != 'B' || head[1] != 'M')
+		KLTError("(bmpReadFileGrey) fileType '%s' is not .bmp\n", fname);
+	offBits = _le32(head + 10);
+	hdrSize = _le32(head + 14);
+	if (hdrSize < 40 || hdrSize > BMPMAXHEADER)
+		KLTError("(bmpReadFileGrey) '%s' has an unsupported %u-byte "
+		         "info header", fname, hdrSize);
+	if (fread(head + 18, 1, hdrSize - 4, fp) != hdrSize - 4)
+		KLTError("(bmpReadFileGrey) '%s' is truncated", fname);
+
+	width = (int)_le32(head + 18);
+	height = (int)_le32(head + 22);
+	bi->bitCount = _le16(head + 28);
+	compression = _le32(head + 30);
+	nColors = _le32(head + 46);
+	if (width <= 0 || height == 0)
+		KLTError("(bmpReadFileGrey) The dimensions %d x %d of '%s' are "
+		         "unacceptable", width, height, fname);
+	bi->ncols = width;
+	bi->topDown = (height < 0);
+	bi->nrows = bi->topDown ? -height : height;
+	bi->rowBytes = ((long)width * bi->bitCount + 31) / 32 * 4;
+
+	/* BGR, or BGRX for 32 bits, unless masks say otherwise */
+	bi->ib = 0;  bi->ig = 1;  bi->ir = 2;
+	bi->greyPalette = false;
+
+	if (bi->bitCount == 32 && (compression == 3 || compression == 6))  {
+		/* BI_BITFIELDS: masks follow a 40-byte header, or are in it */
+		if (hdrSize == 40)  {
+			if (fread(head + 54, 1, 12, fp) != 12)
+				KLTError("(bmpReadFileGrey) '%s' is truncated", fname);
+		}
+		bi->ir = _maskByte(_le32(head + 54), fname);
+		bi->ig = _maskByte(_le32(head + 58), fname);
+		bi->ib = _maskByte(_le32(head + 62), fname);
+	} else if (compression != 0)  {
+		KLTError("(bmpReadFileGrey) '%s' is compressed (type %u); only "
+		         "uncompressed BMP is supported", fname, compression);
+	} else if (bi->bitCount == 8)  {
+		/* The palette follows the header */
+		if (nColors == 0 || nColors > 256)  nColors = 256;
+		if (fseek(fp, 14 + hdrSize, SEEK_SET) != 0 ||
+		    fread(pal, 4, nColors, fp) != nColors)
+			KLTError("(bmpReadFileGrey) '%s' has no color table", fname);
+		bi->greyPalette = (nColors == 256);
+		for (i = 0; i < 256; i++)  {
+			bi->luma[i] = (i < nColors) ?
+				LUMA(pal[4*i+2], pal[4*i+1], pal[4*i]) : 0;
+			if (i < nColors && (pal[4*i] != i || pal[4*i+1] != i ||
+			                    pal[4*i+2] != i))
+				bi->greyPalette = false;
+		}
+	} else if (bi->bitCount != 24 && bi->bitCount != 32)  {
+		KLTError("(bmpReadFileGrey) '%s' has %d bits per pixel; only 8, "
+		         "24 and 32 are supported", fname, bi->bitCount);
+	}
+
+	if (fseek(fp, offBits, SEEK_SET) != 0)
+		KLTError("(bmpReadFileGrey) '%s' is truncated", fname);
+}
+
+
+/*********************************************************************
+ * _lumaRow
+ *
+ * Converts one row of step-byte pixels to grey.  Called with constant
+ * arguments for the common layouts, so that the compiler can unroll
+ * and vectorize the loop for each of them.
+ */
+
+static inline void _lumaRow(
+	const unsigned char *src,
+	unsigned char *dst,
+	int ncols,
+	int step,
+	int ir, int ig, int ib)
+{
+	for (int x = 0; x < ncols; x++)  {
+		dst[x] = LUMA(src[ir], src[ig], src[ib]);
+		src += step;
+	}
+}
+
+
+/*********************************************************************
+ * bmpReadHeaderFile
+ *
+ * Returns the true size of a BMP image, so that a buffer can be made
+ * for bmpReadFileGrey.
+ */
+
+void bmpReadHeaderFile(
+	char *fname,
+	int *ncols,
+	int *nrows)
+{
+	FILE *fp;
+	_BmpInfo bi;
+
+	if ((fp = fopen(fname, "rb")) == NULL)
+		KLTError("(bmpReadHeaderFile) Can't open file named '%s' for reading\n", fname);
+	_bmpReadInfo(fp, fname, &bi);
+	*ncols = bi.ncols;
+	*nrows = bi.nrows;
+	fclose(fp);
+}
+
+
+/*********************************************************************
+ * bmpReadFileGrey
+ *
+ * If img is NULL, memory is allocated with rows ncols bytes apart.
+ * Otherwise the rows go *stride bytes apart into img, or ncols apart
+ * if *stride is 0.  *stride is set to the spacing used; stride may
+ * be NULL if it is ncols.
+ */
+
+unsigned char *bmpReadFileGrey(
+	char *fname,
+	unsigned char *img,
+	int *ncols,
+	int *nrows,
+	int *stride)
+{
+	FILE *fp;
+	_BmpInfo bi;
+	unsigned char *ptr, *row = NULL, *dst;
+	long pad;
+	int rowStride, y;
+
+	if ((fp = fopen(fname, "rb")) == NULL)
+		KLTError("(bmpReadFileGrey) Can't open file named '%s' for reading\n", fname);
+	_bmpReadInfo(fp, fname, &bi);
+	*ncols = bi.ncols;
+	*nrows = bi.nrows;
+
+	rowStride = (img != NULL && stride != NULL && *stride > 0) ? *stride : bi.ncols;
+	if (rowStride < bi.ncols)
+		KLTError("(bmpReadFileGrey) Stride %d is less than the width %d "
+		         "of '%s'", rowStride, bi.ncols, fname);
+	if (stride != NULL)  *stride = rowStride;
+
+	if (img == NULL)  {
+		ptr = (unsigned char *)malloc((size_t)bi.ncols * bi.nrows);
+		if (ptr == NULL)
+			KLTError("(bmpReadFileGrey) Memory not allocated");
+	}
+	else
+		ptr = img;
+
+	/* Grey 8-bit rows are read straight into the image; others go
+	 * through one file row and are converted into it */
+	pad = bi.rowBytes - bi.ncols;
+	row = (unsigned char *)malloc(bi.greyPalette ? (pad > 0 ? pad : 1) : bi.rowBytes);
+	if (row == NULL)
+		KLTError("(bmpReadFileGrey) Memory not allocated");
+
+	for (int i = 0; i < bi.nrows; i++)  {
+		y = bi.topDown ? i : bi.nrows - 1 - i;
+		dst = ptr + (size_t)y * rowStride;
+		if (bi.greyPalette)  {
+			if (fread(dst, 1, bi.ncols, fp) != (size_t)bi.ncols ||
+			    fread(row, 1, pad, fp) != (size_t)pad)
+				KLTError("(bmpReadFileGrey) '%s' is truncated", fname);
+			continue;
+		}
+		if (fread(row, 1, bi.rowBytes, fp) != (size_t)bi.rowBytes)
+			KLTError("(bmpReadFileGrey) '%s' is truncated", fname);
+		if (bi.bitCount == 8)
+			for (int x = 0; x < bi.ncols; x++)
+				dst[x] = bi.luma[row[x]];
+		else if (bi.bitCount == 24)
+			_lumaRow(row, dst, bi.ncols, 3, 2, 1, 0);
+		else if (bi.ir == 2 && bi.ig == 1 && bi.ib == 0)
+			_lumaRow(row, dst, bi.ncols, 4, 2, 1, 0);
+		else
+			_lumaRow(row, dst, bi.ncols, 4, bi.ir, bi.ig, bi.ib);
+	}
+
+	free(row);
+	fclose(fp);
+
+	return ptr;
+}
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,10 +17,13 @@
 
 
 /*********************************************************************
+ * _KLTCreateEmptyPyramid
  *
+ * Same as _KLTCreatePyramid, but the levels are left NULL, to be
+ * filled in by _KLTComputeFixedPointPyramids.
  */
 
-_KLT_Pyramid _KLTCreatePyramid(
+_KLT_Pyramid _KLTCreateEmptyPyramid(
   int ncols,
   int nrows,
   int subsampling,
@@ -51,9 +54,9 @@ _KLT_Pyramid _KLTCreatePyramid(
   pyramid->ncols = (int *) (pyramid->img + nlevels);
   pyramid->nrows = (int *) (pyramid->ncols + nlevels);
 
-  /* Allocate memory for each level of pyramid and assign pointers */
+  /* Set the size of each level */
   for (i = 0 ; i < nlevels ; i++)  {
-    pyramid->img[i] =  _KLTCreateFloatImage(ncols, nrows);
+    pyramid->img[i] = NULL;
     pyramid->ncols[i] = ncols;  pyramid->nrows[i] = nrows;
     ncols /= subsampling;  nrows /= subsampling;
   }
@@ -62,6 +65,30 @@ _KLT_Pyramid _KLTCreatePyramid(
 }
 
 
+/*********************************************************************
+ *
+ */
+
+_KLT_Pyramid _KLTCreatePyramid(
+  int ncols,
+  int nrows,
+  int subsampling,
+  int nlevels)
+{
+  _KLT_Pyramid pyramid;
+  int i;
+
+  pyramid = _KLTCreateEmptyPyramid(ncols, nrows, subsampling, nlevels);
+
+  /* Allocate memory for each level of pyramid */
+  for (i = 0 ; i < nlevels ; i++)
+    pyramid->img[i] =  _KLTCreateFloatImage(pyramid->ncols[i],
+                                            pyramid->nrows[i]);
+
+  return pyramid;
+}
+
+
 /*********************************************************************
  *
  */
@@ -80,6 +107,57 @@ void _KLTFreePyramid(
 }
 
 
+/*********************************************************************
+ * _KLTToFixedPointPyramid
+ *
+ * Replaces each level of the pyramid by its 16-bit fixed-point copy.
+ * Levels that are already fixed point are left alone.
+ */
+
+void _KLTToFixedPointPyramid(
+  _KLT_Pyramid pyramid)
+{
+  _KLT_FloatImage fiximg;
+  int i;
+
+  for (i = 0 ; i < pyramid->nLevels ; i++)  {
+    if (pyramid->img[i]->fixdata != NULL)  continue;
+    fiximg = _KLTToFixedPointImage(pyramid->img[i]);
+    _KLTFreeFloatImage(pyramid->img[i]);
+    pyramid->img[i] = fiximg;
+  }
+}
+
+
+/*********************************************************************
+ * _subsampleLevel
+ *
+ * Smooths currimg and subsamples it into nextimg, the next level.
+ */
+
+static void _subsampleLevel(
+  _KLT_FloatImage currimg,
+  int subsampling,
+  float sigma,
+  _KLT_FloatImage nextimg)
+{
+  _KLT_FloatImage tmpimg;
+  int subhalf = subsampling / 2;
+  int x, y;
+
+  tmpimg = _KLTCreateFloatImage(currimg->ncols, currimg->nrows);
+  _KLTComputeSmoothedImage(currimg, sigma, tmpimg);
+
+  for (y = 0 ; y < nextimg->nrows ; y++)
+    for (x = 0 ; x < nextimg->ncols ; x++)
+      nextimg->data[y*nextimg->stride+x] = 
+        tmpimg->data[(subsampling*y+subhalf)*tmpimg->stride +
+                    (subsampling*x+subhalf)];
+
+  _KLTFreeFloatImage(tmpimg);
+}
+
+
 /*********************************************************************
  *
  */
@@ -89,13 +167,11 @@ void _KLTComputePyramid(
   _KLT_Pyramid pyramid,
   float sigma_fact)
 {
-  _KLT_FloatImage currimg, tmpimg;
+  _KLT_FloatImage currimg;
   int ncols = img->ncols, nrows = img->nrows;
   int subsampling = pyramid->subsampling;
-  int subhalf = subsampling / 2;
   float sigma = subsampling * sigma_fact;  /* empirically determined */
-  int oldncols;
-  int i, x, y;
+  int i, y;
 	
   if (subsampling != 2 && subsampling != 4 && 
       subsampling != 8 && subsampling != 16 && subsampling != 32)
@@ -106,27 +182,73 @@ void _KLTComputePyramid(
   assert(pyramid->nrows[0] == img->nrows);
 
   /* Copy original image to level 0 of pyramid */
-  memcpy(pyramid->img[0]->data, img->data, ncols*nrows*sizeof(float));
+  for (y = 0 ; y < nrows ; y++)
+    memcpy(pyramid->img[0]->data + y * pyramid->img[0]->stride,
+           img->data + y * img->stride, ncols*sizeof(float));
 
   currimg = img;
   for (i = 1 ; i < pyramid->nLevels ; i++)  {
-    tmpimg = _KLTCreateFloatImage(ncols, nrows);
-    _KLTComputeSmoothedImage(currimg, sigma, tmpimg);
-
-
-    /* Subsample */
-    oldncols = ncols;
-    ncols /= subsampling;  nrows /= subsampling;
-    for (y = 0 ; y < nrows ; y++)
-      for (x = 0 ; x < ncols ; x++)
-        pyramid->img[i]->data[y*ncols+x] = 
-          tmpimg->data[(subsampling*y+subhalf)*oldncols +
-                      (subsampling*x+subhalf)];
+    _subsampleLevel(currimg, subsampling, sigma, pyramid->img[i]);
 
     /* Reassign current image */
     currimg = pyramid->img[i];
-				
-    _KLTFreeFloatImage(tmpimg);
+  }
+}
+
+
+/*********************************************************************
+ * _KLTComputeFixedPointPyramids
+ *
+ * Computes the pyramid of img and its gradient pyramids, as
+ * _KLTComputePyramid and _KLTComputeGradients do, and stores each
+ * level in 16-bit fixed point as soon as it is done.  Only the float
+ * images of the current level and the next one exist at a time, so
+ * the float pyramids are never held in full.  The pyramids come from
+ * _KLTCreateEmptyPyramid.  gradx0 and grady0 are the gradients of
+ * img if the caller has them already, else NULL.
+ */
+
+void _KLTComputeFixedPointPyramids(
+  _KLT_FloatImage img,
+  _KLT_FloatImage gradx0,
+  _KLT_FloatImage grady0,
+  float sigma_fact,
+  float grad_sigma,
+  _KLT_Pyramid pyramid,
+  _KLT_Pyramid pyramid_gradx,
+  _KLT_Pyramid pyramid_grady)
+{
+  _KLT_FloatImage currimg = img, nextimg, gradx, grady;
+  int subsampling = pyramid->subsampling;
+  float sigma = subsampling * sigma_fact;  /* as in _KLTComputePyramid */
+  int i;
+
+  assert(pyramid->ncols[0] == img->ncols);
+  assert(pyramid->nrows[0] == img->nrows);
+
+  for (i = 0 ; i < pyramid->nLevels ; i++)  {
+    if (i == 0 && gradx0 != NULL)  {
+      pyramid_gradx->img[0] = _KLTToFixedPointImage(gradx0);
+      pyramid_grady->img[0] = _KLTToFixedPointImage(grady0);
+    } else  {
+      gradx = _KLTCreateFloatImage(pyramid->ncols[i], pyramid->nrows[i]);
+      grady = _KLTCreateFloatImage(pyramid->ncols[i], pyramid->nrows[i]);
+      _KLTComputeGradients(currimg, grad_sigma, gradx, grady);
+      pyramid_gradx->img[i] = _KLTToFixedPointImage(gradx);
+      pyramid_grady->img[i] = _KLTToFixedPointImage(grady);
+      _KLTFreeFloatImage(gradx);
+      _KLTFreeFloatImage(grady);
+    }
+
+    nextimg = NULL;
+    if (i + 1 < pyramid->nLevels)  {
+      nextimg = _KLTCreateFloatImage(pyramid->ncols[i+1], pyramid->nrows[i+1]);
+      _subsampleLevel(currimg, subsampling, sigma, nextimg);
+    }
+
+    pyramid->img[i] = _KLTToFixedPointImage(currimg);
+    if (currimg != img)  _KLTFreeFloatImage(currimg);
+    currimg = nextimg;
   }
 }
  
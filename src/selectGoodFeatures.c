@@ -23,6 +23,9 @@ int KLT_verbose = 1;
 
 typedef enum {SELECTING_ALL, REPLACING_SOME} selectionMode;
 
+/* Side of the tiles that incremental replacement rescans */
+#define KLT_REPLACE_TILE 32
+
 
 /*********************************************************************
  * _quicksort
@@ -97,21 +100,33 @@ void _quicksort(int *pointlist, int n)
 #undef SWAP3
 
 
-/*********************************************************************/
+/*********************************************************************
+ * _storeFeature
+ *
+ * Stores a newly selected feature (or KLT_NOT_FOUND) in slot indx,
+ * discarding the slot's affine template and motion prediction.
+ */
 
-static void _fillFeaturemap(
-  int x, int y, 
-  uchar *featuremap, 
-  int mindist, 
-  int ncols, 
-  int nrows)
+static void _storeFeature(
+  KLT_FeatureList featurelist,
+  int indx,
+  int x, int y,
+  int val)
 {
-  int ix, iy;
-
-  for (iy = y - mindist ; iy <= y + mindist ; iy++)
-    for (ix = x - mindist ; ix <= x + mindist ; ix++)
-      if (ix >= 0 && ix < ncols && iy >= 0 && iy < nrows)
-        featuremap[iy*ncols+ix] = 1;
+  featurelist->feature[indx]->x   = (KLT_locType) x;
+  featurelist->feature[indx]->y   = (KLT_locType) y;
+  featurelist->feature[indx]->val = val;
+  _KLTReleaseAffineTemplate(featurelist, indx);
+  featurelist->feature[indx]->aff_x = -1.0;
+  featurelist->feature[indx]->aff_y = -1.0;
+  featurelist->feature[indx]->aff_Axx = 1.0;
+  featurelist->feature[indx]->aff_Ayx = 0.0;
+  featurelist->feature[indx]->aff_Axy = 0.0;
+  featurelist->feature[indx]->aff_Ayy = 1.0;
+  featurelist->feature[indx]->pred_x = -1.0;
+  featurelist->feature[indx]->pred_y = -1.0;
+  featurelist->feature[indx]->lost_x = -1.0;
+  featurelist->feature[indx]->lost_y = -1.0;
 }
 
 
@@ -137,33 +152,27 @@ static void _enforceMinimumDistance(
   int npoints,                 /* number of featurepoints */
   KLT_FeatureList featurelist, /* features */
   int ncols, int nrows,        /* size of images */
-  int mindist,                 /* min. dist b/w features */
+  _KLT_FeatureIndex index,     /* features by location (knows mindist) */
   int min_eigenvalue,          /* min. eigenvalue */
   KLT_BOOL overwriteAllFeatures)
 {
   int indx;          /* Index into features */
   int x, y, val;     /* Location and trackability of pixel under consideration */
-  uchar *featuremap; /* Boolean array recording proximity of features */
   int *ptr;
 	
   /* Cannot add features with an eigenvalue less than one */
   if (min_eigenvalue < 1)  min_eigenvalue = 1;
 
-  /* Allocate memory for feature map and clear it */
-  featuremap = (uchar *) malloc(ncols * nrows * sizeof(uchar));
-  memset(featuremap, 0, ncols*nrows);
-	
-  /* Necessary because code below works with (mindist-1) */
-  mindist--;
-
-  /* If we are keeping all old good features, then add them to the featuremap */
-  if (!overwriteAllFeatures)
-    for (indx = 0 ; indx < featurelist->nFeatures ; indx++)
-      if (featurelist->feature[indx]->val >= 0)  {
-        x   = (int) featurelist->feature[indx]->x;
-        y   = (int) featurelist->feature[indx]->y;
-        _fillFeaturemap(x, y, featuremap, mindist, ncols, nrows);
-      }
+  /* Bring the index up to date: only the old good features we are */
+  /* keeping are in it.  Features that have not moved since the */
+  /* last call are left alone */
+  for (indx = 0 ; indx < featurelist->nFeatures ; indx++)
+    if (!overwriteAllFeatures && featurelist->feature[indx]->val >= 0)
+      _KLTMoveFeatureInIndex(index, indx,
+                             (int) featurelist->feature[indx]->x,
+                             (int) featurelist->feature[indx]->y);
+    else
+      _KLTMoveFeatureInIndex(index, indx, -1, -1);
 
   /* For each feature point, in descending order of importance, do ... */
   ptr = pointlist;
@@ -175,20 +184,8 @@ static void _enforceMinimumDistance(
     if (ptr >= pointlist + 3*npoints)  {
       while (indx < featurelist->nFeatures)  {	
         if (overwriteAllFeatures || 
-            featurelist->feature[indx]->val < 0) {
-          featurelist->feature[indx]->x   = -1;
-          featurelist->feature[indx]->y   = -1;
-          featurelist->feature[indx]->val = KLT_NOT_FOUND;
-	  featurelist->feature[indx]->aff_img = NULL;
-	  featurelist->feature[indx]->aff_img_gradx = NULL;
-	  featurelist->feature[indx]->aff_img_grady = NULL;
-	  featurelist->feature[indx]->aff_x = -1.0;
-	  featurelist->feature[indx]->aff_y = -1.0;
-	  featurelist->feature[indx]->aff_Axx = 1.0;
-	  featurelist->feature[indx]->aff_Ayx = 0.0;
-	  featurelist->feature[indx]->aff_Axy = 0.0;
-	  featurelist->feature[indx]->aff_Ayy = 1.0;
-        }
+            featurelist->feature[indx]->val < 0)
+          _storeFeature(featurelist, indx, -1, -1, KLT_NOT_FOUND);
         indx++;
       }
       break;
@@ -213,29 +210,235 @@ static void _enforceMinimumDistance(
 
     /* If no neighbor has been selected, and if the minimum
        eigenvalue is large enough, then add feature to the current list */
-    if (!featuremap[y*ncols+x] && val >= min_eigenvalue)  {
-      featurelist->feature[indx]->x   = (KLT_locType) x;
-      featurelist->feature[indx]->y   = (KLT_locType) y;
-      featurelist->feature[indx]->val = (int) val;
-      featurelist->feature[indx]->aff_img = NULL;
-      featurelist->feature[indx]->aff_img_gradx = NULL;
-      featurelist->feature[indx]->aff_img_grady = NULL;
-      featurelist->feature[indx]->aff_x = -1.0;
-      featurelist->feature[indx]->aff_y = -1.0;
-      featurelist->feature[indx]->aff_Axx = 1.0;
-      featurelist->feature[indx]->aff_Ayx = 0.0;
-      featurelist->feature[indx]->aff_Axy = 0.0;
-      featurelist->feature[indx]->aff_Ayy = 1.0;
+    if (val >= min_eigenvalue && !_KLTIsCloseToFeature(index, x, y))  {
+      _storeFeature(featurelist, indx, x, y, val);
+      _KLTMoveFeatureInIndex(index, indx, x, y);
       indx++;
+    }
+  }
+}
+
+
+/*********************************************************************
+ * _selectGridFeatures
+ *
+ * Alternative to _sortPointList and _enforceMinimumDistance that
+ * spreads the features over the image.  The image is divided into
+ * cells of cellsize pixels (at least mindist), and each cell gets at
+ * most quota features, counting the old ones that are kept.  The cells
+ * are sorted and thinned independently (in parallel when compiled
+ * with OpenMP); spacing across cell borders is then checked against
+ * the neighboring cells only, best candidates first.
+ *
+ * INPUTS
+ * pointlist:    Unsorted featurepoints; is overwritten.
+ */
+
+static void _selectGridFeatures(
+  int *pointlist,              /* featurepoints */
+  int npoints,                 /* number of featurepoints */
+  KLT_FeatureList featurelist, /* features */
+  int ncols, int nrows,        /* size of images */
+  int cellsize,                /* size of grid cells */
+  int quota,                   /* max. features per cell (0 = even share) */
+  int mindist,                 /* min. dist b/w features */
+  int min_eigenvalue,          /* min. eigenvalue */
+  KLT_BOOL overwriteAllFeatures)
+{
+  int ncellx, ncelly, ncells;
+  int *cellstart;    /* start of each cell's points in cellpoints */
+  int *cellkept;     /* number of candidates kept in each cell */
+  int *cellpoints;   /* points, bucketed by cell */
+  int *cellcount;    /* number of features in each cell */
+  int *cellhead;     /* first feature of each cell's list, or -1 */
+  int *featx, *featy, *featnext;  /* features, linked per cell */
+  int *candidates;
+  int ncandidates, nfeatures, cap;
+  int indx, c, i, j, k, n, x, y, cx, cy, val;
+  KLT_BOOL close;
+
+  /* Cannot add features with an eigenvalue less than one */
+  if (min_eigenvalue < 1)  min_eigenvalue = 1;
+
+  /* Neighboring cells must cover the minimum distance */
+  if (cellsize < mindist)  cellsize = mindist;
+  ncellx = (ncols + cellsize - 1) / cellsize;
+  ncelly = (nrows + cellsize - 1) / cellsize;
+  ncells = ncellx * ncelly;
+  if (quota <= 0)
+    quota = (featurelist->nFeatures + ncells - 1) / ncells;
+  if (quota < 1)  quota = 1;
+  cap = 2 * quota;  /* spares for candidates lost at cell borders */
+
+  cellstart  = (int *) malloc((4*ncells + 1) * sizeof(int));
+  /* at least one element each, as malloc(0) may return NULL */
+  cellpoints = (int *) malloc(3 * max(npoints, 1) * sizeof(int));
+  featx = (int *) malloc(3 * max(featurelist->nFeatures, 1) * sizeof(int));
+  if (cellstart == NULL || cellpoints == NULL || featx == NULL)
+    KLTError("(_selectGridFeatures)  Out of memory");
+  cellkept  = cellstart + ncells + 1;
+  cellcount = cellkept + ncells;
+  featy     = featx + featurelist->nFeatures;
+  cellhead  = cellcount + ncells;
+  featnext  = featy + featurelist->nFeatures;
+
+  /* Bucket the points by cell */
+  memset(cellstart, 0, (ncells + 1) * sizeof(int));
+  for (i = 0 ; i < npoints ; i++)
+    cellstart[(pointlist[3*i+1] / cellsize) * ncellx + pointlist[3*i] / cellsize + 1]++;
+  for (c = 0 ; c < ncells ; c++)
+    cellstart[c+1] += cellstart[c];
+  memset(cellcount, 0, ncells * sizeof(int));
+  for (i = 0 ; i < npoints ; i++)  {
+    c = (pointlist[3*i+1] / cellsize) * ncellx + pointlist[3*i] / cellsize;
+    k = 3 * (cellstart[c] + cellcount[c]++);
+    cellpoints[k]   = pointlist[3*i];
+    cellpoints[k+1] = pointlist[3*i+1];
+    cellpoints[k+2] = pointlist[3*i+2];
+  }
 
-      /* Fill in surrounding region of feature map, but
-         make sure that pixels are in-bounds */
-      _fillFeaturemap(x, y, featuremap, mindist, ncols, nrows);
+  /* Sort each cell and keep its best candidates that are far enough */
+  /* apart; cells do not share any data, so they run in parallel */
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j, n, close) schedule(dynamic, 16)
+#endif
+  for (c = 0 ; c < ncells ; c++)  {
+    int *cell = cellpoints + 3*cellstart[c];
+    int npts = cellstart[c+1] - cellstart[c];
+
+    _quicksort(cell, npts);
+    n = 0;
+    for (i = 0 ; i < npts && n < cap && cell[3*i+2] >= min_eigenvalue ; i++)  {
+      close = FALSE;
+      for (j = 0 ; j < n && !close ; j++)
+        close = abs(cell[3*i] - cell[3*j]) < mindist &&
+                abs(cell[3*i+1] - cell[3*j+1]) < mindist;
+      if (!close)  {
+        cell[3*n]   = cell[3*i];
+        cell[3*n+1] = cell[3*i+1];
+        cell[3*n+2] = cell[3*i+2];
+        n++;
+      }
     }
+    cellkept[c] = n;
   }
 
-  /* Free feature map  */
-  free(featuremap);
+  /* Gather the candidates of all cells, best first */
+  candidates = pointlist;
+  ncandidates = 0;
+  for (c = 0 ; c < ncells ; c++)
+    for (i = 0 ; i < cellkept[c] ; i++)  {
+      memcpy(candidates + 3*ncandidates, cellpoints + 3*(cellstart[c] + i), 3 * sizeof(int));
+      ncandidates++;
+    }
+  _quicksort(candidates, ncandidates);
+
+  /* The features that are kept count towards their cells' quotas */
+  nfeatures = 0;
+  for (c = 0 ; c < ncells ; c++)  {
+    cellhead[c] = -1;
+    cellcount[c] = 0;
+  }
+  if (!overwriteAllFeatures)
+    for (indx = 0 ; indx < featurelist->nFeatures ; indx++)
+      if (featurelist->feature[indx]->val >= 0)  {
+        x = (int) featurelist->feature[indx]->x;
+        y = (int) featurelist->feature[indx]->y;
+        if (x < 0 || x >= ncols || y < 0 || y >= nrows)  continue;
+        c = (y / cellsize) * ncellx + x / cellsize;
+        featx[nfeatures] = x;  featy[nfeatures] = y;
+        featnext[nfeatures] = cellhead[c];
+        cellhead[c] = nfeatures++;
+        cellcount[c]++;
+      }
+
+  /* Fill the free slots, checking the spacing in the 3x3 neighborhood */
+  indx = 0;
+  for (i = 0 ; i < ncandidates ; i++)  {
+    while (!overwriteAllFeatures && 
+           indx < featurelist->nFeatures &&
+           featurelist->feature[indx]->val >= 0)
+      indx++;
+    if (indx >= featurelist->nFeatures)  break;
+
+    x   = candidates[3*i];
+    y   = candidates[3*i+1];
+    val = candidates[3*i+2];
+    cx = x / cellsize;  cy = y / cellsize;
+    c = cy * ncellx + cx;
+    if (cellcount[c] >= quota)  continue;
+
+    close = FALSE;
+    for (j = max(cy-1, 0) ; j <= min(cy+1, ncelly-1) && !close ; j++)
+      for (k = max(cx-1, 0) ; k <= min(cx+1, ncellx-1) && !close ; k++)
+        for (n = cellhead[j*ncellx+k] ; n >= 0 && !close ; n = featnext[n])
+          close = abs(x - featx[n]) < mindist && abs(y - featy[n]) < mindist;
+    if (close)  continue;
+
+    _storeFeature(featurelist, indx++, x, y, val);
+    featx[nfeatures] = x;  featy[nfeatures] = y;
+    featnext[nfeatures] = cellhead[c];
+    cellhead[c] = nfeatures++;
+    cellcount[c]++;
+  }
+
+  /* Fill in the rest of the featurelist with -1's */
+  for ( ; indx < featurelist->nFeatures ; indx++)
+    if (overwriteAllFeatures || featurelist->feature[indx]->val < 0)
+      _storeFeature(featurelist, indx, -1, -1, KLT_NOT_FOUND);
+
+  free(cellstart);
+  free(cellpoints);
+  free(featx);
+}
+
+
+/*********************************************************************
+ * _uncoveredTiles
+ *
+ * Divides the image into KLT_REPLACE_TILE-wide tiles and marks those
+ * that lost a feature (at lost_x, lost_y) and those that contain none
+ * of the features that are kept (e.g., they never had any).  Only
+ * these tiles are rescanned by incremental replacement.
+ *
+ * RETURNS
+ * The marks, one byte per tile in row-major order; *ntilex is set to
+ * the number of tiles per row.
+ */
+
+static uchar *_uncoveredTiles(
+  KLT_FeatureList featurelist,
+  int ncols, int nrows,
+  int *ntilex)
+{
+  int ntiley, indx, x, y;
+  uchar *tiles;
+
+  *ntilex = (ncols + KLT_REPLACE_TILE - 1) / KLT_REPLACE_TILE;
+  ntiley = (nrows + KLT_REPLACE_TILE - 1) / KLT_REPLACE_TILE;
+  tiles = (uchar *) malloc(*ntilex * ntiley * sizeof(uchar));
+  if (tiles == NULL)
+    KLTError("(_uncoveredTiles)  Out of memory");
+  memset(tiles, 1, *ntilex * ntiley);
+
+  for (indx = 0 ; indx < featurelist->nFeatures ; indx++)
+    if (featurelist->feature[indx]->val >= 0)  {
+      x = (int) featurelist->feature[indx]->x;
+      y = (int) featurelist->feature[indx]->y;
+      if (x >= 0 && x < ncols && y >= 0 && y < nrows)
+        tiles[(y / KLT_REPLACE_TILE) * *ntilex + x / KLT_REPLACE_TILE] = 0;
+    }
+
+  /* A tile that lost a feature is rescanned even if it kept others */
+  for (indx = 0 ; indx < featurelist->nFeatures ; indx++)
+    if (featurelist->feature[indx]->val < 0)  {
+      x = (int) featurelist->feature[indx]->lost_x;
+      y = (int) featurelist->feature[indx]->lost_y;
+      if (x >= 0 && x < ncols && y >= 0 && y < nrows)
+        tiles[(y / KLT_REPLACE_TILE) * *ntilex + x / KLT_REPLACE_TILE] = 1;
+    }
+
+  return tiles;
 }
 
 
@@ -297,8 +500,10 @@ static float _minEigenvalue(float gxx, float gxy, float gyy)
 void _KLTSelectGoodFeatures(
   KLT_TrackingContext tc,
   KLT_PixelType *img, 
+  KLT_PreparedImage prep,	/* used instead of img if not NULL */
   int ncols, 
   int nrows,
+  int stride,			/* of img */
   KLT_FeatureList featurelist,
   selectionMode mode)
 {
@@ -306,6 +511,9 @@ void _KLTSelectGoodFeatures(
   int window_hw, window_hh;
   int *pointlist;
   int npoints = 0;
+  _KLT_FeatureIndex index;
+  uchar *tiles = NULL;  /* tiles to scan, or NULL for all */
+  int ntilex = 0;
   KLT_BOOL overwriteAllFeatures = (mode == SELECTING_ALL) ?
     TRUE : FALSE;
   KLT_BOOL floatimages_created = FALSE;
@@ -338,9 +546,25 @@ void _KLTSelectGoodFeatures(
   /* for speed.  Contains only integer locations and values. */
   pointlist = (int *) malloc(ncols * nrows * 3 * sizeof(int));
 
-  /* Create temporary images, etc. */
-  if (mode == REPLACING_SOME && 
-      tc->sequentialMode && tc->pyramid_last != NULL)  {
+  /* Create temporary images, etc.  Fixed-point pyramids (see */
+  /* tc->fixedPointPyramids) cannot be reused, since we need floats below */
+  if (prep != NULL)  {
+    if (!tc->smoothBeforeSelecting)
+      KLTError("(_KLTSelectGoodFeatures) Prepared images are always "
+               "smoothed; select from the raw image when "
+               "tc->smoothBeforeSelecting is FALSE");
+    if (prep->select_img != NULL)  {
+      floatimg = (_KLT_FloatImage) prep->select_img;
+      gradx = (_KLT_FloatImage) prep->select_gradx;
+      grady = (_KLT_FloatImage) prep->select_grady;
+    } else  {
+      floatimg = ((_KLT_Pyramid) prep->pyramid)->img[0];
+      gradx = ((_KLT_Pyramid) prep->pyramid_gradx)->img[0];
+      grady = ((_KLT_Pyramid) prep->pyramid_grady)->img[0];
+    }
+  } else if (mode == REPLACING_SOME && 
+      tc->sequentialMode && tc->pyramid_last != NULL &&
+      ((_KLT_Pyramid) tc->pyramid_last)->img[0]->fixdata == NULL)  {
     floatimg = ((_KLT_Pyramid) tc->pyramid_last)->img[0];
     gradx = ((_KLT_Pyramid) tc->pyramid_last_gradx)->img[0];
     grady = ((_KLT_Pyramid) tc->pyramid_last_grady)->img[0];
@@ -351,13 +575,9 @@ void _KLTSelectGoodFeatures(
     floatimg = _KLTCreateFloatImage(ncols, nrows);
     gradx    = _KLTCreateFloatImage(ncols, nrows);
     grady    = _KLTCreateFloatImage(ncols, nrows);
-    if (tc->smoothBeforeSelecting)  {
-      _KLT_FloatImage tmpimg;
-      tmpimg = _KLTCreateFloatImage(ncols, nrows);
-      _KLTToFloatImage(img, ncols, nrows, tmpimg);
-      _KLTComputeSmoothedImage(tmpimg, _KLTComputeSmoothSigma(tc), floatimg);
-      _KLTFreeFloatImage(tmpimg);
-    } else _KLTToFloatImage(img, ncols, nrows, floatimg);
+    if (tc->smoothBeforeSelecting)
+      _KLTToSmoothedFloatImage(img, ncols, nrows, stride, _KLTComputeSmoothSigma(tc), floatimg);
+    else _KLTToFloatImage(img, ncols, nrows, stride, floatimg);
  
     /* Compute gradient of image in x and y direction */
     _KLTComputeGradients(floatimg, tc->grad_sigma, gradx, grady);
@@ -372,6 +592,11 @@ void _KLTSelectGoodFeatures(
   }
 #endif
 
+  /* When replacing incrementally, only look for features in the */
+  /* tiles that have lost theirs; the others keep the features they have */
+  if (mode == REPLACING_SOME && tc->incrementalReplace)
+    tiles = _uncoveredTiles(featurelist, ncols, nrows, &ntilex);
+
   /* Compute trackability of each image pixel as the minimum
      of the two eigenvalues of the Z matrix */
   {
@@ -398,12 +623,16 @@ void _KLTSelectGoodFeatures(
     for (y = bordery ; y < nrows - bordery ; y += tc->nSkippedPixels + 1)
       for (x = borderx ; x < ncols - borderx ; x += tc->nSkippedPixels + 1)  {
 
+        if (tiles != NULL &&
+            !tiles[(y / KLT_REPLACE_TILE) * ntilex + x / KLT_REPLACE_TILE])
+          continue;
+
         /* Sum the gradients in the surrounding window */
         gxx = 0;  gxy = 0;  gyy = 0;
         for (yy = y-window_hh ; yy <= y+window_hh ; yy++)
           for (xx = x-window_hw ; xx <= x+window_hw ; xx++)  {
-            gx = *(gradx->data + ncols*yy+xx);
-            gy = *(grady->data + ncols*yy+xx);
+            gx = *(gradx->data + gradx->stride*yy+xx);
+            gy = *(grady->data + grady->stride*yy+xx);
             gxx += gx * gx;
             gxy += gx * gy;
             gyy += gy * gy;
@@ -425,9 +654,6 @@ void _KLTSelectGoodFeatures(
       }
   }
 			
-  /* Sort the features  */
-  _sortPointList(pointlist, npoints);
-
   /* Check tc->mindist */
   if (tc->mindist < 0)  {
     KLTWarning("(_KLTSelectGoodFeatures) Tracking context field tc->mindist "
@@ -435,18 +661,49 @@ void _KLTSelectGoodFeatures(
     tc->mindist = 0;
   }
 
-  /* Enforce minimum distance between features */
-  _enforceMinimumDistance(
-    pointlist,
-    npoints,
-    featurelist,
-    ncols, nrows,
-    tc->mindist,
-    tc->min_eigenvalue,
-    overwriteAllFeatures);
+  if (tc->gridCellSize > 0)  {
+
+    /* Select the best features of each grid cell */
+    _selectGridFeatures(
+      pointlist,
+      npoints,
+      featurelist,
+      ncols, nrows,
+      tc->gridCellSize,
+      tc->featuresPerCell,
+      tc->mindist,
+      tc->min_eigenvalue,
+      overwriteAllFeatures);
+
+  } else  {
+
+    /* Sort the features  */
+    _sortPointList(pointlist, npoints);
+
+    /* The feature index is kept between calls, as long as the */
+    /* image, mindist and feature list size stay the same */
+    index = (_KLT_FeatureIndex) tc->feature_index;
+    if (index == NULL || index->ncols != ncols || index->nrows != nrows ||
+        index->mindist != tc->mindist || index->nslots != featurelist->nFeatures)  {
+      if (index != NULL)  _KLTFreeFeatureIndex(index);
+      index = _KLTCreateFeatureIndex(ncols, nrows, tc->mindist, featurelist->nFeatures);
+      tc->feature_index = index;
+    }
+
+    /* Enforce minimum distance between features */
+    _enforceMinimumDistance(
+      pointlist,
+      npoints,
+      featurelist,
+      ncols, nrows,
+      index,
+      tc->min_eigenvalue,
+      overwriteAllFeatures);
+  }
 
   /* Free memory */
   free(pointlist);
+  free(tiles);
   if (floatimages_created)  {
     _KLTFreeFloatImage(floatimg);
     _KLTFreeFloatImage(gradx);
@@ -477,13 +734,37 @@ void KLTSelectGoodFeatures(
   int nrows,
   KLT_FeatureList fl)
 {
+  KLTSelectGoodFeaturesStrided(tc, img, ncols, nrows, ncols, fl);
+}
+
+
+/*********************************************************************
+ * KLTSelectGoodFeaturesStrided
+ *
+ * Same as KLTSelectGoodFeatures, for an image whose rows are stride
+ * pixels apart, such as a padded capture buffer, or a region of a
+ * larger image (img pointing at its top-left pixel).
+ */
+
+void KLTSelectGoodFeaturesStrided(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img, 
+  int ncols, 
+  int nrows,
+  int stride,
+  KLT_FeatureList fl)
+{
+  if (stride < ncols)
+    KLTError("(KLTSelectGoodFeaturesStrided) Stride %d is less than "
+             "the width %d", stride, ncols);
+
   if (KLT_verbose >= 1)  {
     fprintf(stderr,  "(KLT) Selecting the %d best features "
             "from a %d by %d image...  ", fl->nFeatures, ncols, nrows);
     fflush(stderr);
   }
 
-  _KLTSelectGoodFeatures(tc, img, ncols, nrows, 
+  _KLTSelectGoodFeatures(tc, img, NULL, ncols, nrows, stride,
                          fl, SELECTING_ALL);
 
   if (KLT_verbose >= 1)  {
@@ -496,6 +777,39 @@ void KLTSelectGoodFeatures(
 }
 
 
+/*********************************************************************
+ * KLTSelectGoodFeaturesPrepared
+ *
+ * Same as KLTSelectGoodFeatures, for an image prepared by
+ * KLTPrepareImage, whose smoothed image and gradients are reused.
+ * Since the prepared image is smoothed, tc->smoothBeforeSelecting
+ * must be TRUE.
+ */
+
+void KLTSelectGoodFeaturesPrepared(
+  KLT_TrackingContext tc,
+  KLT_PreparedImage prep,
+  KLT_FeatureList fl)
+{
+  _KLTCheckPreparedImage(tc, prep, "KLTSelectGoodFeaturesPrepared");
+
+  if (KLT_verbose >= 1)  {
+    fprintf(stderr,  "(KLT) Selecting the %d best features "
+            "from a %d by %d image...  ", fl->nFeatures, prep->ncols, prep->nrows);
+    fflush(stderr);
+  }
+
+  _KLTSelectGoodFeatures(tc, NULL, prep, prep->ncols, prep->nrows, 0,
+                         fl, SELECTING_ALL);
+
+  if (KLT_verbose >= 1)  {
+    fprintf(stderr,  "\n\t%d features found.\n", 
+            KLTCountRemainingFeatures(fl));
+    fflush(stderr);
+  }
+}
+
+
 /*********************************************************************
  * KLTReplaceLostFeatures
  *
@@ -518,9 +832,32 @@ void KLTReplaceLostFeatures(
   int ncols, 
   int nrows,
   KLT_FeatureList fl)
+{
+  KLTReplaceLostFeaturesStrided(tc, img, ncols, nrows, ncols, fl);
+}
+
+
+/*********************************************************************
+ * KLTReplaceLostFeaturesStrided
+ *
+ * Same as KLTReplaceLostFeatures, for an image whose rows are stride
+ * pixels apart.
+ */
+
+void KLTReplaceLostFeaturesStrided(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img, 
+  int ncols, 
+  int nrows,
+  int stride,
+  KLT_FeatureList fl)
 {
   int nLostFeatures = fl->nFeatures - KLTCountRemainingFeatures(fl);
 
+  if (stride < ncols)
+    KLTError("(KLTReplaceLostFeaturesStrided) Stride %d is less than "
+             "the width %d", stride, ncols);
+
   if (KLT_verbose >= 1)  {
     fprintf(stderr,  "(KLT) Attempting to replace %d features "
             "in a %d by %d image...  ", nLostFeatures, ncols, nrows);
@@ -529,7 +866,7 @@ void KLTReplaceLostFeatures(
 
   /* If there are any lost features, replace them */
   if (nLostFeatures > 0)
-    _KLTSelectGoodFeatures(tc, img, ncols, nrows, 
+    _KLTSelectGoodFeatures(tc, img, NULL, ncols, nrows, stride,
                            fl, REPLACING_SOME);
 
   if (KLT_verbose >= 1)  {
@@ -542,3 +879,38 @@ void KLTReplaceLostFeatures(
 }
 
 
+/*********************************************************************
+ * KLTReplaceLostFeaturesPrepared
+ *
+ * Same as KLTReplaceLostFeatures, for an image prepared by
+ * KLTPrepareImage, whose smoothed image and gradients are reused.
+ * As in KLTSelectGoodFeaturesPrepared, tc->smoothBeforeSelecting
+ * must be TRUE.
+ */
+
+void KLTReplaceLostFeaturesPrepared(
+  KLT_TrackingContext tc,
+  KLT_PreparedImage prep,
+  KLT_FeatureList fl)
+{
+  int nLostFeatures = fl->nFeatures - KLTCountRemainingFeatures(fl);
+
+  _KLTCheckPreparedImage(tc, prep, "KLTReplaceLostFeaturesPrepared");
+
+  if (KLT_verbose >= 1)  {
+    fprintf(stderr,  "(KLT) Attempting to replace %d features "
+            "in a %d by %d image...  ", nLostFeatures, prep->ncols, prep->nrows);
+    fflush(stderr);
+  }
+
+  /* If there are any lost features, replace them */
+  if (nLostFeatures > 0)
+    _KLTSelectGoodFeatures(tc, NULL, prep, prep->ncols, prep->nrows, 0,
+                           fl, REPLACING_SOME);
+
+  if (KLT_verbose >= 1)  {
+    fprintf(stderr,  "\n\t%d features replaced.\n",
+            nLostFeatures - fl->nFeatures + KLTCountRemainingFeatures(fl));
+    fflush(stderr);
+  }
+}
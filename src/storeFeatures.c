@@ -115,3 +115,190 @@ void KLTExtractFeatureHistory(
   }
 }
 
+
+
+/*********************************************************************
+ * KLTPredictFeatureList
+ *
+ * Sets the predicted location (pred_x, pred_y) of each feature in the
+ * frame after 'frame', using a constant-velocity model over frames
+ * frame-1 and frame of the table.  Only features that were tracked
+ * into 'frame' (val == KLT_TRACKED) get a prediction; the others, and
+ * all features when frame is 0, get none.  KLTTrackFeatures starts
+ * the search for each feature at its prediction, so that fast motion
+ * no longer needs a larger search range (i.e., more pyramid levels).
+ * Callers with a better motion model may set pred_x and pred_y
+ * directly instead.
+ */
+
+void KLTPredictFeatureList(
+  KLT_FeatureList fl,
+  KLT_FeatureTable ft,
+  int frame)
+{
+  KLT_Feature cur, prev;
+  int feat;
+
+  if (frame < 0 || frame >= ft->nFrames)
+    KLTError("(KLTPredictFeatureList) Frame number %d is not between 0 and %d",
+             frame, ft->nFrames - 1);
+
+  if (fl->nFeatures != ft->nFeatures)
+    KLTError("(KLTPredictFeatureList) FeatureList and FeatureTable must "
+             "have the same number of features");
+
+  for (feat = 0 ; feat < fl->nFeatures ; feat++)  {
+    fl->feature[feat]->pred_x = -1.0;
+    fl->feature[feat]->pred_y = -1.0;
+    if (frame == 0)  continue;
+    cur  = ft->feature[feat][frame];
+    prev = ft->feature[feat][frame-1];
+    if (cur->val == KLT_TRACKED && prev->val >= 0)  {
+      fl->feature[feat]->pred_x = 2 * cur->x - prev->x;
+      fl->feature[feat]->pred_y = 2 * cur->y - prev->y;
+    }
+  }
+}
+
+
+/*********************************************************************
+ * KLTStoreFeatureListCompact
+ * KLTExtractFeatureListCompact
+ * KLTStoreFeatureHistoryCompact
+ * KLTExtractFeatureHistoryCompact
+ * KLTPredictFeatureListCompact
+ *
+ * Same as the functions above, for a compact table.  A frame is one
+ * run of cells, so lists are copied with a single sequential pass;
+ * histories step through the table a frame at a time.
+ */
+
+static void _checkCompactFrame(
+  KLT_FeatureList fl,
+  KLT_CompactFeatureTable ct,
+  int frame,
+  char *caller)
+{
+  if (frame < 0 || frame >= ct->nFrames)
+    KLTError("%s Frame number %d is not between 0 and %d",
+             caller, frame, ct->nFrames - 1);
+
+  if (fl->nFeatures != ct->nFeatures)
+    KLTError("%s FeatureList and FeatureTable must "
+             "have the same number of features", caller);
+}
+
+static void _checkCompactFeature(
+  KLT_FeatureHistory fh,
+  KLT_CompactFeatureTable ct,
+  int feat,
+  char *caller)
+{
+  if (feat < 0 || feat >= ct->nFeatures)
+    KLTError("%s Feature number %d is not between 0 and %d",
+             caller, feat, ct->nFeatures - 1);
+
+  if (fh->nFrames != ct->nFrames)
+    KLTError("%s FeatureHistory and FeatureTable must "
+             "have the same number of frames", caller);
+}
+
+
+void KLTStoreFeatureListCompact(
+  KLT_FeatureList fl,
+  KLT_CompactFeatureTable ct,
+  int frame)
+{
+  KLT_FeatureCell *cell;
+  int feat;
+
+  _checkCompactFrame(fl, ct, frame, "(KLTStoreFeatures)");
+
+  cell = ct->cell + (size_t) frame * ct->nFeatures;
+  for (feat = 0 ; feat < fl->nFeatures ; feat++, cell++)  {
+    cell->x   = fl->feature[feat]->x;
+    cell->y   = fl->feature[feat]->y;
+    cell->val = fl->feature[feat]->val;
+  }
+}
+
+
+void KLTExtractFeatureListCompact(
+  KLT_FeatureList fl,
+  KLT_CompactFeatureTable ct,
+  int frame)
+{
+  KLT_FeatureCell *cell;
+  int feat;
+
+  _checkCompactFrame(fl, ct, frame, "(KLTExtractFeatures)");
+
+  cell = ct->cell + (size_t) frame * ct->nFeatures;
+  for (feat = 0 ; feat < fl->nFeatures ; feat++, cell++)  {
+    fl->feature[feat]->x   = cell->x;
+    fl->feature[feat]->y   = cell->y;
+    fl->feature[feat]->val = cell->val;
+  }
+}
+
+
+void KLTStoreFeatureHistoryCompact(
+  KLT_FeatureHistory fh,
+  KLT_CompactFeatureTable ct,
+  int feat)
+{
+  KLT_FeatureCell *cell;
+  int frame;
+
+  _checkCompactFeature(fh, ct, feat, "(KLTStoreFeatureHistory)");
+
+  cell = ct->cell + feat;
+  for (frame = 0 ; frame < fh->nFrames ; frame++, cell += ct->nFeatures)  {
+    cell->x   = fh->feature[frame]->x;
+    cell->y   = fh->feature[frame]->y;
+    cell->val = fh->feature[frame]->val;
+  }
+}
+
+
+void KLTExtractFeatureHistoryCompact(
+  KLT_FeatureHistory fh,
+  KLT_CompactFeatureTable ct,
+  int feat)
+{
+  KLT_FeatureCell *cell;
+  int frame;
+
+  _checkCompactFeature(fh, ct, feat, "(KLTExtractFeatureHistory)");
+
+  cell = ct->cell + feat;
+  for (frame = 0 ; frame < fh->nFrames ; frame++, cell += ct->nFeatures)  {
+    fh->feature[frame]->x   = cell->x;
+    fh->feature[frame]->y   = cell->y;
+    fh->feature[frame]->val = cell->val;
+  }
+}
+
+
+void KLTPredictFeatureListCompact(
+  KLT_FeatureList fl,
+  KLT_CompactFeatureTable ct,
+  int frame)
+{
+  KLT_FeatureCell *cur, *prev;
+  int feat;
+
+  _checkCompactFrame(fl, ct, frame, "(KLTPredictFeatureList)");
+
+  cur = ct->cell + (size_t) frame * ct->nFeatures;
+  prev = (frame > 0) ? cur - ct->nFeatures : cur;
+  for (feat = 0 ; feat < fl->nFeatures ; feat++)  {
+    fl->feature[feat]->pred_x = -1.0;
+    fl->feature[feat]->pred_y = -1.0;
+    if (frame == 0)  continue;
+    if (cur[feat].val == KLT_TRACKED && prev[feat].val >= 0)  {
+      fl->feature[feat]->pred_x = 2 * cur[feat].x - prev[feat].x;
+      fl->feature[feat]->pred_y = 2 * cur[feat].y - prev[feat].y;
+    }
+  }
+}
@@ -16,6 +16,7 @@
 #include "klt.h"
 #include "klt_util.h"	/* _KLT_FloatImage */
 #include "pyramid.h"	/* _KLT_Pyramid */
+#include "trackKernels.h"	/* _KLT_WindowKernels */
 
 extern int KLT_verbose;
 
@@ -37,7 +38,8 @@ static float _interpolate(
   int yt = (int) y;
   float ax = x - xt;
   float ay = y - yt;
-  float *ptr = img->data + (img->ncols*yt) + xt;// care for the x, y matches rows,cols 
+  float *ptr;
+  short *fptr;
 
 #ifndef _DNDEBUG
   if (xt<0 || yt<0 || xt>=img->ncols-1 || yt>=img->nrows-1) {
@@ -50,10 +52,20 @@ static float _interpolate(
 
   assert (xt >= 0 && yt >= 0 && xt <= img->ncols - 2 && yt <= img->nrows - 2);
 
+  /* 16-bit fixed-point storage: interpolate, then rescale once */
+  if (img->fixdata != NULL)  {
+    fptr = img->fixdata + (img->stride*yt) + xt;
+    return ( (1-ax) * (1-ay) * *fptr +
+             ax   * (1-ay) * *(fptr+1) +
+             (1-ax) *   ay   * *(fptr+(img->stride)) +
+             ax   *   ay   * *(fptr+(img->stride)+1) ) * img->fixstep;
+  }
+
+  ptr = img->data + (img->stride*yt) + xt;// care for the x, y matches rows,cols 
   return ( (1-ax) * (1-ay) * *ptr +
            ax   * (1-ay) * *(ptr+1) +
-           (1-ax) *   ay   * *(ptr+(img->ncols)) +
-           ax   *   ay   * *(ptr+(img->ncols)+1) );
+           (1-ax) *   ay   * *(ptr+(img->stride)) +
+           ax   *   ay   * *(ptr+(img->stride)+1) );
 }
 
 
@@ -128,6 +140,9 @@ static void _computeGradientSum(
  * Given two images and the window center in both images,
  * aligns the images wrt the window and computes the difference 
  * between the two overlaid images; normalizes for overall gain and bias.
+ * Each window is interpolated only once, into win1 and win2, and the
+ * sums are taken from these.  If galpha is not NULL, it is set to the
+ * gain used by _computeGradientSumLightingInsensitive.
  */
 
 static void _computeIntensityDifferenceLightingInsensitive(
@@ -136,36 +151,39 @@ static void _computeIntensityDifferenceLightingInsensitive(
   float x1, float y1,     /* center of window in 1st img */
   float x2, float y2,     /* center of window in 2nd img */
   int width, int height,  /* size of window */
-  _FloatWindow imgdiff)   /* output */
+  _FloatWindow win1,      /* scratch windows */
+  _FloatWindow win2,
+  _FloatWindow imgdiff,   /* output */
+  float *galpha)          /*   " */
 {
   register int hw = width/2, hh = height/2;
   float g1, g2, sum1_squared = 0, sum2_squared = 0;
   register int i, j;
+  int n = width * height;
+  _FloatWindow w1 = win1, w2 = win2;
   
   float sum1 = 0, sum2 = 0;
   float mean1, mean2,alpha,belta;
   /* Compute values */
   for (j = -hh ; j <= hh ; j++)
     for (i = -hw ; i <= hw ; i++)  {
-      g1 = _interpolate(x1+i, y1+j, img1);
-      g2 = _interpolate(x2+i, y2+j, img2);
+      g1 = *w1++ = _interpolate(x1+i, y1+j, img1);
+      g2 = *w2++ = _interpolate(x2+i, y2+j, img2);
       sum1 += g1;    sum2 += g2;
       sum1_squared += g1*g1;
       sum2_squared += g2*g2;
    }
-  mean1=sum1_squared/(width*height);
-  mean2=sum2_squared/(width*height);
+  mean1=sum1_squared/n;
+  mean2=sum2_squared/n;
   alpha = (float) sqrt(mean1/mean2);
-  mean1=sum1/(width*height);
-  mean2=sum2/(width*height);
+  mean1=sum1/n;
+  mean2=sum2/n;
   belta = mean1-alpha*mean2;
+  if (galpha != NULL)
+    *galpha = (float) sqrt(mean1/mean2);
 
-  for (j = -hh ; j <= hh ; j++)
-    for (i = -hw ; i <= hw ; i++)  {
-      g1 = _interpolate(x1+i, y1+j, img1);
-      g2 = _interpolate(x2+i, y2+j, img2);
-      *imgdiff++ = g1- g2*alpha-belta;
-    } 
+  for (i = 0 ; i < n ; i++)
+    *imgdiff++ = win1[i] - win2[i]*alpha - belta;
 }
 
 
@@ -174,7 +192,8 @@ static void _computeIntensityDifferenceLightingInsensitive(
  *
  * Given two gradients and the window center in both images,
  * aligns the gradients wrt the window and computes the sum of the two 
- * overlaid gradients; normalizes for overall gain and bias.
+ * overlaid gradients; normalizes for overall gain (alpha, as returned
+ * by _computeIntensityDifferenceLightingInsensitive).
  */
 
 static void _computeGradientSumLightingInsensitive(
@@ -182,31 +201,17 @@ static void _computeGradientSumLightingInsensitive(
   _KLT_FloatImage grady1,
   _KLT_FloatImage gradx2,
   _KLT_FloatImage grady2,
-  _KLT_FloatImage img1,   /* images */
-  _KLT_FloatImage img2,
- 
   float x1, float y1,      /* center of window in 1st img */
   float x2, float y2,      /* center of window in 2nd img */
   int width, int height,   /* size of window */
+  float alpha,             /* gain of 2nd img */
   _FloatWindow gradx,      /* output */
   _FloatWindow grady)      /*   " */
 {
   register int hw = width/2, hh = height/2;
-  float g1, g2, sum1_squared = 0, sum2_squared = 0;
+  float g1, g2;
   register int i, j;
   
-  float sum1 = 0, sum2 = 0;
-  float mean1, mean2, alpha;
-  for (j = -hh ; j <= hh ; j++)
-    for (i = -hw ; i <= hw ; i++)  {
-      g1 = _interpolate(x1+i, y1+j, img1);
-      g2 = _interpolate(x2+i, y2+j, img2);
-      sum1_squared += g1;    sum2_squared += g2;
-    }
-  mean1 = sum1_squared/(width*height);
-  mean2 = sum2_squared/(width*height);
-  alpha = (float) sqrt(mean1/mean2);
-  
   /* Compute values */
   for (j = -hh ; j <= hh ; j++)
     for (i = -hw ; i <= hw ; i++)  {
@@ -279,6 +284,80 @@ static void _compute2by1ErrorVector(
 }
 
 
+/*********************************************************************
+ * _computeGradientMatrixAndErrorVector
+ *
+ * Same as _computeIntensityDifference and _computeGradientSum followed
+ * by _compute2by2GradientMatrix and _compute2by1ErrorVector, but in a
+ * single sweep over the window that does not store the windows.
+ */
+
+static void _computeGradientMatrixAndErrorVector(
+  _KLT_FloatImage img1,   /* images and their gradients */
+  _KLT_FloatImage gradx1,
+  _KLT_FloatImage grady1,
+  _KLT_FloatImage img2,
+  _KLT_FloatImage gradx2,
+  _KLT_FloatImage grady2,
+  float x1, float y1,     /* center of window in 1st img */
+  float x2, float y2,     /* center of window in 2nd img */
+  int width, int height,  /* size of window */
+  float step_factor, /* 2.0 comes from equations, 1.0 seems to avoid overshooting */
+  float *gxx,  /* return values */
+  float *gxy, 
+  float *gyy,
+  float *ex,
+  float *ey)
+{
+  register int hw = width/2, hh = height/2;
+  register float diff, gx, gy;
+  register int i, j;
+
+  /* Compute values */
+  *gxx = 0.0;  *gxy = 0.0;  *gyy = 0.0;
+  *ex = 0;  *ey = 0;  
+  for (j = -hh ; j <= hh ; j++)
+    for (i = -hw ; i <= hw ; i++)  {
+      diff = _interpolate(x1+i, y1+j, img1) - _interpolate(x2+i, y2+j, img2);
+      gx = _interpolate(x1+i, y1+j, gradx1) + _interpolate(x2+i, y2+j, gradx2);
+      gy = _interpolate(x1+i, y1+j, grady1) + _interpolate(x2+i, y2+j, grady2);
+      *gxx += gx*gx;
+      *gxy += gx*gy;
+      *gyy += gy*gy;
+      *ex += diff * gx;
+      *ey += diff * gy;
+    }
+  *ex *= step_factor;
+  *ey *= step_factor;
+}
+
+
+/*********************************************************************
+ * _computeResidue
+ *
+ * Same as _computeIntensityDifference followed by _sumAbsFloatWindow,
+ * without storing the window.
+ */
+
+static float _computeResidue(
+  _KLT_FloatImage img1,   /* images */
+  _KLT_FloatImage img2,
+  float x1, float y1,     /* center of window in 1st img */
+  float x2, float y2,     /* center of window in 2nd img */
+  int width, int height)  /* size of window */
+{
+  register int hw = width/2, hh = height/2;
+  register int i, j;
+  float sum = 0.0;
+
+  for (j = -hh ; j <= hh ; j++)
+    for (i = -hw ; i <= hw ; i++)
+      sum += (float) fabs(_interpolate(x1+i, y1+j, img1) -
+                          _interpolate(x2+i, y2+j, img2));
+  return sum;
+}
+
+
 /*********************************************************************
  * _solveEquation
  *
@@ -367,11 +446,167 @@ static float _sumAbsFloatWindow(
 }
 
 
+/*********************************************************************
+ * _getWindow
+ *
+ * Samples the window of an image centered at (x,y).
+ */
+
+static void _getWindow(
+  _KLT_FloatImage img,
+  float x, float y,       /* center of window */
+  int width, int height,  /* size of window */
+  _FloatWindow win)       /* output */
+{
+  register int hw = width/2, hh = height/2;
+  register int i, j;
+
+  for (j = -hh ; j <= hh ; j++)
+    for (i = -hw ; i <= hw ; i++)
+      *win++ = _interpolate(x+i, y+j, img);
+}
+
+
+/*********************************************************************
+ * _computeDifferenceFromTemplate
+ *
+ * Same as _computeIntensityDifference and _computeGradientSum (or their
+ * lighting-insensitive versions), except that the windows of the first
+ * image have already been sampled, so that only the second image is
+ * interpolated.  If gradx is NULL, only the difference is computed.
+ */
+
+static void _computeDifferenceFromTemplate(
+  _FloatWindow tmpl,        /* windows of 1st img */
+  _FloatWindow tmpl_gradx,
+  _FloatWindow tmpl_grady,
+  _KLT_FloatImage img2,     /* 2nd img */
+  _KLT_FloatImage gradx2,
+  _KLT_FloatImage grady2,
+  float x2, float y2,       /* center of window in 2nd img */
+  int width, int height,    /* size of window */
+  int lighting_insensitive, /* whether to normalize for gain and bias */
+  _FloatWindow win,         /* scratch window */
+  _FloatWindow imgdiff,     /* output */
+  _FloatWindow gradx,       /*   " */
+  _FloatWindow grady)       /*   " */
+{
+  register int hw = width/2, hh = height/2;
+  register int i, j;
+  int n = width * height;
+  float alpha = 1.0f, belta = 0.0f, galpha = 1.0f;
+
+  _getWindow(img2, x2, y2, width, height, win);
+
+  /* Gain and bias, computed as in the lighting-insensitive functions */
+  if (lighting_insensitive)  {
+    float sum1 = 0, sum2 = 0, sum1_squared = 0, sum2_squared = 0;
+    for (i = 0 ; i < n ; i++)  {
+      sum1 += tmpl[i];  sum2 += win[i];
+      sum1_squared += tmpl[i]*tmpl[i];
+      sum2_squared += win[i]*win[i];
+    }
+    alpha = (float) sqrt(sum1_squared/sum2_squared);
+    belta = sum1/n - alpha*sum2/n;
+    galpha = (float) sqrt(sum1/sum2);
+  }
+
+  for (i = 0 ; i < n ; i++)
+    imgdiff[i] = tmpl[i] - win[i]*alpha - belta;
+
+  if (gradx == NULL)  return;
+
+  for (j = -hh ; j <= hh ; j++)
+    for (i = -hw ; i <= hw ; i++)  {
+      *gradx++ = *tmpl_gradx++ + _interpolate(x2+i, y2+j, gradx2) * galpha;
+      *grady++ = *tmpl_grady++ + _interpolate(x2+i, y2+j, grady2) * galpha;
+    }
+}
+
+
+/*********************************************************************
+ * _computeGradientMatrixAndErrorVectorFromTemplate
+ *
+ * Same as _computeGradientMatrixAndErrorVector, except that the windows
+ * of the first image have already been sampled (as in
+ * _computeDifferenceFromTemplate, without lighting insensitivity).
+ */
+
+static void _computeGradientMatrixAndErrorVectorFromTemplate(
+  _FloatWindow tmpl,        /* windows of 1st img */
+  _FloatWindow tmpl_gradx,
+  _FloatWindow tmpl_grady,
+  _KLT_FloatImage img2,     /* 2nd img and its gradients */
+  _KLT_FloatImage gradx2,
+  _KLT_FloatImage grady2,
+  float x2, float y2,       /* center of window in 2nd img */
+  int width, int height,    /* size of window */
+  float step_factor, /* 2.0 comes from equations, 1.0 seems to avoid overshooting */
+  float *gxx,  /* return values */
+  float *gxy, 
+  float *gyy,
+  float *ex,
+  float *ey)
+{
+  register int hw = width/2, hh = height/2;
+  register float diff, gx, gy;
+  register int i, j;
+
+  /* Compute values */
+  *gxx = 0.0;  *gxy = 0.0;  *gyy = 0.0;
+  *ex = 0;  *ey = 0;  
+  for (j = -hh ; j <= hh ; j++)
+    for (i = -hw ; i <= hw ; i++)  {
+      diff = *tmpl++ - _interpolate(x2+i, y2+j, img2);
+      gx = *tmpl_gradx++ + _interpolate(x2+i, y2+j, gradx2);
+      gy = *tmpl_grady++ + _interpolate(x2+i, y2+j, grady2);
+      *gxx += gx*gx;
+      *gxy += gx*gy;
+      *gyy += gy*gy;
+      *ex += diff * gx;
+      *ey += diff * gy;
+    }
+  *ex *= step_factor;
+  *ey *= step_factor;
+}
+
+
+/*********************************************************************
+ * _computeResidueFromTemplate
+ *
+ * Same as _computeResidue, with the window of the first image already
+ * sampled.
+ */
+
+static float _computeResidueFromTemplate(
+  _FloatWindow tmpl,        /* window of 1st img */
+  _KLT_FloatImage img2,     /* 2nd img */
+  float x2, float y2,       /* center of window in 2nd img */
+  int width, int height)    /* size of window */
+{
+  register int hw = width/2, hh = height/2;
+  register int i, j;
+  float sum = 0.0;
+
+  for (j = -hh ; j <= hh ; j++)
+    for (i = -hw ; i <= hw ; i++)
+      sum += (float) fabs(*tmpl++ - _interpolate(x2+i, y2+j, img2));
+  return sum;
+}
+
+
 /*********************************************************************
  * _trackFeature
  *
  * Tracks a feature point from one image to the next.
  *
+ * If tmpl is not NULL, it holds seven windows of the window's size
+ * (see _trackFeatureBackward).  The windows of the first image are
+ * then sampled into the first three once, and every iteration only
+ * interpolates the second image, in a single sweep unless lighting
+ * insensitive (see _computeDifferenceFromTemplate); the other four
+ * are scratch space.
+ *
  * RETURNS
  * KLT_SMALL_DET if feature is lost,
  * KLT_MAX_ITERATIONS if tracking stopped because iterations timed out,
@@ -392,7 +627,8 @@ static int _trackFeature(
   _KLT_FloatImage img2, 
   _KLT_FloatImage gradx2,
   _KLT_FloatImage grady2,
-  _KLT_FloatImage Img2ForShow,
+  _KLT_FloatImage Img2ForShow, /* debug image scribbled on, or NULL */
+  _FloatWindow tmpl,   /* windows of first image, or NULL */
   int width,           /* size of window */
   int height,
   float step_factor, /* 2.0 comes from equations, 1.0 seems to avoid overshooting */
@@ -403,10 +639,14 @@ static int _trackFeature(
   int lighting_insensitive,
   int isPrint)  /* whether to normalize for gain and bias */
 {
-  _FloatWindow imgdiff, gradx, grady;
-  float gxx, gxy, gyy, ex, ey, dx, dy;
+  _FloatWindow imgdiff = NULL, gradx = NULL, grady = NULL;
+  _FloatWindow win1 = NULL, win2 = NULL;
+  _FloatWindow tmpl_gradx = NULL, tmpl_grady = NULL;
+  _KLT_WindowKernels kernels = _KLTGetWindowKernels(width, height);
+  float gxx, gxy, gyy, ex, ey, dx, dy, alpha, residue;
   int iteration = 0;
-  int status;
+  int status = KLT_TRACKED;
+  int n = width * height;
   int hw = width/2;
   int hh = height/2;
   int nc = img1->ncols;
@@ -414,52 +654,101 @@ static int _trackFeature(
   float one_plus_eps = 1.001f;   /* To prevent rounding errors */
   char fname[80];
 	
-  /* Allocate memory for windows */
-  imgdiff = _allocateFloatWindow(width, height);
-  gradx   = _allocateFloatWindow(width, height);
-  grady   = _allocateFloatWindow(width, height);
+  /* The window in the first image does not move */
+  if (x1-hw < 0.0f || nc-(x1+hw) < one_plus_eps ||
+      y1-hh < 0.0f || nr-(y1+hh) < one_plus_eps)
+    status = KLT_OOB;
+
+  /* Windows: the caller's in template mode; otherwise only the */
+  /* lighting-insensitive case stores them, the other sums are */
+  /* accumulated in a single sweep */
+  if (tmpl != NULL)  {
+    tmpl_gradx = tmpl + n;
+    tmpl_grady = tmpl + 2*n;
+    win1    = tmpl + 3*n;
+    imgdiff = tmpl + 4*n;
+    gradx   = tmpl + 5*n;
+    grady   = tmpl + 6*n;
+    if (status != KLT_OOB)  {
+      _getWindow(img1, x1, y1, width, height, tmpl);
+      _getWindow(gradx1, x1, y1, width, height, tmpl_gradx);
+      _getWindow(grady1, x1, y1, width, height, tmpl_grady);
+    }
+  } else if (lighting_insensitive)  {
+    imgdiff = _allocateFloatWindow(width, height);
+    gradx   = _allocateFloatWindow(width, height);
+    grady   = _allocateFloatWindow(width, height);
+    win1  = _allocateFloatWindow(width, height);
+    win2  = _allocateFloatWindow(width, height);
+  }
  
   //ʼ뵱ǰʱ㣺ɫ
   if (isPrint == 1){
 	  printf("(%6.2f,%6.2f)\n", *x2, *y2);
   }
-  int place = (int)(*y2)* Img2ForShow->ncols + (int)(*x2);
-  Img2ForShow->data[place] = 245.0;
+  if (Img2ForShow != NULL)  {
+    int place = (int)(*y2)* Img2ForShow->stride + (int)(*x2);
+    Img2ForShow->data[place] = 245.0;
+  }
   
   /* Iteratively update the window position */
   do  {
 
     /* If out of bounds, exit loop */
-    if (  x1-hw < 0.0f || nc-( x1+hw) < one_plus_eps ||
-         *x2-hw < 0.0f || nc-(*x2+hw) < one_plus_eps ||
-          y1-hh < 0.0f || nr-( y1+hh) < one_plus_eps ||
-         *y2-hh < 0.0f || nr-(*y2+hh) < one_plus_eps) {
+    if (status == KLT_OOB ||
+        *x2-hw < 0.0f || nc-(*x2+hw) < one_plus_eps ||
+        *y2-hh < 0.0f || nr-(*y2+hh) < one_plus_eps) {
       status = KLT_OOB;
       break;
     }
 	
     /* СڵݶȡҶȲֵCompute gradient and difference windows */
-    if (lighting_insensitive) {
+    /* СڹUse these windows to construct matrices */
+	//ݶȾGĸԪ:gxx, gxy, gyy
+	//ҶȲֵԪ: ex,ey
+    if (tmpl != NULL && lighting_insensitive) {
+      _computeDifferenceFromTemplate(tmpl, tmpl_gradx, tmpl_grady,
+                                     img2, gradx2, grady2, *x2, *y2,
+                                     width, height, lighting_insensitive,
+                                     win1, imgdiff, gradx, grady);
+      _compute2by2GradientMatrix(gradx, grady, width, height, 
+                                 &gxx, &gxy, &gyy);
+      _compute2by1ErrorVector(imgdiff, gradx, grady, width, height, step_factor,
+                              &ex, &ey);
+    } else if (tmpl != NULL && kernels != NULL) {
+      kernels->gradientMatrixAndErrorVectorFromTemplate(tmpl, tmpl_gradx, tmpl_grady,
+                                                        img2, gradx2, grady2,
+                                                        *x2, *y2, step_factor,
+                                                        &gxx, &gxy, &gyy, &ex, &ey);
+    } else if (tmpl != NULL) {
+      _computeGradientMatrixAndErrorVectorFromTemplate(tmpl, tmpl_gradx, tmpl_grady,
+                                                       img2, gradx2, grady2,
+                                                       *x2, *y2, width, height,
+                                                       step_factor,
+                                                       &gxx, &gxy, &gyy, &ex, &ey);
+    } else if (lighting_insensitive) {
       _computeIntensityDifferenceLightingInsensitive(img1, img2, x1, y1, *x2, *y2, 
-                                  width, height, imgdiff);
+                                  width, height, win1, win2, imgdiff, &alpha);
       _computeGradientSumLightingInsensitive(gradx1, grady1, gradx2, grady2, 
-			  img1, img2, x1, y1, *x2, *y2, width, height, gradx, grady);
+			  x1, y1, *x2, *y2, width, height, alpha, gradx, grady);
+      _compute2by2GradientMatrix(gradx, grady, width, height, 
+                                 &gxx, &gxy, &gyy);
+      _compute2by1ErrorVector(imgdiff, gradx, grady, width, height, step_factor,
+                              &ex, &ey);
+    } else if (kernels != NULL) {
+      /* specialized for this window size */
+      kernels->gradientMatrixAndErrorVector(img1, gradx1, grady1,
+                                            img2, gradx2, grady2,
+                                            x1, y1, *x2, *y2, step_factor,
+                                            &gxx, &gxy, &gyy, &ex, &ey);
     } else {
-		//˫ԲֵͼеfloatĻҶȲֵ
-      _computeIntensityDifference(img1, img2, x1, y1, *x2, *y2, 
-                                  width, height, imgdiff);
-	  //˫Բֵͼеfloatݶ
-      _computeGradientSum(gradx1, grady1, gradx2, grady2, 
-			  x1, y1, *x2, *y2, width, height, gradx, grady);
+      //˫ԲֵһɨСڣֱۼG
+      _computeGradientMatrixAndErrorVector(img1, gradx1, grady1,
+                                           img2, gradx2, grady2,
+                                           x1, y1, *x2, *y2, width, height,
+                                           step_factor,
+                                           &gxx, &gxy, &gyy, &ex, &ey);
     }
-		
-    /* СڹUse these windows to construct matrices */
-	//ݶȾGĸԪ:gxx, gxy, gyy
-    _compute2by2GradientMatrix(gradx, grady, width, height, 
-                               &gxx, &gxy, &gyy);
-	//ҶȲֵԪ: ex,ey
-    _compute2by1ErrorVector(imgdiff, gradx, grady, width, height, step_factor,
-                            &ex, &ey);
 				
 	//G棬µ:dx,dyһfloat
     status = _solveEquation(gxx, gxy, gyy, ex, ey, small, &dx, &dy);
@@ -470,7 +759,9 @@ static int _trackFeature(
 	//ڵ㣺ɫ
 	if (isPrint == 1){
 		printf("(%6.2f,%6.2f)\n", *x2, *y2);
-		int place = (int)(*y2)* Img2ForShow->ncols + (int)(*x2);//floatתint
+	}
+	if (Img2ForShow != NULL){
+		int place = (int)(*y2)* Img2ForShow->stride + (int)(*x2);//floatתint
 		Img2ForShow->data[place] = 0.0;
 	}
 	
@@ -485,18 +776,33 @@ static int _trackFeature(
 
   /* Check whether residue is too large */
   if (status == KLT_TRACKED)  {
-    if (lighting_insensitive)
+    if (tmpl != NULL && lighting_insensitive)  {
+      _computeDifferenceFromTemplate(tmpl, NULL, NULL,
+                                     img2, NULL, NULL, *x2, *y2,
+                                     width, height, lighting_insensitive,
+                                     win1, imgdiff, NULL, NULL);
+      residue = _sumAbsFloatWindow(imgdiff, width, height);
+    } else if (tmpl != NULL && kernels != NULL)
+      residue = kernels->residueFromTemplate(tmpl, img2, *x2, *y2);
+    else if (tmpl != NULL)
+      residue = _computeResidueFromTemplate(tmpl, img2, *x2, *y2, width, height);
+    else if (lighting_insensitive)  {
       _computeIntensityDifferenceLightingInsensitive(img1, img2, x1, y1, *x2, *y2, 
-                                  width, height, imgdiff);
+                                  width, height, win1, win2, imgdiff, NULL);
+      residue = _sumAbsFloatWindow(imgdiff, width, height);
+    } else if (kernels != NULL)
+      residue = kernels->residue(img1, img2, x1, y1, *x2, *y2);
     else
-      _computeIntensityDifference(img1, img2, x1, y1, *x2, *y2, 
-                                  width, height, imgdiff);
-    if (_sumAbsFloatWindow(imgdiff, width, height)/(width*height) > max_residue) 
+      residue = _computeResidue(img1, img2, x1, y1, *x2, *y2, width, height);
+    if (residue/(width*height) > max_residue) 
       status = KLT_LARGE_RESIDUE;
   }
 
   /* Free memory */
-  free(imgdiff);  free(gradx);  free(grady);
+  if (tmpl == NULL)  {
+    free(imgdiff);  free(gradx);  free(grady);
+    free(win1);  free(win2);
+  }
 
   /* Return appropriate value */
   if (status == KLT_SMALL_DET)  return KLT_SMALL_DET;
@@ -507,6 +813,124 @@ static int _trackFeature(
 }
 
 
+/*********************************************************************
+ * _trackFeatureBackward
+ *
+ * Tracks a feature from its location (x2,y2) in the second image back
+ * to the first image, coarse to fine through the pyramids that were
+ * built for the forward track.  At each level the windows around the
+ * fixed point in the second image are sampled once and reused by all
+ * Newton iterations, so the backward track costs well under a forward
+ * one.  windows holds seven windows of the tracking window's size,
+ * allocated once by the caller for all features.
+ *
+ * RETURNS
+ * the status of the backward track; (*x1,*y1) is its result.
+ */
+
+static int _trackFeatureBackward(
+  KLT_TrackingContext tc,
+  _KLT_Pyramid pyramid2,        /* image tracked from */
+  _KLT_Pyramid pyramid2_gradx,
+  _KLT_Pyramid pyramid2_grady,
+  _KLT_Pyramid pyramid1,        /* image tracked to */
+  _KLT_Pyramid pyramid1_gradx,
+  _KLT_Pyramid pyramid1_grady,
+  float x2, float y2,
+  float *x1, float *y1,
+  _FloatWindow windows)
+{
+  float subsampling = (float) tc->subsampling;
+  int val = KLT_TRACKED;
+  int r;
+
+  /* Transform location to coarsest resolution */
+  for (r = tc->nPyramidLevels - 1 ; r >= 0 ; r--)  {
+    x2 /= subsampling;  y2 /= subsampling;
+  }
+  *x1 = x2;  *y1 = y2;
+
+  for (r = tc->nPyramidLevels - 1 ; r >= 0 ; r--)  {
+    x2 *= subsampling;  y2 *= subsampling;
+    *x1 *= subsampling;  *y1 *= subsampling;
+
+    val = _trackFeature(x2, y2, x1, y1,
+                        pyramid2->img[r],
+                        pyramid2_gradx->img[r], pyramid2_grady->img[r],
+                        pyramid1->img[r],
+                        pyramid1_gradx->img[r], pyramid1_grady->img[r],
+                        NULL, windows,
+                        tc->window_width, tc->window_height,
+                        tc->step_factor,
+                        tc->max_iterations,
+                        tc->min_determinant,
+                        tc->min_displacement,
+                        tc->max_residue,
+                        tc->lighting_insensitive,
+                        0);
+    if (val==KLT_SMALL_DET || val==KLT_OOB)
+      break;
+  }
+
+  return val;
+}
+
+
+/*********************************************************************
+ * _startPyramidLevel
+ *
+ * Given the expected displacement of a feature from its starting
+ * location (negative if unknown), returns the finest pyramid level
+ * from which coarse-to-fine tracking can still capture twice that
+ * displacement.  The search range of levels 0..r is computed as in
+ * KLTChangeTCPyramid.
+ */
+
+static int _startPyramidLevel(
+  KLT_TrackingContext tc,
+  float motion)
+{
+  float window_halfwidth = min(tc->window_width, tc->window_height)/2.0f;
+  float range = 0.0f, scale = 1.0f;
+  int r;
+
+  if (motion < 0.0f)  return tc->nPyramidLevels - 1;
+  for (r = 0 ; r < tc->nPyramidLevels - 1 ; r++)  {
+    range += window_halfwidth * scale;
+    if (range >= 2.0f * motion)  return r;
+    scale *= tc->subsampling;
+  }
+  return tc->nPyramidLevels - 1;
+}
+
+
+/*********************************************************************
+ * _estimateMotion
+ *
+ * Returns the 90th percentile of the displacements (from the starting
+ * location) of the features tracked by one call, which serves as the
+ * expected displacement of every feature in the next call.  Returns -1
+ * if there are too few features to tell.  Sorts the array.
+ */
+
+static int _compareFloats(
+  const void *a,
+  const void *b)
+{
+  float fa = *(const float *) a, fb = *(const float *) b;
+  return (fa < fb) ? -1 : (fa > fb) ? 1 : 0;
+}
+
+static float _estimateMotion(
+  float *disp,
+  int n)
+{
+  if (n < 10)  return -1.0f;
+  qsort(disp, n, sizeof(float), _compareFloats);
+  return disp[(9 * n) / 10];
+}
+
+
 /*********************************************************************/
 
 static KLT_BOOL _outOfBounds(
@@ -545,82 +969,59 @@ static KLT_BOOL _outOfBounds(
 * Thanks to Kevin Koeser (koeser@mip.informatik.uni-kiel.de) for fixing a bug 
 */
 
-#define SWAP_ME(X,Y) {temp=(X);(X)=(Y);(Y)=temp;}
-
-static float **_am_matrix(long nr, long nc)
-{
-  float **m;
-  int a;
-  m = (float **) malloc((size_t)(nr*sizeof(float*)));
-  m[0] = (float *) malloc((size_t)((nr*nc)*sizeof(float)));
-  for(a = 1; a < nr; a++) m[a] = m[a-1]+nc;
-  return m;
-}
+/*********************************************************************
+ * _AM_DEFINE_LDLT_SOLVER
+ *
+ * Defines _am_solveLDLT<N>, which solves the N by N symmetric system
+ * T a = e of the affine tracker by LDL^T decomposition.  a is returned
+ * in e.  Everything lives on the stack, and all loop bounds are
+ * compile-time constants, so the compiler can unroll the small cases.
+ * The normal matrices are positive semi-definite; a pivot that is not
+ * positive means the matrix is singular.
+ *
+ * RETURNS
+ * KLT_SMALL_DET if T is singular, KLT_TRACKED otherwise.
+ */
 
-static void _am_free_matrix(float **m)
-{
-  free(m[0]);
-  free(m);
+#define _AM_DEFINE_LDLT_SOLVER(N) \
+static int _am_solveLDLT##N(float T[N][N], float e[N]) \
+{ \
+  float L[N][N], d[N], v; \
+  int i, j, k; \
+  \
+  /* Decompose T = L D L^T, L unit lower triangular */ \
+  for (j = 0 ; j < N ; j++)  { \
+    v = T[j][j]; \
+    for (k = 0 ; k < j ; k++)  v -= L[j][k] * L[j][k] * d[k]; \
+    if (!(v > 0.0f))  return KLT_SMALL_DET; \
+    d[j] = v; \
+    for (i = j+1 ; i < N ; i++)  { \
+      v = T[i][j]; \
+      for (k = 0 ; k < j ; k++)  v -= L[i][k] * L[j][k] * d[k]; \
+      L[i][j] = v / d[j]; \
+    } \
+  } \
+  \
+  /* Solve L y = e, then D z = y, then L^T a = z */ \
+  for (i = 0 ; i < N ; i++)  { \
+    v = e[i]; \
+    for (k = 0 ; k < i ; k++)  v -= L[i][k] * e[k]; \
+    e[i] = v; \
+  } \
+  for (i = 0 ; i < N ; i++)  e[i] /= d[i]; \
+  for (i = N-1 ; i >= 0 ; i--)  { \
+    v = e[i]; \
+    for (k = i+1 ; k < N ; k++)  v -= L[k][i] * e[k]; \
+    e[i] = v; \
+  } \
+  return KLT_TRACKED; \
 }
 
+/* similarity mapping (4 parameters) and affine mapping (6 parameters); */
+/* the 2 by 2 translational case is solved in closed form by _solveEquation */
+_AM_DEFINE_LDLT_SOLVER(4)
+_AM_DEFINE_LDLT_SOLVER(6)
 
-static int _am_gauss_jordan_elimination(float **a, int n, float **b, int m)
-{
-  /* re-implemented from Numerical Recipes in C */
-  int *indxc,*indxr,*ipiv;
-  int i,j,k,l,ll;
-  float big,dum,pivinv,temp;
-  int col = 0;
-  int row = 0;
-
-  indxc=(int *)malloc((size_t) (n*sizeof(int)));
-  indxr=(int *)malloc((size_t) (n*sizeof(int)));
-  ipiv=(int *)malloc((size_t) (n*sizeof(int)));
-  for (j=0;j<n;j++) ipiv[j]=0;
-  for (i=0;i<n;i++) {
-    big=0.0;
-    for (j=0;j<n;j++)
-      if (ipiv[j] != 1)
-	for (k=0;k<n;k++) {
-	  if (ipiv[k] == 0) {
-	    if (fabs(a[j][k]) >= big) {
-	      big= (float) fabs(a[j][k]);
-	      row=j;
-	      col=k;
-	    }
-	  } else if (ipiv[k] > 1) return KLT_SMALL_DET;
-	}
-    ++(ipiv[col]);
-    if (row != col) {
-      for (l=0;l<n;l++) SWAP_ME(a[row][l],a[col][l])
-			  for (l=0;l<m;l++) SWAP_ME(b[row][l],b[col][l])
-					      }
-    indxr[i]=row;
-    indxc[i]=col;
-    if (a[col][col] == 0.0) return KLT_SMALL_DET;
-    pivinv=1.0f/a[col][col];
-    a[col][col]=1.0;
-    for (l=0;l<n;l++) a[col][l] *= pivinv;
-    for (l=0;l<m;l++) b[col][l] *= pivinv;
-    for (ll=0;ll<n;ll++)
-      if (ll != col) {
-	dum=a[ll][col];
-	a[ll][col]=0.0;
-	for (l=0;l<n;l++) a[ll][l] -= a[col][l]*dum;
-	for (l=0;l<m;l++) b[ll][l] -= b[col][l]*dum;
-      }
-  }
-  for (l=n-1;l>=0;l--) {
-    if (indxr[l] != indxc[l])
-      for (k=0;k<n;k++)
-	SWAP_ME(a[k][indxr[l]],a[k][indxc[l]]);
-  }
-  free(ipiv);
-  free(indxr);
-  free(indxc);
-
-  return KLT_TRACKED;
-}
 
 /*********************************************************************
  * _am_getGradientWinAffine
@@ -703,8 +1104,8 @@ static void _am_getSubFloatImage(
   /* copy values */
   for (j = -hh ; j <= hh ; j++)
     for (i = -hw ; i <= hw ; i++)  {
-      offset = (j+y0)*img->ncols + (i+x0);
-      *windata++ = *(img->data+offset);
+      offset = (j+y0)*img->stride + (i+x0);
+      *windata++ = _KLTGetFloatImagePixel(img, offset);
     }
 }
 
@@ -753,7 +1154,7 @@ static void _am_compute6by6GradientMatrix(
 					  _FloatWindow grady,
 					  int width,   /* size of window */
 					  int height,
-					  float **T)  /* return values */
+					  float T[6][6])  /* return values */
 {
   register int hw = width/2, hh = height/2;
   register int i, j;
@@ -830,14 +1231,14 @@ static void _am_compute6by1ErrorVector(
 				       _FloatWindow grady,
 				       int width,   /* size of window */
 				       int height,
-				       float **e)  /* return values */
+				       float e[6])  /* return values */
 {
   register int hw = width/2, hh = height/2;
   register int i, j;
   register float diff,  diffgradx,  diffgrady;
 
   /* Set values to zero */  
-  for(i = 0; i < 6; i++) e[i][0] = 0.0; 
+  for(i = 0; i < 6; i++) e[i] = 0.0; 
   
   /* Compute values */
   for (j = -hh ; j <= hh ; j++) {
@@ -845,16 +1246,16 @@ static void _am_compute6by1ErrorVector(
       diff = *imgdiff++;
       diffgradx = diff * (*gradx++);
       diffgrady = diff * (*grady++);
-      e[0][0] += diffgradx * i;
-      e[1][0] += diffgrady * i;
-      e[2][0] += diffgradx * j; 
-      e[3][0] += diffgrady * j; 
-      e[4][0] += diffgradx;
-      e[5][0] += diffgrady; 
+      e[0] += diffgradx * i;
+      e[1] += diffgrady * i;
+      e[2] += diffgradx * j; 
+      e[3] += diffgrady * j; 
+      e[4] += diffgradx;
+      e[5] += diffgrady; 
     }
   }
   
-  for(i = 0; i < 6; i++) e[i][0] *= 0.5;
+  for(i = 0; i < 6; i++) e[i] *= 0.5;
   
 }
 
@@ -869,7 +1270,7 @@ static void _am_compute4by4GradientMatrix(
 					  _FloatWindow grady,
 					  int width,   /* size of window */
 					  int height,
-					  float **T)  /* return values */
+					  float T[4][4])  /* return values */
 {
   register int hw = width/2, hh = height/2;
   register int i, j;
@@ -924,14 +1325,14 @@ static void _am_compute4by1ErrorVector(
 				       _FloatWindow grady,
 				       int width,   /* size of window */
 				       int height,
-				       float **e)  /* return values */
+				       float e[4])  /* return values */
 {
   register int hw = width/2, hh = height/2;
   register int i, j;
   register float diff,  diffgradx,  diffgrady;
 
   /* Set values to zero */  
-  for(i = 0; i < 4; i++) e[i][0] = 0.0; 
+  for(i = 0; i < 4; i++) e[i] = 0.0; 
   
   /* Compute values */
   for (j = -hh ; j <= hh ; j++) {
@@ -939,14 +1340,14 @@ static void _am_compute4by1ErrorVector(
       diff = *imgdiff++;
       diffgradx = diff * (*gradx++);
       diffgrady = diff * (*grady++);
-      e[0][0] += diffgradx * i + diffgrady * j;
-      e[1][0] += diffgrady * i - diffgradx * j;
-      e[2][0] += diffgradx;
-      e[3][0] += diffgrady;
+      e[0] += diffgradx * i + diffgrady * j;
+      e[1] += diffgrady * i - diffgradx * j;
+      e[2] += diffgradx;
+      e[3] += diffgrady;
     }
   }
   
-  for(i = 0; i < 4; i++) e[i][0] *= 0.5;
+  for(i = 0; i < 4; i++) e[i] *= 0.5;
   
 }
 
@@ -998,7 +1399,8 @@ static int _am_trackFeatureAffine(
 
 
   _FloatWindow imgdiff, gradx, grady;
-  float gxx, gxy, gyy, ex, ey, dx, dy;
+  _FloatWindow win1 = NULL, win2 = NULL;
+  float gxx, gxy, gyy, ex, ey, dx, dy, alpha;
   int iteration = 0;
   int status = 0;
   int hw = width/2;
@@ -1007,8 +1409,8 @@ static int _am_trackFeatureAffine(
   int nr1 = img1->nrows;
   int nc2 = img2->ncols;
   int nr2 = img2->nrows;
-  float **a;
-  float **T; 
+  float T[6][6], a[6];
+  float T4[4][4];
   float one_plus_eps = 1.001f;   /* To prevent rounding errors */
   float old_x2 = *x2;
   float old_y2 = *y2;
@@ -1017,6 +1419,7 @@ static int _am_trackFeatureAffine(
 #ifdef DEBUG_AFFINE_MAPPING
   char fname[80];
   _KLT_FloatImage aff_diff_win = _KLTCreateFloatImage(width,height);
+  aff_diff_win->stride = width;	/* its data are set to windows below */
   printf("starting location x2=%f y2=%f\n", *x2, *y2);
 #endif
   
@@ -1024,8 +1427,10 @@ static int _am_trackFeatureAffine(
   imgdiff = _allocateFloatWindow(width, height);
   gradx   = _allocateFloatWindow(width, height);
   grady   = _allocateFloatWindow(width, height);
-  T = _am_matrix(6,6);
-  a = _am_matrix(6,1);
+  if (lighting_insensitive)  {
+    win1  = _allocateFloatWindow(width, height);
+    win2  = _allocateFloatWindow(width, height);
+  }
 
   /* Iteratively update the window position */
   do  {
@@ -1044,9 +1449,9 @@ static int _am_trackFeatureAffine(
       /* Compute gradient and difference windows */
       if (lighting_insensitive) {
         _computeIntensityDifferenceLightingInsensitive(img1, img2, x1, y1, *x2, *y2, 
-                                    width, height, imgdiff);
+                                    width, height, win1, win2, imgdiff, &alpha);
         _computeGradientSumLightingInsensitive(gradx1, grady1, gradx2, grady2, 
-			    img1, img2, x1, y1, *x2, *y2, width, height, gradx, grady);
+			    x1, y1, *x2, *y2, width, height, alpha, gradx, grady);
       } else {
         _computeIntensityDifference(img1, img2, x1, y1, *x2, *y2, 
                                     width, height, imgdiff);
@@ -1135,32 +1540,32 @@ static int _am_trackFeatureAffine(
       switch(affine_map){
       case 1:
 	_am_compute4by1ErrorVector(imgdiff, gradx, grady, width, height, a);
-	_am_compute4by4GradientMatrix(gradx, grady, width, height, T);
+	_am_compute4by4GradientMatrix(gradx, grady, width, height, T4);
 	
-	status = _am_gauss_jordan_elimination(T,4,a,1);
+	status = _am_solveLDLT4(T4, a);
 	
-	*Axx += a[0][0];
-	*Ayx += a[1][0];
+	*Axx += a[0];
+	*Ayx += a[1];
 	*Ayy = *Axx;
 	*Axy = -(*Ayx);
 	
-	dx = a[2][0];
-	dy = a[3][0];
+	dx = a[2];
+	dy = a[3];
 	
 	break;
       case 2:
 	_am_compute6by1ErrorVector(imgdiff, gradx, grady, width, height, a);
 	_am_compute6by6GradientMatrix(gradx, grady, width, height, T);
       
-	status = _am_gauss_jordan_elimination(T,6,a,1);
+	status = _am_solveLDLT6(T, a);
 	
-	*Axx += a[0][0];
-	*Ayx += a[1][0];
-	*Axy += a[2][0];
-	*Ayy += a[3][0];
+	*Axx += a[0];
+	*Ayx += a[1];
+	*Axy += a[2];
+	*Ayy += a[3];
 
-	dx = a[4][0];
-	dy = a[5][0];
+	dx = a[4];
+	dy = a[5];
       
 	break;
       }
@@ -1200,8 +1605,6 @@ static int _am_trackFeatureAffine(
 #endif   
     }  while ( !convergence  && iteration < max_iterations); 
     /*}  while ( (fabs(dx)>=th || fabs(dy)>=th || (affine_map && iteration < 8) ) && iteration < max_iterations); */
-  _am_free_matrix(T);
-  _am_free_matrix(a);
 
   /* Check whether window is out of bounds */
   if (*x2-hw < 0.0f || nc2-(*x2+hw) < one_plus_eps || 
@@ -1230,6 +1633,7 @@ static int _am_trackFeatureAffine(
 
   /* Free memory */
   free(imgdiff);  free(gradx);  free(grady);
+  free(win1);  free(win2);
 
 #ifdef DEBUG_AFFINE_MAPPING
   printf("iter = %d status=%d\n", iteration, status);
@@ -1247,28 +1651,203 @@ static int _am_trackFeatureAffine(
 
 
 /*********************************************************************
- * KLTTrackFeatures
+ * KLTPrepareImage
  *
- * Tracks feature points from one image to the next.
+ * Smooths an image, and computes its pyramid and gradient pyramids,
+ * as KLTTrackFeatures does with its images.  The result can be passed
+ * to KLTSelectGoodFeaturesPrepared, KLTTrackPreparedFeatures and
+ * KLTReplaceLostFeaturesPrepared, so that a frame is only processed
+ * once however often it is used.  It stays valid as long as the
+ * window size, pyramid and sigma parameters of tc do not change.
+ * With tc->fixedPointPyramids, the pyramids are stored in fixed point
+ * for tracking, and level 0 is also kept as floats for selection.
  */
-void KLTTrackFeatures(
+
+KLT_PreparedImage KLTPrepareImage(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img,
+  int ncols,
+  int nrows)
+{
+	return KLTPrepareImageStrided(tc, img, ncols, nrows, ncols);
+}
+
+
+/*********************************************************************
+ * KLTPrepareImageStrided
+ *
+ * Same as KLTPrepareImage, for an image whose rows are stride pixels
+ * apart.  img is only read here, so a capture buffer can be released
+ * once this returns.
+ */
+
+KLT_PreparedImage KLTPrepareImageStrided(
+  KLT_TrackingContext tc,
+  KLT_PixelType *img,
+  int ncols,
+  int nrows,
+  int stride)
+{
+	KLT_PreparedImage prep;
+	_KLT_FloatImage floatimg;
+	_KLT_Pyramid pyramid, pyramid_gradx, pyramid_grady;
+	int i;
+
+	if (stride < ncols)
+		KLTError("(KLTPrepareImageStrided) Stride %d is less than the "
+			"width %d", stride, ncols);
+
+	prep = (KLT_PreparedImage) malloc(sizeof(KLT_PreparedImageRec));
+	if (prep == NULL)
+		KLTError("(KLTPrepareImage)  Out of memory");
+	prep->ncols = ncols;
+	prep->nrows = nrows;
+	prep->nPyramidLevels = tc->nPyramidLevels;
+	prep->subsampling = tc->subsampling;
+	prep->smooth_sigma = _KLTComputeSmoothSigma(tc);
+	prep->grad_sigma = tc->grad_sigma;
+	prep->pyramid_sigma_fact = tc->pyramid_sigma_fact;
+
+	floatimg = _KLTCreateFloatImage(ncols, nrows);
+	_KLTToSmoothedFloatImage(img, ncols, nrows, stride, prep->smooth_sigma, floatimg);
+	prep->select_img = prep->select_gradx = prep->select_grady = NULL;
+
+	if (tc->fixedPointPyramids)  {
+		_KLT_FloatImage gradx, grady;
+
+		gradx = _KLTCreateFloatImage(ncols, nrows);
+		grady = _KLTCreateFloatImage(ncols, nrows);
+		_KLTComputeGradients(floatimg, tc->grad_sigma, gradx, grady);
+		pyramid = _KLTCreateEmptyPyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+		pyramid_gradx = _KLTCreateEmptyPyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+		pyramid_grady = _KLTCreateEmptyPyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+		_KLTComputeFixedPointPyramids(floatimg, gradx, grady,
+			tc->pyramid_sigma_fact, tc->grad_sigma,
+			pyramid, pyramid_gradx, pyramid_grady);
+		prep->select_img = floatimg;
+		prep->select_gradx = gradx;
+		prep->select_grady = grady;
+		prep->pyramid = pyramid;
+		prep->pyramid_gradx = pyramid_gradx;
+		prep->pyramid_grady = pyramid_grady;
+		return prep;
+	}
+
+	pyramid = _KLTCreatePyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+	_KLTComputePyramid(floatimg, pyramid, tc->pyramid_sigma_fact);
+	pyramid_gradx = _KLTCreatePyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+	pyramid_grady = _KLTCreatePyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+	for (i = 0 ; i < tc->nPyramidLevels ; i++)
+		_KLTComputeGradients(pyramid->img[i], tc->grad_sigma, 
+		pyramid_gradx->img[i],
+		pyramid_grady->img[i]);
+	_KLTFreeFloatImage(floatimg);
+
+	prep->pyramid = pyramid;
+	prep->pyramid_gradx = pyramid_gradx;
+	prep->pyramid_grady = pyramid_grady;
+	return prep;
+}
+
+
+/*********************************************************************
+ * _KLTCheckPreparedImage
+ *
+ * Aborts if prep was computed with other parameters than tc's.
+ */
+
+void _KLTCheckPreparedImage(
+  KLT_TrackingContext tc,
+  KLT_PreparedImage prep,
+  const char *caller)
+{
+	if (prep->nPyramidLevels != tc->nPyramidLevels ||
+		prep->subsampling != tc->subsampling ||
+		prep->smooth_sigma != _KLTComputeSmoothSigma(tc) ||
+		prep->grad_sigma != tc->grad_sigma ||
+		prep->pyramid_sigma_fact != tc->pyramid_sigma_fact)
+		KLTError("(%s) Prepared image was computed with different "
+			"tracking context parameters", caller);
+}
+
+
+/*********************************************************************
+ * _computeTrackingPyramids
+ *
+ * Builds the image and gradient pyramids of floatimg for tracking.
+ * With fixedPointPyramids set, each level is stored in 16-bit fixed
+ * point as soon as it is computed, so the float pyramids never exist
+ * in full.
+ */
+
+static void _computeTrackingPyramids(
+	KLT_TrackingContext tc,
+	_KLT_FloatImage floatimg,
+	_KLT_Pyramid *pyramid,
+	_KLT_Pyramid *pyramid_gradx,
+	_KLT_Pyramid *pyramid_grady)
+{
+	int ncols = floatimg->ncols, nrows = floatimg->nrows;
+	int i;
+
+	if (tc->fixedPointPyramids)  {
+		*pyramid = _KLTCreateEmptyPyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+		*pyramid_gradx = _KLTCreateEmptyPyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+		*pyramid_grady = _KLTCreateEmptyPyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+		_KLTComputeFixedPointPyramids(floatimg, NULL, NULL, tc->pyramid_sigma_fact, tc->grad_sigma,
+			*pyramid, *pyramid_gradx, *pyramid_grady);
+		return;
+	}
+
+	//
+	*pyramid = _KLTCreatePyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+	_KLTComputePyramid(floatimg, *pyramid, tc->pyramid_sigma_fact);
+	//ݶ
+	*pyramid_gradx = _KLTCreatePyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+	*pyramid_grady = _KLTCreatePyramid(ncols, nrows, tc->subsampling, tc->nPyramidLevels);
+	for (i = 0 ; i < tc->nPyramidLevels ; i++)
+		_KLTComputeGradients((*pyramid)->img[i], tc->grad_sigma, 
+		(*pyramid_gradx)->img[i],
+		(*pyramid_grady)->img[i]);
+}
+
+
+/*********************************************************************
+ * _trackFeatureList
+ *
+ * Body of KLTTrackFeatures and KLTTrackPreparedFeatures: tracks
+ * feature points from one image to the next, taking the images
+ * either raw (img1, img2, with rows stride pixels apart) or prepared
+ * (prep1, prep2).
+ */
+
+static void _trackFeatureList(
 					  KLT_TrackingContext tc,
 					  KLT_PixelType *img1,
 					  KLT_PixelType *img2,
+					  KLT_PreparedImage prep1,
+					  KLT_PreparedImage prep2,
 					  int ncols,
 					  int nrows,
+					  int stride,
 					  KLT_FeatureList featurelist,
 					  const char *dir,//·ļڴӡʱͼ·
 					  const char *infilename_1,
 					  const char *infilename_2 )
 {
-	_KLT_FloatImage tmpimg, floatimg1, floatimg2;
+	_KLT_FloatImage floatimg1, floatimg2 = NULL;
 	_KLT_Pyramid pyramid1, pyramid1_gradx, pyramid1_grady,
 		pyramid2, pyramid2_gradx, pyramid2_grady;
 	_KLT_Pyramid tmp_pyramid;//ڴӡڵʱͼںһ֡img2
 	float subsampling = (float) tc->subsampling;
 	float xloc, yloc, xlocout, ylocout;
-	int val;
+	float xback, yback, xpred, ypred, xstart, ystart, xprev, yprev;
+	float *disp;
+	_FloatWindow fbwindows = NULL;
+	int ndisp = 0, startLevel;
+	int nStill, nSkipped = 0;
+	KLT_BOOL adapt;
+	int val, valback;
 	int indx, r;
 	KLT_BOOL floatimg1_created = FALSE;
 	int i;
@@ -1304,13 +1883,17 @@ void KLTTrackFeatures(
 			"Changing to %d.\n", tc->window_height);
 	}
 
-	/* Create temporary image */
-	tmpimg = _KLTCreateFloatImage(ncols, nrows);
-
 	/* ǰһ֡ͼĴfloat, smoothing, computing gradient.*/
 	/* Process first image by converting, smoothing, computing */
 	/* pyramid and computing gradient pyramids */
-	if (tc->sequentialMode && tc->pyramid_last != NULL)  {
+	if (prep1 != NULL)  {
+		if (tc->fixedPointPyramids && prep1->select_img == NULL)
+			KLTWarning("(KLTTrackPreparedFeatures) The prepared images were "
+				"made without tc->fixedPointPyramids; tracking in float");
+		pyramid1 = (_KLT_Pyramid) prep1->pyramid;
+		pyramid1_gradx = (_KLT_Pyramid) prep1->pyramid_gradx;
+		pyramid1_grady = (_KLT_Pyramid) prep1->pyramid_grady;
+	} else if (tc->sequentialMode && tc->pyramid_last != NULL)  {
 		pyramid1 = (_KLT_Pyramid) tc->pyramid_last;
 		pyramid1_gradx = (_KLT_Pyramid) tc->pyramid_last_gradx;
 		pyramid1_grady = (_KLT_Pyramid) tc->pyramid_last_grady;
@@ -1323,36 +1906,30 @@ void KLTTrackFeatures(
 	} else  {
 		floatimg1_created = TRUE;
 		floatimg1 = _KLTCreateFloatImage(ncols, nrows);
-		_KLTToFloatImage(img1, ncols, nrows, tmpimg);
-		_KLTComputeSmoothedImage(tmpimg, _KLTComputeSmoothSigma(tc), floatimg1); 
-		//
-		pyramid1 = _KLTCreatePyramid(ncols, nrows, (int) subsampling, tc->nPyramidLevels);
-		_KLTComputePyramid(floatimg1, pyramid1, tc->pyramid_sigma_fact);
-		//ݶ
-		pyramid1_gradx = _KLTCreatePyramid(ncols, nrows, (int) subsampling, tc->nPyramidLevels);
-		pyramid1_grady = _KLTCreatePyramid(ncols, nrows, (int) subsampling, tc->nPyramidLevels);
-		for (i = 0 ; i < tc->nPyramidLevels ; i++)
-			_KLTComputeGradients(pyramid1->img[i], tc->grad_sigma, 
-			pyramid1_gradx->img[i],
-			pyramid1_grady->img[i]);
+		_KLTToSmoothedFloatImage(img1, ncols, nrows, stride, _KLTComputeSmoothSigma(tc), floatimg1);
+		_computeTrackingPyramids(tc, floatimg1, &pyramid1, &pyramid1_gradx, &pyramid1_grady);
 	}
 
 	/* һ֡ͼDo the same thing with second image */
-	floatimg2 = _KLTCreateFloatImage(ncols, nrows);
-	_KLTToFloatImage(img2, ncols, nrows, tmpimg);
-	_KLTComputeSmoothedImage(tmpimg, _KLTComputeSmoothSigma(tc), floatimg2);
-	//
-	pyramid2 = _KLTCreatePyramid(ncols, nrows, (int) subsampling, tc->nPyramidLevels);
-	tmp_pyramid = _KLTCreatePyramid(ncols, nrows, (int)subsampling, tc->nPyramidLevels);
-	_KLTComputePyramid(floatimg2, pyramid2, tc->pyramid_sigma_fact);
-	_KLTComputePyramid(floatimg2, tmp_pyramid, tc->pyramid_sigma_fact);
-	//ݶ
-	pyramid2_gradx = _KLTCreatePyramid(ncols, nrows, (int) subsampling, tc->nPyramidLevels);
-	pyramid2_grady = _KLTCreatePyramid(ncols, nrows, (int) subsampling, tc->nPyramidLevels);
-	for (i = 0 ; i < tc->nPyramidLevels ; i++)
-		_KLTComputeGradients(pyramid2->img[i], tc->grad_sigma, 
-		pyramid2_gradx->img[i],
-		pyramid2_grady->img[i]);
+	/* The scribbled copy of img2's pyramid is only for debug output */
+	tmp_pyramid = NULL;
+	if (tc->Count_Feature_Former > 0 || tc->writeInternalImages)
+		tmp_pyramid = _KLTCreatePyramid(ncols, nrows, (int)subsampling, tc->nPyramidLevels);
+	if (prep2 != NULL)  {
+		pyramid2 = (_KLT_Pyramid) prep2->pyramid;
+		pyramid2_gradx = (_KLT_Pyramid) prep2->pyramid_gradx;
+		pyramid2_grady = (_KLT_Pyramid) prep2->pyramid_grady;
+		if (tmp_pyramid != NULL)
+			_KLTComputePyramid(prep2->select_img != NULL ?
+				(_KLT_FloatImage) prep2->select_img : pyramid2->img[0],
+				tmp_pyramid, tc->pyramid_sigma_fact);
+	} else  {
+		floatimg2 = _KLTCreateFloatImage(ncols, nrows);
+		_KLTToSmoothedFloatImage(img2, ncols, nrows, stride, _KLTComputeSmoothSigma(tc), floatimg2);
+		if (tmp_pyramid != NULL)
+			_KLTComputePyramid(floatimg2, tmp_pyramid, tc->pyramid_sigma_fact);
+		_computeTrackingPyramids(tc, floatimg2, &pyramid2, &pyramid2_gradx, &pyramid2_grady);
+	}
 
 	/* ͼмݣ/pyramid*/
 	if (tc->writeInternalImages)  {
@@ -1390,145 +1967,202 @@ void KLTTrackFeatures(
 		}
 	}
 
+	/* Store pyramids as 16-bit fixed point, which halves the memory */
+	/* traffic of the bilinear gathers below.  New pyramids were */
+	/* converted level by level; this only catches a float pyramid */
+	/* kept from the previous call in sequential mode.  Prepared */
+	/* images are converted, or not, by KLTPrepareImage */
+	if (tc->fixedPointPyramids && prep1 == NULL)  {
+		_KLTToFixedPointPyramid(pyramid1);
+		_KLTToFixedPointPyramid(pyramid1_gradx);
+		_KLTToFixedPointPyramid(pyramid1_grady);
+		_KLTToFixedPointPyramid(pyramid2);
+		_KLTToFixedPointPyramid(pyramid2_gradx);
+		_KLTToFixedPointPyramid(pyramid2_grady);
+	}
+
+	/* Displacements of tracked features, for adaptive pyramid levels; */
+	/* at least one element, as malloc(0) may return NULL */
+	disp = (float *) malloc(max(featurelist->nFeatures, 1) * sizeof(float));
+	if (disp == NULL)
+		KLTError("(KLTTrackFeatures)  Out of memory");
+	tc->nLevelsSaved = 0;
+
+	/* Windows of the backward tracks, shared by all features */
+	if (tc->forwardBackwardCheck)  {
+		fbwindows = (_FloatWindow) malloc(7 * tc->window_width * tc->window_height * sizeof(float));
+		if (fbwindows == NULL)
+			KLTError("(KLTTrackFeatures)  Out of memory");
+	}
+
 	/* For each feature, do ... */
 	//ѭÿΪλ For each feature.
 	for (indx = 0 ; indx < featurelist->nFeatures ; indx++)  {
 		
 		KLT_FeatureList fl_tmp;
 
+		/* A prediction is only good for one call */
+		xpred = featurelist->feature[indx]->pred_x;
+		ypred = featurelist->feature[indx]->pred_y;
+		featurelist->feature[indx]->pred_x = -1.0;
+		featurelist->feature[indx]->pred_y = -1.0;
+
 		/* Only track features that are not lost */
 		if (featurelist->feature[indx]->val >= 0)  {
 
 			xloc = featurelist->feature[indx]->x;
 			yloc = featurelist->feature[indx]->y;
-			
-			if (indx < tc->Count_Feature_Former){
-				printf("***feature points:[%d]***\n", indx);
-				printf("initial point in img1:(%6.2f,%6.2f)\n", xloc, yloc);
-			}
-			/* Transform location to coarsest resolution */
-			for (r = tc->nPyramidLevels - 1 ; r >= 0 ; r--)  {
-				xloc /= subsampling;  yloc /= subsampling;
+
+			/* Start the search from the predicted location, if it is */
+			/* inside the image, and from the old location otherwise */
+			if (xpred < 0.0f || xpred > ncols - 1 || ypred < 0.0f || ypred > nrows - 1)  {
+				xpred = xloc;  ypred = yloc;
 			}
-			xlocout = xloc;  ylocout = yloc;
+			xstart = xpred;  ystart = ypred;
+
+			/* With adaptive pyramid levels, start at the finest level */
+			/* that covers the expected motion, and go straight to the */
+			/* finest level once two successive levels have converged */
+			/* without moving the feature.  A feature that fails after */
+			/* skipping levels may have moved more than expected, so it */
+			/* is tracked again through the full pyramid */
+			adapt = tc->adaptivePyramidLevels;
+			startLevel = tc->nPyramidLevels - 1;
+			if (adapt)
+				startLevel = _startPyramidLevel(tc, tc->motion_estimate);
+			do  {
+				nStill = 0;
+				nSkipped = 0;
+				xloc = featurelist->feature[indx]->x;
+				yloc = featurelist->feature[indx]->y;
+				xpred = xstart;  ypred = ystart;
 
-			//ӵͷֱʵĽ㿪ʼڲø˹ţٵ
-			for (r = tc->nPyramidLevels - 1 ; r >= 0 ; r--)  {
+				if (indx < tc->Count_Feature_Former){
+					printf("***feature points:[%d]***\n", indx);
+					printf("initial point in img1:(%6.2f,%6.2f)\n", xloc, yloc);
+				}
+				/* Transform location to coarsest resolution */
+				for (r = tc->nPyramidLevels - 1 ; r >= 0 ; r--)  {
+					xloc /= subsampling;  yloc /= subsampling;
+					xpred /= subsampling;  ypred /= subsampling;
+				}
+				xlocout = xpred;  ylocout = ypred;
 
-				/* Track feature at current resolution */
-				xloc *= subsampling;  yloc *= subsampling;
-				xlocout *= subsampling;  ylocout *= subsampling;
+				//ӵͷֱʵĽ㿪ʼڲø˹ţٵ
+				for (r = tc->nPyramidLevels - 1 ; r >= 0 ; r--)  {
 
-				//ʼʱΪɫڿӻʾڵ
-				//Count_Feature_FormerΪҪʾǰĸ
-				if (indx < tc->Count_Feature_Former){
-					printf("Layer=%d\n", r);
-					isPrint = 1;
-					int place;
-					if (r == 0){//floatתint
-						place = (int)(featurelist->feature[indx]->y)* tmp_pyramid->img[r]->ncols 
-							+ (int)(featurelist->feature[indx]->x);
+					/* Track feature at current resolution */
+					xloc *= subsampling;  yloc *= subsampling;
+					xlocout *= subsampling;  ylocout *= subsampling;
+
+					if (adapt && r > 0 && (r > startLevel || nStill >= 2))  {
+						nSkipped++;
+						continue;
+					}
+					xprev = xlocout;  yprev = ylocout;
+
+					//ʼʱΪɫڿӻʾڵ
+					//Count_Feature_FormerΪҪʾǰĸ
+					if (indx < tc->Count_Feature_Former){
+						printf("Layer=%d\n", r);
+						isPrint = 1;
+						int place;
+						if (r == 0){//floatתint
+							place = (int)(featurelist->feature[indx]->y)* tmp_pyramid->img[r]->stride 
+								+ (int)(featurelist->feature[indx]->x);
+						}
+						else
+							place = (int)(yloc)* tmp_pyramid->img[r]->stride + (int)xloc;
+						//ɫΪǻҶͼ
+						tmp_pyramid->img[r]->data[place] = 255.0;
 					}
+					else{
+						isPrint = 0;
+					}
+
+					//ʹýLKPYLK
+					//̣ɲοpptеġPYLK㷨̡
+					val = _trackFeature(xloc, yloc, 
+						&xlocout, &ylocout,
+						pyramid1->img[r], 
+						pyramid1_gradx->img[r], pyramid1_grady->img[r], 
+						pyramid2->img[r], 
+						pyramid2_gradx->img[r], pyramid2_grady->img[r],
+						tmp_pyramid != NULL ? tmp_pyramid->img[r] : NULL, NULL,
+						tc->window_width, tc->window_height,
+						tc->step_factor,	   //size of the Newton step, Default: 1.0.
+						tc->max_iterations,
+						tc->min_determinant,
+						tc->min_displacement, //th for stopping tracking when pixel changes little
+						tc->max_residue,      //th for stopping tracking when residue is large
+						tc->lighting_insensitive,
+						isPrint);
+
+					if (val==KLT_SMALL_DET || val==KLT_OOB)
+						break;
+					if (fabs(xlocout - xprev) < tc->min_displacement &&
+						fabs(ylocout - yprev) < tc->min_displacement)
+						nStill++;
 					else
-						place = (int)(yloc)* tmp_pyramid->img[r]->ncols + (int)xloc;
-					//ɫΪǻҶͼ
-					tmp_pyramid->img[r]->data[place] = 255.0;
-				}
-				else{
-					isPrint = 0;
-				}
+						nStill = 0;
+
+					//ͼӻʾ ڵ·result/inIter
+					//Count_Feature_FormerΪҪʾǰĸ
+					if (indx < tc->Count_Feature_Former){
+						char inIter_dir[_MAX_PATH];
+						if (0 != checkAndBuildOutputDir(dir, inIter_dir, "/inIter")){
+							printf("inIter_dir: create output dir failed");
+							return 0;
+						}				
+						sprintf(pgmfname, "%s/pyLayer%d_inIter_%s.ppm", inIter_dir, r, infilename_2);
+						sprintf(bmpgrayfname, "%s/pyLayer%d_inIter_%s.bmp", inIter_dir, r, infilename_2);
+						_KLTWriteFloatImageToPGM(tmp_pyramid->img[r], pgmfname, bmpgrayfname);
+					}
+				}//end of nPyramidLevels-1
 
-				//ʹýLKPYLK
-				//̣ɲοpptеġPYLK㷨̡
-				val = _trackFeature(xloc, yloc, 
-					&xlocout, &ylocout,
-					pyramid1->img[r], 
-					pyramid1_gradx->img[r], pyramid1_grady->img[r], 
-					pyramid2->img[r], 
-					pyramid2_gradx->img[r], pyramid2_grady->img[r],
-					tmp_pyramid->img[r],
-					tc->window_width, tc->window_height,
-					tc->step_factor,	   //size of the Newton step, Default: 1.0.
-					tc->max_iterations,
-					tc->min_determinant,
-					tc->min_displacement, //th for stopping tracking when pixel changes little
-					tc->max_residue,      //th for stopping tracking when residue is large
-					tc->lighting_insensitive,
-					isPrint);
-
-				if (val==KLT_SMALL_DET || val==KLT_OOB)
+				if (nSkipped == 0)  break;
+				if (val == KLT_TRACKED &&
+					!_outOfBounds(xlocout, ylocout, ncols, nrows, tc->borderx, tc->bordery))
 					break;
+				adapt = FALSE;
+				startLevel = tc->nPyramidLevels - 1;
+			} while (TRUE);
+
+			/* Forward-backward check: track back to the first image and */
+			/* reject the feature if it does not return close to its start */
+			if (tc->forwardBackwardCheck && val == KLT_TRACKED &&
+				!_outOfBounds(xlocout, ylocout, ncols, nrows, tc->borderx, tc->bordery))  {
+				valback = _trackFeatureBackward(tc, 
+					pyramid2, pyramid2_gradx, pyramid2_grady,
+					pyramid1, pyramid1_gradx, pyramid1_grady,
+					xlocout, ylocout, &xback, &yback, fbwindows);
+				xback -= featurelist->feature[indx]->x;
+				yback -= featurelist->feature[indx]->y;
+				if (valback == KLT_SMALL_DET || valback == KLT_OOB ||
+					valback == KLT_LARGE_RESIDUE ||
+					xback*xback + yback*yback > tc->max_fb_error*tc->max_fb_error)
+					val = KLT_LARGE_FB_ERROR;
+			}
 
-				//ͼӻʾ ڵ·result/inIter
-				//Count_Feature_FormerΪҪʾǰĸ
-				if (indx < tc->Count_Feature_Former){
-					char inIter_dir[_MAX_PATH];
-					if (0 != checkAndBuildOutputDir(dir, inIter_dir, "/inIter")){
-						printf("inIter_dir: create output dir failed");
-						return 0;
-					}				
-					sprintf(pgmfname, "%s/pyLayer%d_inIter_%s.ppm", inIter_dir, r, infilename_2);
-					sprintf(bmpgrayfname, "%s/pyLayer%d_inIter_%s.bmp", inIter_dir, r, infilename_2);
-					_KLTWriteFloatImageToPGM(tmp_pyramid->img[r], pgmfname, bmpgrayfname);
-				}
-			}//end of nPyramidLevels-1
+			if (val == KLT_TRACKED)
+				disp[ndisp++] = (float) sqrt((xlocout-xstart)*(xlocout-xstart) +
+				                             (ylocout-ystart)*(ylocout-ystart));
 			
 			/* ¼img2׷ٵ*/
-			if (val == KLT_OOB) {
+			if (_outOfBounds(xlocout, ylocout, ncols, nrows, tc->borderx, tc->bordery))
+				val = KLT_OOB;
+			if (val != KLT_TRACKED)  {
+				featurelist->feature[indx]->lost_x = featurelist->feature[indx]->x;
+				featurelist->feature[indx]->lost_y = featurelist->feature[indx]->y;
 				featurelist->feature[indx]->x   = -1.0;
 				featurelist->feature[indx]->y   = -1.0;
-				featurelist->feature[indx]->val = KLT_OOB;
-				if( featurelist->feature[indx]->aff_img ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img);
-				if( featurelist->feature[indx]->aff_img_gradx ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_gradx);
-				if( featurelist->feature[indx]->aff_img_grady ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_grady);
-				featurelist->feature[indx]->aff_img = NULL;
-				featurelist->feature[indx]->aff_img_gradx = NULL;
-				featurelist->feature[indx]->aff_img_grady = NULL;
-
-			} else if (_outOfBounds(xlocout, ylocout, ncols, nrows, tc->borderx, tc->bordery))  {
-				featurelist->feature[indx]->x   = -1.0;
-				featurelist->feature[indx]->y   = -1.0;
-				featurelist->feature[indx]->val = KLT_OOB;
-				if( featurelist->feature[indx]->aff_img ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img);
-				if( featurelist->feature[indx]->aff_img_gradx ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_gradx);
-				if( featurelist->feature[indx]->aff_img_grady ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_grady);
-				featurelist->feature[indx]->aff_img = NULL;
-				featurelist->feature[indx]->aff_img_gradx = NULL;
-				featurelist->feature[indx]->aff_img_grady = NULL;
-			} else if (val == KLT_SMALL_DET)  {
-				featurelist->feature[indx]->x   = -1.0;
-				featurelist->feature[indx]->y   = -1.0;
-				featurelist->feature[indx]->val = KLT_SMALL_DET;
-				if( featurelist->feature[indx]->aff_img ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img);
-				if( featurelist->feature[indx]->aff_img_gradx ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_gradx);
-				if( featurelist->feature[indx]->aff_img_grady ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_grady);
-				featurelist->feature[indx]->aff_img = NULL;
-				featurelist->feature[indx]->aff_img_gradx = NULL;
-				featurelist->feature[indx]->aff_img_grady = NULL;
-			} else if (val == KLT_LARGE_RESIDUE)  {
-				featurelist->feature[indx]->x   = -1.0;
-				featurelist->feature[indx]->y   = -1.0;
-				featurelist->feature[indx]->val = KLT_LARGE_RESIDUE;
-				if( featurelist->feature[indx]->aff_img ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img);
-				if( featurelist->feature[indx]->aff_img_gradx ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_gradx);
-				if( featurelist->feature[indx]->aff_img_grady ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_grady);
-				featurelist->feature[indx]->aff_img = NULL;
-				featurelist->feature[indx]->aff_img_gradx = NULL;
-				featurelist->feature[indx]->aff_img_grady = NULL;
-			} else if (val == KLT_MAX_ITERATIONS)  {
-				featurelist->feature[indx]->x   = -1.0;
-				featurelist->feature[indx]->y   = -1.0;
-				featurelist->feature[indx]->val = KLT_MAX_ITERATIONS;
-				if( featurelist->feature[indx]->aff_img ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img);
-				if( featurelist->feature[indx]->aff_img_gradx ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_gradx);
-				if( featurelist->feature[indx]->aff_img_grady ) _KLTFreeFloatImage(featurelist->feature[indx]->aff_img_grady);
-				featurelist->feature[indx]->aff_img = NULL;
-				featurelist->feature[indx]->aff_img_gradx = NULL;
-				featurelist->feature[indx]->aff_img_grady = NULL;
+				featurelist->feature[indx]->val = val;
+				_KLTReleaseAffineTemplate(featurelist, indx);
 			} else  {
 				featurelist->feature[indx]->x = xlocout;
 				featurelist->feature[indx]->y = ylocout;
 				featurelist->feature[indx]->val = KLT_TRACKED;
+				tc->nLevelsSaved += nSkipped;
 				if (tc->affineConsistencyCheck >= 0 && val == KLT_TRACKED)  { /*for affine mapping*/
 					int border = 2; /* add border for interpolation */
 
@@ -1538,9 +2172,8 @@ void KLTTrackFeatures(
 
 					if(!featurelist->feature[indx]->aff_img){
 						/* save image and gradient for each feature at finest resolution after first successful track */
-						featurelist->feature[indx]->aff_img = _KLTCreateFloatImage((tc->affine_window_width+border), (tc->affine_window_height+border));
-						featurelist->feature[indx]->aff_img_gradx = _KLTCreateFloatImage((tc->affine_window_width+border), (tc->affine_window_height+border));
-						featurelist->feature[indx]->aff_img_grady = _KLTCreateFloatImage((tc->affine_window_width+border), (tc->affine_window_height+border));
+						_KLTAcquireAffineTemplate(featurelist, indx, 
+							tc->affine_window_width+border, tc->affine_window_height+border);
 						_am_getSubFloatImage(pyramid1->img[0],xloc,yloc,featurelist->feature[indx]->aff_img);
 						_am_getSubFloatImage(pyramid1_gradx->img[0],xloc,yloc,featurelist->feature[indx]->aff_img_gradx);
 						_am_getSubFloatImage(pyramid1_grady->img[0],xloc,yloc,featurelist->feature[indx]->aff_img_grady);
@@ -1572,17 +2205,14 @@ void KLTTrackFeatures(
 							);
 						featurelist->feature[indx]->val = val;
 						if(val != KLT_TRACKED){
+							featurelist->feature[indx]->lost_x = featurelist->feature[indx]->x;
+							featurelist->feature[indx]->lost_y = featurelist->feature[indx]->y;
 							featurelist->feature[indx]->x   = -1.0;
 							featurelist->feature[indx]->y   = -1.0;
 							featurelist->feature[indx]->aff_x = -1.0;
 							featurelist->feature[indx]->aff_y = -1.0;
 							/* free image and gradient for lost feature */
-							_KLTFreeFloatImage(featurelist->feature[indx]->aff_img);
-							_KLTFreeFloatImage(featurelist->feature[indx]->aff_img_gradx);
-							_KLTFreeFloatImage(featurelist->feature[indx]->aff_img_grady);
-							featurelist->feature[indx]->aff_img = NULL;
-							featurelist->feature[indx]->aff_img_gradx = NULL;
-							featurelist->feature[indx]->aff_img_grady = NULL;
+							_KLTReleaseAffineTemplate(featurelist, indx);
 						}else{
 							/*featurelist->feature[indx]->x = xlocout;*/
 							/*featurelist->feature[indx]->y = ylocout;*/
@@ -1594,28 +2224,40 @@ void KLTTrackFeatures(
 		}
 	}
 
-	if (tc->sequentialMode)  {
-		tc->pyramid_last = pyramid2;
-		tc->pyramid_last_gradx = pyramid2_gradx;
-		tc->pyramid_last_grady = pyramid2_grady;
+	/* Prepared images belong to the caller */
+	if (prep1 != NULL)  {
+		if (tmp_pyramid != NULL)  _KLTFreePyramid(tmp_pyramid);
 	} else  {
-		_KLTFreePyramid(pyramid2);
-		_KLTFreePyramid(pyramid2_gradx);
-		_KLTFreePyramid(pyramid2_grady);
+		if (tc->sequentialMode)  {
+			tc->pyramid_last = pyramid2;
+			tc->pyramid_last_gradx = pyramid2_gradx;
+			tc->pyramid_last_grady = pyramid2_grady;
+		} else  {
+			_KLTFreePyramid(pyramid2);
+			_KLTFreePyramid(pyramid2_gradx);
+			_KLTFreePyramid(pyramid2_grady);
+		}
+
+		/* Free memory */
+		if (floatimg1_created)  _KLTFreeFloatImage(floatimg1);
+		_KLTFreeFloatImage(floatimg2);
+		_KLTFreePyramid(pyramid1);
+		_KLTFreePyramid(pyramid1_gradx);
+		_KLTFreePyramid(pyramid1_grady);
+		if (tmp_pyramid != NULL)  _KLTFreePyramid(tmp_pyramid);
 	}
 
-	/* Free memory */
-	_KLTFreeFloatImage(tmpimg);
-	if (floatimg1_created)  _KLTFreeFloatImage(floatimg1);
-	_KLTFreeFloatImage(floatimg2);
-	_KLTFreePyramid(pyramid1);
-	_KLTFreePyramid(pyramid1_gradx);
-	_KLTFreePyramid(pyramid1_grady);
-	_KLTFreePyramid(tmp_pyramid);
+	/* Expected motion for the next call */
+	tc->motion_estimate = _estimateMotion(disp, ndisp);
+	free(disp);
+	free(fbwindows);
 
 	if (KLT_verbose >= 1)  {
 		fprintf(stderr,  "\n\t%d features successfully tracked.\n",
 			KLTCountRemainingFeatures(featurelist));
+		if (tc->adaptivePyramidLevels)
+			fprintf(stderr,  "\t%d pyramid levels skipped, summed over all features.\n",
+				tc->nLevelsSaved);
 		if (tc->writeInternalImages)
 			fprintf(stderr,  "\tWrote images to 'kltimg_tf*.pgm'.\n");
 		fflush(stderr);
@@ -1624,3 +2266,82 @@ void KLTTrackFeatures(
 }
 
 
+/*********************************************************************
+ * KLTTrackFeatures
+ *
+ * Tracks feature points from one image to the next.
+ */
+
+void KLTTrackFeatures(
+					  KLT_TrackingContext tc,
+					  KLT_PixelType *img1,
+					  KLT_PixelType *img2,
+					  int ncols,
+					  int nrows,
+					  KLT_FeatureList featurelist,
+					  const char *dir,
+					  const char *infilename_1,
+					  const char *infilename_2 )
+{
+	_trackFeatureList(tc, img1, img2, NULL, NULL, ncols, nrows, ncols,
+		featurelist, dir, infilename_1, infilename_2);
+}
+
+
+/*********************************************************************
+ * KLTTrackFeaturesStrided
+ *
+ * Same as KLTTrackFeatures, for images whose rows are stride pixels
+ * apart, such as padded capture buffers, or the same region of two
+ * larger images (img1 and img2 pointing at its top-left pixel).
+ */
+
+void KLTTrackFeaturesStrided(
+					  KLT_TrackingContext tc,
+					  KLT_PixelType *img1,
+					  KLT_PixelType *img2,
+					  int ncols,
+					  int nrows,
+					  int stride,
+					  KLT_FeatureList featurelist,
+					  const char *dir,
+					  const char *infilename_1,
+					  const char *infilename_2 )
+{
+	if (stride < ncols)
+		KLTError("(KLTTrackFeaturesStrided) Stride %d is less than the "
+			"width %d", stride, ncols);
+
+	_trackFeatureList(tc, img1, img2, NULL, NULL, ncols, nrows, stride,
+		featurelist, dir, infilename_1, infilename_2);
+}
+
+
+/*********************************************************************
+ * KLTTrackPreparedFeatures
+ *
+ * Same as KLTTrackFeatures, for images prepared by KLTPrepareImage.
+ * Sequential mode is not needed (and not used): prep2 can simply be
+ * passed as prep1 of the next call.  Prepared pyramids are never
+ * converted to fixed point.
+ */
+
+void KLTTrackPreparedFeatures(
+					  KLT_TrackingContext tc,
+					  KLT_PreparedImage prep1,
+					  KLT_PreparedImage prep2,
+					  KLT_FeatureList featurelist,
+					  const char *dir,
+					  const char *infilename_1,
+					  const char *infilename_2 )
+{
+	_KLTCheckPreparedImage(tc, prep1, "KLTTrackPreparedFeatures");
+	_KLTCheckPreparedImage(tc, prep2, "KLTTrackPreparedFeatures");
+	if (prep1->ncols != prep2->ncols || prep1->nrows != prep2->nrows)
+		KLTError("(KLTTrackPreparedFeatures) Images are of different sizes "
+			"(%d by %d and %d by %d)\n",
+			prep1->ncols, prep1->nrows, prep2->ncols, prep2->nrows);
+
+	_trackFeatureList(tc, NULL, NULL, prep1, prep2, prep1->ncols, prep1->nrows, 0,
+		featurelist, dir, infilename_1, infilename_2);
+}
@@ -0,0 +1,258 @@
+/*********************************************************************
+ * trackKernels.cpp
+ *
+ * Window kernels of the translational tracker, specialized at compile
+ * time for the square window sizes in common use (5, 7, 9, 11, 15).
+ * With the window size known, every loop has a constant trip count,
+ * so the compiler can unroll and vectorize them.  Other sizes use the
+ * generic functions in trackFeatures.c.
+ *
+ * Each kernel makes a single sweep over the window, one row at a time,
+ * and accumulates its sums without storing the windows.  All pixels
+ * of a window share the fractional part of its center, so the bilinear
+ * weights are computed once per window instead of once per pixel.
+ *********************************************************************/
+
+/* Standard includes */
+#include <math.h>    /* fabs() */
+#include <stddef.h>  /* NULL */
+
+/* Our includes */
+#include "trackKernels.h"
+
+
+/*********************************************************************
+ * _Bilinear
+ *
+ * Bilinear weights of a W by H window centered at (x,y), and the
+ * offset of its top-left pixel, as used by _interpolate in
+ * trackFeatures.c.  The caller ensures that the window is inside
+ * the image.
+ */
+
+struct _Bilinear  {
+  int offset;
+  float w00, w01, w10, w11;
+};
+
+template <int W, int H>
+static inline _Bilinear _bilinear(
+  _KLT_FloatImage img,
+  float x, float y)   /* center of window */
+{
+  _Bilinear b;
+  int xt = (int) x;   /* coordinates of top-left corner of center pixel */
+  int yt = (int) y;
+  float ax = x - xt;
+  float ay = y - yt;
+
+  b.offset = img->stride * (yt - H/2) + (xt - W/2);
+  b.w00 = (1-ax) * (1-ay);
+  b.w01 =   ax   * (1-ay);
+  b.w10 = (1-ax) *   ay;
+  b.w11 =   ax   *   ay;
+  return b;
+}
+
+
+/*********************************************************************
+ * _sampleRow
+ *
+ * Interpolates row j of a window into row.
+ */
+
+template <int W>
+static inline void _sampleRow(
+  _KLT_FloatImage img,
+  const _Bilinear &b,
+  int j,
+  float *row)         /* output */
+{
+  const int nc = img->stride;
+  int i;
+
+  if (img->fixdata != NULL)  {
+    const short *ptr = img->fixdata + b.offset + j * nc;
+    for (i = 0 ; i < W ; i++)
+      row[i] = ( b.w00 * ptr[i] + b.w01 * ptr[i+1] +
+                 b.w10 * ptr[i+nc] + b.w11 * ptr[i+nc+1] ) * img->fixstep;
+  } else {
+    const float *ptr = img->data + b.offset + j * nc;
+    for (i = 0 ; i < W ; i++)
+      row[i] = b.w00 * ptr[i] + b.w01 * ptr[i+1] +
+               b.w10 * ptr[i+nc] + b.w11 * ptr[i+nc+1];
+  }
+}
+
+
+/*********************************************************************
+ * _gradientMatrixAndErrorVector
+ *
+ * Same as _computeGradientMatrixAndErrorVector in trackFeatures.c.
+ */
+
+template <int W, int H>
+static void _gradientMatrixAndErrorVector(
+  _KLT_FloatImage img1, _KLT_FloatImage gradx1, _KLT_FloatImage grady1,
+  _KLT_FloatImage img2, _KLT_FloatImage gradx2, _KLT_FloatImage grady2,
+  float x1, float y1, float x2, float y2,
+  float step_factor,
+  float *gxx, float *gxy, float *gyy, float *ex, float *ey)
+{
+  _Bilinear b1 = _bilinear<W,H>(img1, x1, y1);
+  _Bilinear b2 = _bilinear<W,H>(img2, x2, y2);
+  float i1[W], i2[W], gx1[W], gx2[W], gy1[W], gy2[W];
+  float sxx = 0.0f, sxy = 0.0f, syy = 0.0f, sx = 0.0f, sy = 0.0f;
+  float diff, gx, gy;
+  int i, j;
+
+  for (j = 0 ; j < H ; j++)  {
+    _sampleRow<W>(img1, b1, j, i1);
+    _sampleRow<W>(img2, b2, j, i2);
+    _sampleRow<W>(gradx1, b1, j, gx1);
+    _sampleRow<W>(gradx2, b2, j, gx2);
+    _sampleRow<W>(grady1, b1, j, gy1);
+    _sampleRow<W>(grady2, b2, j, gy2);
+    for (i = 0 ; i < W ; i++)  {
+      diff = i1[i] - i2[i];
+      gx = gx1[i] + gx2[i];
+      gy = gy1[i] + gy2[i];
+      sxx += gx * gx;
+      sxy += gx * gy;
+      syy += gy * gy;
+      sx += diff * gx;
+      sy += diff * gy;
+    }
+  }
+  *gxx = sxx;  *gxy = sxy;  *gyy = syy;
+  *ex = sx * step_factor;
+  *ey = sy * step_factor;
+}
+
+
+/*********************************************************************
+ * _residue
+ *
+ * Same as _computeResidue in trackFeatures.c.
+ */
+
+template <int W, int H>
+static float _residue(
+  _KLT_FloatImage img1, _KLT_FloatImage img2,
+  float x1, float y1, float x2, float y2)
+{
+  _Bilinear b1 = _bilinear<W,H>(img1, x1, y1);
+  _Bilinear b2 = _bilinear<W,H>(img2, x2, y2);
+  float i1[W], i2[W];
+  float sum = 0.0f;
+  int i, j;
+
+  for (j = 0 ; j < H ; j++)  {
+    _sampleRow<W>(img1, b1, j, i1);
+    _sampleRow<W>(img2, b2, j, i2);
+    for (i = 0 ; i < W ; i++)
+      sum += (float) fabs(i1[i] - i2[i]);
+  }
+  return sum;
+}
+
+
+/*********************************************************************
+ * _gradientMatrixAndErrorVectorFromTemplate
+ *
+ * Same as _computeGradientMatrixAndErrorVectorFromTemplate in
+ * trackFeatures.c.  The template windows are W by H, row by row.
+ */
+
+template <int W, int H>
+static void _gradientMatrixAndErrorVectorFromTemplate(
+  const float *tmpl, const float *tmpl_gradx, const float *tmpl_grady,
+  _KLT_FloatImage img2, _KLT_FloatImage gradx2, _KLT_FloatImage grady2,
+  float x2, float y2,
+  float step_factor,
+  float *gxx, float *gxy, float *gyy, float *ex, float *ey)
+{
+  _Bilinear b2 = _bilinear<W,H>(img2, x2, y2);
+  float i2[W], gx2[W], gy2[W];
+  float sxx = 0.0f, sxy = 0.0f, syy = 0.0f, sx = 0.0f, sy = 0.0f;
+  float diff, gx, gy;
+  int i, j;
+
+  for (j = 0 ; j < H ; j++)  {
+    _sampleRow<W>(img2, b2, j, i2);
+    _sampleRow<W>(gradx2, b2, j, gx2);
+    _sampleRow<W>(grady2, b2, j, gy2);
+    for (i = 0 ; i < W ; i++)  {
+      diff = tmpl[j*W+i] - i2[i];
+      gx = tmpl_gradx[j*W+i] + gx2[i];
+      gy = tmpl_grady[j*W+i] + gy2[i];
+      sxx += gx * gx;
+      sxy += gx * gy;
+      syy += gy * gy;
+      sx += diff * gx;
+      sy += diff * gy;
+    }
+  }
+  *gxx = sxx;  *gxy = sxy;  *gyy = syy;
+  *ex = sx * step_factor;
+  *ey = sy * step_factor;
+}
+
+
+/*********************************************************************
+ * _residueFromTemplate
+ *
+ * Same as _computeResidueFromTemplate in trackFeatures.c.
+ */
+
+template <int W, int H>
+static float _residueFromTemplate(
+  const float *tmpl, _KLT_FloatImage img2,
+  float x2, float y2)
+{
+  _Bilinear b2 = _bilinear<W,H>(img2, x2, y2);
+  float i2[W];
+  float sum = 0.0f;
+  int i, j;
+
+  for (j = 0 ; j < H ; j++)  {
+    _sampleRow<W>(img2, b2, j, i2);
+    for (i = 0 ; i < W ; i++)
+      sum += (float) fabs(tmpl[j*W+i] - i2[i]);
+  }
+  return sum;
+}
+
+
+/*********************************************************************
+ * _KLTGetWindowKernels
+ *
+ * RETURNS
+ * the kernels specialized for a width by height window, or NULL if
+ * there are none.
+ */
+
+#define _WINDOW_KERNELS(W) \
+  { _gradientMatrixAndErrorVector<W,W>, _residue<W,W>, \
+    _gradientMatrixAndErrorVectorFromTemplate<W,W>, _residueFromTemplate<W,W> }
+
+static _KLT_WindowKernelsRec kernels5  = _WINDOW_KERNELS(5);
+static _KLT_WindowKernelsRec kernels7  = _WINDOW_KERNELS(7);
+static _KLT_WindowKernelsRec kernels9  = _WINDOW_KERNELS(9);
+static _KLT_WindowKernelsRec kernels11 = _WINDOW_KERNELS(11);
+static _KLT_WindowKernelsRec kernels15 = _WINDOW_KERNELS(15);
+
+_KLT_WindowKernels _KLTGetWindowKernels(
+  int width,
+  int height)
+{
+  if (width != height)  return NULL;
+  switch (width)  {
+    case 5:   return &kernels5;
+    case 7:   return &kernels7;
+    case 9:   return &kernels9;
+    case 11:  return &kernels11;
+    case 15:  return &kernels15;
+    default:  return NULL;
+  }
+}
@@ -0,0 +1,412 @@
+/*********************************************************************
+ * videoReader.cpp
+ *
+ * Reads grey-level frames from a video file one after another: raw
+ * 8-bit frames, YUV4MPEG2 (luma only), or PGM images one after
+ * another.  The file is opened once, and frames go into a fixed ring
+ * of buffers allocated when it is opened.
+ *
+ * The ring has nHeld + readAhead buffers.  Frame f goes into buffer
+ * f % (nHeld + readAhead), which is free once frame f - nHeld -
+ * readAhead is no longer among the last nHeld frames returned.  With
+ * readAhead > 0 a thread fills the ring ahead of the caller;
+ * otherwise each call reads one frame.
+ *********************************************************************/
+
+/* Standard includes */
+#include <stdio.h>   /* fopen(), fread() */
+#include <stdlib.h>  /* malloc() */
+#include <string.h>  /* strncmp() */
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/* Our includes */
+#include "pnmio.h"
+#include "videoReader.h"
+extern "C" {
+#include "error.h"
+}
+
+#define Y4MLINELENGTH	256
+#define MAGICLENGTH	9	/* "YUV4MPEG2" */
+
+
+struct _VideoReaderState  {
+  FILE *fp;
+  int nBuffers;
+  int nHeld;
+  unsigned char **buffer;
+  long chromaBytes;		/* Y4M: bytes after the luma plane */
+  unsigned char *scratch;	/* Y4M: chroma, if the file can't seek */
+  unsigned char head[MAGICLENGTH];	/* bytes read to tell the format */
+  int nhead, headpos;		/* raw: how many, and how many used */
+
+  /* read-ahead only */
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable produced;
+  std::condition_variable consumed;
+  int nDecoded;			/* frames in the ring so far */
+  bool eof;
+  bool stop;
+  bool threaded;
+};
+
+
+/*********************************************************************
+ * _readLine
+ *
+ * Reads a header line of a Y4M file, without its newline, after the
+ * n characters already in line.  Returns FALSE at the end of the file.
+ */
+
+static bool _readLine(
+  FILE *fp,
+  char *line,
+  int n)
+{
+  int c;
+
+  while ((c = fgetc(fp)) != EOF && c != '\n')
+    if (n < Y4MLINELENGTH - 1)  line[n++] = (char) c;
+  line[n] = '\0';
+  return c != EOF || n > 0;
+}
+
+
+/* Parses a Y4M stream header: size and chroma layout.  The magic */
+/* number may already have been read, to tell the format */
+static void _readY4MHeader(
+  VideoReader vr,
+  _VideoReaderState *st,
+  bool magicRead)
+{
+  char line[Y4MLINELENGTH], *tok;
+  const char *chroma = "420";
+  long cw, ch;
+
+  strcpy(line, magicRead ? "YUV4MPEG2" : "");
+  if (!_readLine(st->fp, line, (int) strlen(line)) ||
+      strncmp(line, "YUV4MPEG2", 9) != 0)
+    KLTError("(videoOpenFile) Not a YUV4MPEG2 file");
+  for (tok = strtok(line + 9, " ") ; tok != NULL ; tok = strtok(NULL, " "))  {
+    if (tok[0] == 'W')  vr->ncols = atoi(tok + 1);
+    else if (tok[0] == 'H')  vr->nrows = atoi(tok + 1);
+    else if (tok[0] == 'I' && tok[1] != 'p' && tok[1] != '?')
+      KLTWarning("(videoOpenFile) Interlaced Y4M file; fields are "
+                 "read as one frame");
+    else if (tok[0] == 'C')  chroma = tok + 1;
+  }
+
+  /* Size of the chroma planes that follow the luma plane */
+  if (strncmp(chroma, "mono", 4) == 0)  {
+    cw = 0;  ch = 0;
+  } else if (strncmp(chroma, "420", 3) == 0)  {
+    cw = (vr->ncols + 1) / 2;  ch = (vr->nrows + 1) / 2;
+  } else if (strncmp(chroma, "422", 3) == 0)  {
+    cw = (vr->ncols + 1) / 2;  ch = vr->nrows;
+  } else if (strncmp(chroma, "411", 3) == 0)  {
+    cw = (vr->ncols + 3) / 4;  ch = vr->nrows;
+  } else if (strncmp(chroma, "444", 3) == 0)  {
+    cw = vr->ncols;  ch = vr->nrows;
+  } else  {
+    KLTError("(videoOpenFile) Y4M chroma layout 'C%s' is not supported",
+             chroma);
+    return;
+  }
+  st->chromaBytes = 2 * cw * ch;
+  if (strcmp(chroma, "444alpha") == 0)
+    st->chromaBytes += (long) vr->ncols * vr->nrows;
+}
+
+
+/*********************************************************************
+ * _matchMagic
+ *
+ * Reads the first bytes of the file into head for as long as they
+ * match magic.  Returns TRUE if the file starts with magic.  A pipe
+ * cannot be rewound, so the bytes read stay in head: a raw file
+ * starts its first frame with them.
+ */
+
+static bool _matchMagic(
+  _VideoReaderState *st,
+  const char *magic)
+{
+  int c, n = (int) strlen(magic);
+
+  if (memcmp(st->head, magic, st->nhead < n ? st->nhead : n) != 0)
+    return false;
+  while (st->nhead < n)  {
+    if ((c = fgetc(st->fp)) == EOF)  return false;
+    st->head[st->nhead++] = (unsigned char) c;
+    if (c != (unsigned char) magic[st->nhead - 1])  return false;
+  }
+  return st->nhead == n;
+}
+
+
+/* Reads nbytes of a raw file, starting with those left in head */
+static size_t _readBytes(
+  _VideoReaderState *st,
+  unsigned char *buf,
+  size_t nbytes)
+{
+  size_t n = (size_t) (st->nhead - st->headpos);
+
+  if (n > nbytes)  n = nbytes;
+  memcpy(buf, st->head + st->headpos, n);
+  st->headpos += (int) n;
+  return n + fread(buf + n, 1, nbytes - n, st->fp);
+}
+
+
+/*********************************************************************
+ * _readFrame
+ *
+ * Reads the next frame into img.  Returns FALSE at the end of the
+ * file; a frame cut short also counts as the end.
+ */
+
+static bool _readFrame(
+  VideoReader vr,
+  _VideoReaderState *st,
+  int frame,
+  unsigned char *img)
+{
+  size_t nbytes = (size_t) vr->ncols * vr->nrows;
+  char line[Y4MLINELENGTH];
+  int c, magic, ncols, nrows, maxval;
+
+  switch (vr->format)  {
+  case VIDEO_Y4M:
+    if (!_readLine(st->fp, line, 0))  return false;
+    if (strncmp(line, "FRAME", 5) != 0)
+      KLTError("(videoReadFrame) Y4M frame %d does not start with FRAME",
+               frame);
+    if (fread(img, 1, nbytes, st->fp) != nbytes)  return false;
+    if (st->chromaBytes > 0 &&
+        (st->scratch != NULL || fseek(st->fp, st->chromaBytes, SEEK_CUR) != 0))  {
+      /* Not seekable (e.g., a pipe); read the chroma and drop it */
+      if (st->scratch == NULL)  {
+        st->scratch = (unsigned char *) malloc(st->chromaBytes);
+        if (st->scratch == NULL)
+          KLTError("(videoReadFrame)  Out of memory");
+      }
+      if (fread(st->scratch, 1, st->chromaBytes, st->fp) !=
+          (size_t) st->chromaBytes)
+        return false;
+    }
+    return true;
+
+  case VIDEO_PGM:
+    /* The header of the first image was read by videoOpenFile */
+    if (frame > 0)  {
+      /* Another image follows, unless only white space is left */
+      do  c = fgetc(st->fp);  while (c == ' ' || c == '\n' || c == '\r' || c == '\t');
+      if (c == EOF)  return false;
+      ungetc(c, st->fp);
+      pnmReadHeader(st->fp, &magic, &ncols, &nrows, &maxval);
+      if (magic != 5 || ncols != vr->ncols || nrows != vr->nrows)
+        KLTError("(videoReadFrame) PGM image %d is P%d, %d x %d; expected "
+                 "P5, %d x %d", frame, magic, ncols, nrows,
+                 vr->ncols, vr->nrows);
+      if (maxval > 255)
+        KLTError("(videoReadFrame) PGM image %d has maxval %d; only 8-bit "
+                 "images (maxval <= 255) are supported", frame, maxval);
+    }
+    return fread(img, 1, nbytes, st->fp) == nbytes;
+
+  default:
+    return _readBytes(st, img, nbytes) == nbytes;
+  }
+}
+
+
+/*********************************************************************
+ * _readAhead
+ *
+ * Body of the read-ahead thread.
+ */
+
+static void _readAhead(
+  VideoReader vr)
+{
+  _VideoReaderState *st = (_VideoReaderState *) vr->state;
+  int frame;
+  bool ok;
+
+  for (;;)  {
+    {
+      std::unique_lock<std::mutex> guard(st->lock);
+      /* Wait until the buffer of the next frame is no longer held */
+      while (!st->stop &&
+             st->nDecoded - vr->nFramesRead >= st->nBuffers - st->nHeld)
+        st->consumed.wait(guard);
+      if (st->stop)  return;
+      frame = st->nDecoded;
+    }
+
+    ok = _readFrame(vr, st, frame, st->buffer[frame % st->nBuffers]);
+
+    {
+      std::lock_guard<std::mutex> guard(st->lock);
+      if (ok)  st->nDecoded++;
+      else  st->eof = true;
+      st->produced.notify_one();
+      if (!ok)  return;
+    }
+  }
+}
+
+
+/*********************************************************************
+ * videoOpenFile
+ */
+
+VideoReader videoOpenFile(
+  char *fname,
+  VideoFormat format,
+  int ncols,
+  int nrows,
+  int nHeld,
+  int readAhead)
+{
+  VideoReader vr;
+  _VideoReaderState *st;
+  bool magicRead = false;
+  int magic, maxval, i;
+
+  if (nHeld < 1 || readAhead < 0)
+    KLTError("(videoOpenFile) Bad buffer counts: %d held, %d read ahead",
+             nHeld, readAhead);
+
+  vr = (VideoReader) malloc(sizeof(VideoReaderRec));
+  if (vr == NULL)
+    KLTError("(videoOpenFile)  Out of memory");
+  st = new _VideoReaderState;
+  st->fp = fopen(fname, "rb");
+  if (st->fp == NULL)
+    KLTError("(videoOpenFile) Can't open file named '%s' for reading", fname);
+  st->chromaBytes = 0;
+  st->scratch = NULL;
+  st->nhead = 0;
+  st->headpos = 0;
+  st->nHeld = nHeld;
+  st->nBuffers = nHeld + readAhead;
+  st->nDecoded = 0;
+  st->eof = false;
+  st->stop = false;
+  st->threaded = (readAhead > 0);
+  vr->state = st;
+  vr->nFramesRead = 0;
+  vr->ncols = ncols;
+  vr->nrows = nrows;
+
+  /* Find the format from the first bytes, which are not read again */
+  if (format == VIDEO_AUTO)  {
+    if (_matchMagic(st, "YUV4MPEG2"))  format = VIDEO_Y4M;
+    else if (_matchMagic(st, "P5"))  format = VIDEO_PGM;
+    else  format = VIDEO_RAW_GREY8;
+    magicRead = (format != VIDEO_RAW_GREY8);
+  }
+  vr->format = format;
+
+  /* Read the size from the header; the first PGM image is then */
+  /* read without its header */
+  if (format == VIDEO_Y4M)
+    _readY4MHeader(vr, st, magicRead);
+  else if (format == VIDEO_PGM)  {
+    magic = 5;
+    if (magicRead)
+      pnmReadHeaderRest(st->fp, &vr->ncols, &vr->nrows, &maxval);
+    else
+      pnmReadHeader(st->fp, &magic, &vr->ncols, &vr->nrows, &maxval);
+    if (magic != 5)
+      KLTError("(videoOpenFile) Magic number is not 'P5', but 'P%d'", magic);
+    if (maxval > 255)
+      KLTError("(videoOpenFile) Maxval of '%s' is %d; only 8-bit images "
+               "(maxval <= 255) are supported", fname, maxval);
+  }
+  if (vr->ncols <= 0 || vr->nrows <= 0)
+    KLTError("(videoOpenFile) The dimensions %d x %d of '%s' are "
+             "unacceptable", vr->ncols, vr->nrows, fname);
+
+  st->buffer = (unsigned char **) malloc(st->nBuffers * sizeof(unsigned char *));
+  if (st->buffer == NULL)
+    KLTError("(videoOpenFile)  Out of memory");
+  for (i = 0 ; i < st->nBuffers ; i++)  {
+    st->buffer[i] = (unsigned char *) malloc((size_t) vr->ncols * vr->nrows);
+    if (st->buffer[i] == NULL)
+      KLTError("(videoOpenFile)  Out of memory for %d frames", st->nBuffers);
+  }
+
+  if (st->threaded)
+    st->thread = std::thread(_readAhead, vr);
+
+  return vr;
+}
+
+
+/*********************************************************************
+ * videoReadFrame
+ *
+ * Returns the next frame, or NULL at the end of the file.  The
+ * buffer belongs to the reader and is reused nHeld frames later.
+ */
+
+unsigned char *videoReadFrame(
+  VideoReader vr)
+{
+  _VideoReaderState *st = (_VideoReaderState *) vr->state;
+  unsigned char *img = st->buffer[vr->nFramesRead % st->nBuffers];
+
+  if (!st->threaded)  {
+    if (st->eof || !_readFrame(vr, st, vr->nFramesRead, img))  {
+      st->eof = true;
+      return NULL;
+    }
+    vr->nFramesRead++;
+    return img;
+  }
+
+  {
+    std::unique_lock<std::mutex> guard(st->lock);
+    while (st->nDecoded <= vr->nFramesRead && !st->eof)
+      st->produced.wait(guard);
+    if (st->nDecoded <= vr->nFramesRead)  return NULL;
+    vr->nFramesRead++;
+    st->consumed.notify_one();
+  }
+  return img;
+}
+
+
+/*********************************************************************
+ * videoCloseFile
+ */
+
+void videoCloseFile(
+  VideoReader vr)
+{
+  _VideoReaderState *st = (_VideoReaderState *) vr->state;
+  int i;
+
+  if (st->threaded)  {
+    {
+      std::lock_guard<std::mutex> guard(st->lock);
+      st->stop = true;
+      st->consumed.notify_one();
+    }
+    st->thread.join();
+  }
+
+  fclose(st->fp);
+  for (i = 0 ; i < st->nBuffers ; i++)
+    free(st->buffer[i]);
+  free(st->buffer);
+  free(st->scratch);
+  delete st;
+  free(vr);
+}
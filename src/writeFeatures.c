@@ -6,28 +6,236 @@
 
 /* Standard includes */
 #include <assert.h>
-#include <ctype.h>		/* isdigit() */
-#include <stdio.h>		/* sprintf(), fprintf(), sscanf(), fscanf() */
-#include <stdlib.h>		/* malloc() */
-#include <string.h>		/* memcpy(), strcmp() */
+#include <ctype.h>		/* isdigit(), isspace() */
+#include <math.h>		/* frexp(), ldexp() */
+#include <stdio.h>		/* sprintf(), fprintf(), fread() */
+#include <stdlib.h>		/* malloc(), strtof() */
+#include <string.h>		/* memcpy(), strcmp(), strstr() */
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>		/* CreateFileMapping(), MapViewOfFile() */
+#else
+#include <fcntl.h>		/* open() */
+#include <sys/mman.h>		/* mmap() */
+#include <sys/stat.h>		/* fstat() */
+#include <unistd.h>		/* close() */
+#endif
 
 /* Our includes */
 #include "base.h"
 #include "error.h"
-#include "pnmio.h"		/* ppmWriteFileRGB() */
+#include "pnmio.h"		/* ppmWriteFileInterleaved() */
 #include "klt.h"
 
 #define BINHEADERLENGTH	6
+#define FT2HEADERLENGTH	64	/* header of KLTFT2 files */
+#define FT2ALIGNMENT	64	/* alignment of KLTFT2 columns */
 
 extern int KLT_verbose;
 
-typedef enum {FEATURE_LIST, FEATURE_HISTORY, FEATURE_TABLE} structureType;
+typedef enum {FEATURE_LIST, FEATURE_HISTORY, FEATURE_TABLE,
+              FEATURE_TABLE_COLUMNAR} structureType;
 
 static char warning_line[] = "!!! Warning:  This is a KLT data file.  "
                              "Do not modify below this line !!!\n";
 static char binheader_fl[BINHEADERLENGTH+1] = "KLTFL1";
 static char binheader_fh[BINHEADERLENGTH+1] = "KLTFH1";
 static char binheader_ft[BINHEADERLENGTH+1] = "KLTFT1";
+static char binheader_ft2[BINHEADERLENGTH+1] = "KLTFT2";
+
+/* Reading KLTFT2 files from a stream; see the KLTFT2 section below */
+static void _readHeaderColumnar(FILE *fp, char *fname,
+                                int *nFrames, int *nFeatures);
+static void _readFeatureTableColumnar(FILE *fp, char *fname,
+                                      KLT_FeatureTable ft);
+
+/*********************************************************************
+ * _OverlayImage
+ *
+ * One interleaved 24-bit image laid out as a PPM or BMP file stores
+ * it, so that the overlay is drawn straight into the bytes that are
+ * written.  Row y starts at row0 + y * step; a BMP image is stored
+ * bottom-up, so its step is negative.
+ */
+
+typedef struct  {
+  uchar *row0;
+  int step;
+  int ir, ib;		/* offsets of red and blue within a pixel */
+  int ncols, nrows;
+} _OverlayImage;
+
+
+/*********************************************************************
+ * _renderGrey
+ *
+ * Fills the image with the grey levels, in one pass.
+ */
+
+static void _renderGrey(
+  _OverlayImage *oi,
+  KLT_PixelType *greyimg)
+{
+  KLT_PixelType *src = greyimg;
+  uchar *dst;
+  int x, y;
+
+  for (y = 0 ; y < oi->nrows ; y++)  {
+    dst = oi->row0 + y * oi->step;
+    for (x = 0 ; x < oi->ncols ; x++)  {
+      dst[0] = dst[1] = dst[2] = (uchar) *src++;
+      dst += 3;
+    }
+  }
+}
+
+
+static void _paintPixel(
+  _OverlayImage *oi,
+  int x,
+  int y,
+  uchar r,
+  uchar g,
+  uchar b)
+{
+  uchar *p;
+
+  if (x < 0 || y < 0 || x >= oi->ncols || y >= oi->nrows)  return;
+  p = oi->row0 + y * oi->step + 3 * x;
+  p[oi->ir] = r;
+  p[1] = g;
+  p[oi->ib] = b;
+}
+
+
+/* 3x3 square centered on the feature, as the overlays have always been */
+static void _paintMarker(
+  _OverlayImage *oi,
+  KLT_Feature f)
+{
+  int x = (int) (f->x + 0.5);
+  int y = (int) (f->y + 0.5);
+  int xx, yy;
+
+  for (yy = y - 1 ; yy <= y + 1 ; yy++)
+    for (xx = x - 1 ; xx <= x + 1 ; xx++)
+      _paintPixel(oi, xx, yy, 255, 0, 0);
+}
+
+
+/* Bresenham line between two feature positions */
+static void _paintSegment(
+  _OverlayImage *oi,
+  KLT_Feature f0,
+  KLT_Feature f1)
+{
+  int x0 = (int) (f0->x + 0.5), y0 = (int) (f0->y + 0.5);
+  int x1 = (int) (f1->x + 0.5), y1 = (int) (f1->y + 0.5);
+  int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+  int sx = (x0 < x1) ? 1 : -1, sy = (y0 < y1) ? 1 : -1;
+  int err = dx + dy, e2;
+
+  for (;;)  {
+    _paintPixel(oi, x0, y0, 255, 255, 0);
+    if (x0 == x1 && y0 == y1)  break;
+    e2 = 2 * err;
+    if (e2 >= dy)  { err += dy;  x0 += sx; }
+    if (e2 <= dx)  { err += dx;  y0 += sy; }
+  }
+}
+
+
+/*********************************************************************
+ * _renderOverlay
+ *
+ * Draws the grey image, then the trails of the last nTrail frames of
+ * ft (if any) in yellow, then the features of fl in red.  A trail
+ * stops where a feature was lost or replaced.
+ */
+
+static void _renderOverlay(
+  _OverlayImage *oi,
+  KLT_PixelType *greyimg,
+  KLT_FeatureList fl,
+  KLT_FeatureTable ft,
+  int frame,
+  int nTrail)
+{
+  int first = (frame - nTrail > 0) ? frame - nTrail : 0;
+  int i, j;
+
+  _renderGrey(oi, greyimg);
+
+  if (ft != NULL)
+    for (j = 0 ; j < ft->nFeatures ; j++)
+      for (i = first ; i < frame ; i++)
+        if (ft->feature[j][i]->val >= 0 &&
+            ft->feature[j][i+1]->val == KLT_TRACKED)
+          _paintSegment(oi, ft->feature[j][i], ft->feature[j][i+1]);
+
+  for (i = 0 ; i < fl->nFeatures ; i++)
+    if (fl->feature[i]->val >= 0)
+      _paintMarker(oi, fl->feature[i]);
+}
+
+
+/*********************************************************************
+ * _writeOverlays
+ *
+ * Renders the overlay once for each file, each time straight into the
+ * layout of that file, reusing one buffer.  Either name may be NULL.
+ */
+
+static void _writeOverlays(
+  KLT_PixelType *greyimg,
+  int ncols,
+  int nrows,
+  KLT_FeatureList fl,
+  KLT_FeatureTable ft,
+  int frame,
+  int nTrail,
+  char *ppmfname,
+  char *bmpfname)
+{
+  int bmpRowBytes = (3 * ncols + 3) / 4 * 4;
+  uchar *buf;
+  _OverlayImage oi;
+  int j;
+
+  if (sizeof(KLT_PixelType) != 1)
+    KLTWarning("(KLTWriteFeaturesToPPM)  KLT_PixelType is not uchar");
+
+  /* BMP rows are padded, so its layout is the larger of the two */
+  buf = (uchar *) malloc((size_t) bmpRowBytes * nrows);
+  if (buf == NULL)
+    KLTError("(KLTWriteFeaturesToPPM)  Out of memory\n");
+  oi.ncols = ncols;
+  oi.nrows = nrows;
+
+  if (ppmfname != NULL)  {
+    oi.row0 = buf;
+    oi.step = 3 * ncols;
+    oi.ir = 0;  oi.ib = 2;
+    _renderOverlay(&oi, greyimg, fl, ft, frame, nTrail);
+    ppmWriteFileInterleaved(ppmfname, buf, ncols, nrows);
+  }
+
+  if (bmpfname != NULL)  {
+    oi.row0 = buf + (size_t) (nrows - 1) * bmpRowBytes;
+    oi.step = -bmpRowBytes;
+    oi.ir = 2;  oi.ib = 0;
+    _renderOverlay(&oi, greyimg, fl, ft, frame, nTrail);
+    /* The padding may still hold pixels of the PPM pass */
+    for (j = 0 ; j < nrows ; j++)
+      memset(buf + (size_t) j * bmpRowBytes + 3 * ncols, 0,
+             bmpRowBytes - 3 * ncols);
+    bmpWriteFileInterleaved(bmpfname, buf, ncols, nrows);
+  }
+
+  free(buf);
+}
+
 
 /*********************************************************************
  * KLTWriteFeatureListToPPMandBMP
@@ -41,54 +249,60 @@ void KLTWriteFeatureListToPPMandBMP(
   char *filename,
   char *bmpfilename)
 {
-  int nbytes = ncols * nrows * sizeof(char);
-  uchar *redimg, *grnimg, *bluimg;
-  int offset;
-  int x, y, xx, yy;
-  int i;
-	
   if (KLT_verbose >= 1) 
     fprintf(stderr, "(KLT) Writing %d features to PPM file: '%s'\n", 
             KLTCountRemainingFeatures(featurelist), filename);
 
-  /* Allocate memory for component images */
-  redimg = (uchar *)  malloc(nbytes);
-  grnimg = (uchar *)  malloc(nbytes);
-  bluimg = (uchar *)  malloc(nbytes);
-  if (redimg == NULL || grnimg == NULL || bluimg == NULL)
-    KLTError("(KLTWriteFeaturesToPPM)  Out of memory\n");
+  _writeOverlays(greyimg, ncols, nrows, featurelist, NULL, 0, 0,
+                 filename, bmpfilename);
+}
 
-  /* Copy grey image to component images */
-  if (sizeof(KLT_PixelType) != 1)
-    KLTWarning("(KLTWriteFeaturesToPPM)  KLT_PixelType is not uchar");
-  memcpy(redimg, greyimg, nbytes);
-  memcpy(grnimg, greyimg, nbytes);
-  memcpy(bluimg, greyimg, nbytes);
-	
-  /* Overlay features in red */
-  for (i = 0 ; i < featurelist->nFeatures ; i++)
-    if (featurelist->feature[i]->val >= 0)  {
-      x = (int) (featurelist->feature[i]->x + 0.5);
-      y = (int) (featurelist->feature[i]->y + 0.5);
-      for (yy = y - 1 ; yy <= y + 1 ; yy++)
-        for (xx = x - 1 ; xx <= x + 1 ; xx++)  
-          if (xx >= 0 && yy >= 0 && xx < ncols && yy < nrows)  {
-            offset = yy * ncols + xx;
-            *(redimg + offset) = 255;
-            *(grnimg + offset) = 0;
-            *(bluimg + offset) = 0;
-          }
-    }
-	
-  /* Write to PPM file */
-  ppmWriteFileRGB(filename, redimg, grnimg, bluimg, ncols, nrows);
 
-  bmpWriteFileRGB(bmpfilename, redimg, grnimg, bluimg, ncols, nrows);
+/*********************************************************************
+ * KLTWriteFeatureTrailsToPPMandBMP
+ *
+ * Like KLTWriteFeatureListToPPMandBMP, with the features of the given
+ * frame of the table, each with a trail of where it was in the
+ * previous nTrail frames.
+ */
 
-  /* Free memory */
-  free(redimg);
-  free(grnimg);
-  free(bluimg);
+void KLTWriteFeatureTrailsToPPMandBMP(
+  KLT_FeatureTable ft,
+  int frame,
+  int nTrail,
+  KLT_PixelType *greyimg,
+  int ncols,
+  int nrows,
+  char *filename,
+  char *bmpfilename)
+{
+  KLT_FeatureListRec fl;
+  int j;
+
+  if (frame < 0 || frame >= ft->nFrames)
+    KLTError("(KLTWriteFeatureTrailsToPPMandBMP) Frame %d is not in the "
+             "table, which has %d frames", frame, ft->nFrames);
+  if (nTrail < 0)
+    KLTError("(KLTWriteFeatureTrailsToPPMandBMP) Trail length %d is "
+             "negative", nTrail);
+
+  /* The features of the frame, without copying them */
+  memset(&fl, 0, sizeof(fl));
+  fl.nFeatures = ft->nFeatures;
+  fl.feature = (KLT_Feature *) malloc(ft->nFeatures * sizeof(KLT_Feature));
+  if (fl.feature == NULL)
+    KLTError("(KLTWriteFeatureTrailsToPPMandBMP)  Out of memory");
+  for (j = 0 ; j < ft->nFeatures ; j++)
+    fl.feature[j] = ft->feature[j][frame];
+
+  if (KLT_verbose >= 1)
+    fprintf(stderr, "(KLT) Writing %d features of frame %d with trails "
+            "to PPM file: '%s'\n", KLTCountRemainingFeatures(&fl), frame,
+            filename);
+
+  _writeOverlays(greyimg, ncols, nrows, &fl, ft, frame, nTrail,
+                 filename, bmpfilename);
+  free(fl.feature);
 }
 
 
@@ -240,6 +454,7 @@ static void _printHeader(
      case FEATURE_LIST: fprintf(fp, "KLT Feature List\n");    break;
      case FEATURE_HISTORY: fprintf(fp, "KLT Feature History\n"); break;
      case FEATURE_TABLE: fprintf(fp, "KLT Feature Table\n");   break;
+     default:  break;	/* KLTFT2 files have no text header */
   }
 
   fprintf(fp, "------------------------------\n\n");
@@ -248,6 +463,7 @@ static void _printHeader(
      case FEATURE_HISTORY: fprintf(fp, "nFrames = %d\n\n", nFrames); break;
      case FEATURE_TABLE: fprintf(fp, "nFrames = %d, nFeatures = %d\n\n",
                                  nFrames, nFeatures);   break;
+     default:  break;
   }
 
   switch (id)  {
@@ -268,6 +484,7 @@ static void _printHeader(
        for (i = 0 ; i < nFrames ; i++) _printNhyphens(fp, width);
        fprintf(fp, "\n");   
        break;
+     default:  break;
   }
 }
 
@@ -313,6 +530,195 @@ static void _printShutdown(
 }
 
 
+/*********************************************************************
+ * Text writer
+ *
+ * Features are formatted into a buffer that is written out in bulk.
+ * Formats of the form "%<w>d" and "%<w>.<p>f" are expanded directly,
+ * rounding like printf; any other format goes through fprintf.
+ */
+
+#define TEXTBUFSIZE	32768
+#define TEXTMAXFIELD	128	/* room one formatted feature may need */
+
+typedef struct  {
+  FILE *fp;
+  char *format;		/* feature format, as built by _printSetupTxt */
+  char type;		/* 'f' or 'd' */
+  int width;		/* width of x and y, or -1 if format must be used */
+  int precision;	/* digits after the point of x and y */
+  int n;		/* number of bytes in buf */
+  char buf[TEXTBUFSIZE];
+}  _TextWriter;
+
+
+static void _initTextWriter(
+  _TextWriter *tw,
+  FILE *fp,
+  char *fmt,	/* e.g., %5.1f or %3d */
+  char *format,
+  char type)
+{
+  char *p = fmt + 1;
+
+  tw->fp = fp;
+  tw->format = format;
+  tw->type = type;
+  tw->n = 0;
+
+  /* Accept "%<w>d" and "%<w>.<p>f", with w up to 40 and p up to 9 */
+  tw->width = tw->precision = 0;
+  while (isdigit((unsigned char) *p) && tw->width <= 40)
+    tw->width = 10 * tw->width + (*p++ - '0');
+  if (*p == '.' && type == 'f' && isdigit((unsigned char) p[1]))  {
+    for (p++ ; isdigit((unsigned char) *p) && tw->precision <= 9 ; p++)
+      tw->precision = 10 * tw->precision + (*p - '0');
+  } else if (type == 'f')
+    tw->precision = 6;
+  if (p == fmt + 1 || fmt[1] == '0' || *p != type || p[1] != '\0' ||
+      tw->width > 40 || tw->precision > 9)
+    tw->width = -1;
+}
+
+
+static void _flushText(
+  _TextWriter *tw)
+{
+  fwrite(tw->buf, sizeof(char), tw->n, tw->fp);
+  tw->n = 0;
+}
+
+
+static void _putString(
+  _TextWriter *tw,
+  char *str)
+{
+  while (*str != '\0')  tw->buf[tw->n++] = *str++;
+}
+
+
+/* Writes the digits of value right-aligned in width characters */
+static void _putDigits(
+  _TextWriter *tw,
+  KLT_BOOL negative,
+  unsigned long long value,
+  int ndigits,	/* minimum number of digits */
+  int point,	/* position of the point from the right, or 0 */
+  int width)
+{
+  char tmp[48];
+  int i = 0;
+
+  do  {
+    if (point > 0 && i == point)  tmp[i++] = '.';
+    tmp[i++] = (char) ('0' + value % 10);
+    value /= 10;
+  } while (value != 0 || i < ndigits + (point > 0));
+  if (negative)  tmp[i++] = '-';
+  for ( ; width > i ; width--)  tw->buf[tw->n++] = ' ';
+  while (i > 0)  tw->buf[tw->n++] = tmp[--i];
+}
+
+
+static void _putInteger(
+  _TextWriter *tw,
+  int integer,
+  int width)
+{
+  unsigned long long magnitude = (integer < 0) ?
+    0 - (unsigned long long) integer : (unsigned long long) integer;
+  _putDigits(tw, integer < 0, magnitude, 1, 0, width);
+}
+
+
+/*********************************************************************
+ * _putFixed
+ *
+ * Equivalent to printf("%<width>.<precision>f", x).  A float is
+ * m * 2^e with m below 2^24, so x * 10^p = m * 5^p * 2^(e+p) is
+ * scaled exactly in 64 bits and then rounded to nearest, ties to
+ * even, as glibc and the C standard do.  Values too large for that,
+ * infinities and NaNs go to sprintf.
+ */
+
+static void _putFixed(
+  _TextWriter *tw,
+  float x,
+  int width,
+  int precision)
+{
+  unsigned long long mant, q, rem, half;
+  int e, shift, i;
+  double frac;
+  KLT_BOOL negative;
+
+  if (x != x || x - x != 0.0f || fabs(x) >= 1.0e9)  {
+    tw->n += sprintf(tw->buf + tw->n, "%*.*f", width, precision, x);
+    return;
+  }
+  negative = (x < 0.0f || (x == 0.0f && 1.0f / x < 0.0f));
+  frac = frexp(fabs(x), &e);
+  mant = (unsigned long long) ldexp(frac, 24);
+  for (i = 0 ; i < precision ; i++)  mant *= 5;
+  shift = e - 24 + precision;
+  if (shift >= 0)
+    q = mant << shift;
+  else if (shift > -63)  {
+    q = mant >> -shift;
+    rem = mant & ((1ULL << -shift) - 1);
+    half = 1ULL << (-shift - 1);
+    if (rem > half || (rem == half && (q & 1)))  q++;
+  } else
+    q = 0;
+  _putDigits(tw, negative, q, precision + 1, precision, width);
+}
+
+
+static void _putFeatureTxt(
+  _TextWriter *tw,
+  KLT_Feature feat)
+{
+  if (tw->n > TEXTBUFSIZE - TEXTMAXFIELD)  _flushText(tw);
+
+  if (tw->width < 0)  {
+    _flushText(tw);
+    _printFeatureTxt(tw->fp, feat, tw->format, tw->type);
+    return;
+  }
+
+  tw->buf[tw->n++] = '(';
+  if (tw->type == 'f')  {
+    _putFixed(tw, feat->x, tw->width, tw->precision);
+    tw->buf[tw->n++] = ',';
+    _putFixed(tw, feat->y, tw->width, tw->precision);
+  } else  {
+    /* Round x & y to nearest integer, unless negative */
+    float x = feat->x;
+    float y = feat->y;
+    if (x >= 0.0) x += 0.5;
+    if (y >= 0.0) y += 0.5;
+    _putInteger(tw, (int) x, tw->width);
+    tw->buf[tw->n++] = ',';
+    _putInteger(tw, (int) y, tw->width);
+  }
+  _putString(tw, ")=");
+  _putInteger(tw, feat->val, 5);
+  tw->buf[tw->n++] = ' ';
+}
+
+
+/* Starts a row with "<indx> | ", the index being width wide */
+static void _putRowStart(
+  _TextWriter *tw,
+  int indx,
+  int width)
+{
+  if (tw->n > TEXTBUFSIZE - TEXTMAXFIELD)  _flushText(tw);
+  _putInteger(tw, indx, width);
+  _putString(tw, " | ");
+}
+
+
 /*********************************************************************
  * KLTWriteFeatureList()
  * KLTWriteFeatureHistory()
@@ -333,6 +739,7 @@ void KLTWriteFeatureList(
 {
   FILE *fp;
   char format[100];
+  _TextWriter tw;
   char type;
   int i;
 
@@ -346,11 +753,13 @@ void KLTWriteFeatureList(
     fp = _printSetupTxt(fname, fmt, format, &type);
     _printHeader(fp, format, FEATURE_LIST, 0, fl->nFeatures);
 	
+    _initTextWriter(&tw, fp, fmt, format, type);
     for (i = 0 ; i < fl->nFeatures ; i++)  {
-      fprintf(fp, "%7d | ", i);
-      _printFeatureTxt(fp, fl->feature[i], format, type);
-      fprintf(fp, "\n");
+      _putRowStart(&tw, i, 7);
+      _putFeatureTxt(&tw, fl->feature[i]);
+      tw.buf[tw.n++] = '\n';
     }
+    _flushText(&tw);
     _printShutdown(fp);
   } else {  /* binary file */
     fp = _printSetupBin(fname);
@@ -371,6 +780,7 @@ void KLTWriteFeatureHistory(
 {
   FILE *fp;
   char format[100];
+  _TextWriter tw;
   char type;
   int i;
 
@@ -384,11 +794,13 @@ void KLTWriteFeatureHistory(
     fp = _printSetupTxt(fname, fmt, format, &type);
     _printHeader(fp, format, FEATURE_HISTORY, fh->nFrames, 0);
 	
+    _initTextWriter(&tw, fp, fmt, format, type);
     for (i = 0 ; i < fh->nFrames ; i++)  {
-      fprintf(fp, "%5d | ", i);
-      _printFeatureTxt(fp, fh->feature[i], format, type);
-      fprintf(fp, "\n");
+      _putRowStart(&tw, i, 5);
+      _putFeatureTxt(&tw, fh->feature[i]);
+      tw.buf[tw.n++] = '\n';
     }
+    _flushText(&tw);
     _printShutdown(fp);
   } else {  /* binary file */
     fp = _printSetupBin(fname);
@@ -410,6 +822,7 @@ void KLTWriteFeatureTable(
 {
   FILE *fp;
   char format[100];
+  _TextWriter tw;
   char type;
   int i, j;
 
@@ -423,12 +836,14 @@ void KLTWriteFeatureTable(
     fp = _printSetupTxt(fname, fmt, format, &type);
     _printHeader(fp, format, FEATURE_TABLE, ft->nFrames, ft->nFeatures);
 
+    _initTextWriter(&tw, fp, fmt, format, type);
     for (j = 0 ; j < ft->nFeatures ; j++)  {
-      fprintf(fp, "%7d | ", j);
+      _putRowStart(&tw, j, 7);
       for (i = 0 ; i < ft->nFrames ; i++)
-        _printFeatureTxt(fp, ft->feature[j][i], format, type);
-      fprintf(fp, "\n");
+        _putFeatureTxt(&tw, ft->feature[j][i]);
+      tw.buf[tw.n++] = '\n';
     }
+    _flushText(&tw);
     _printShutdown(fp);
   } else {  /* binary file */
     fp = _printSetupBin(fname);
@@ -446,19 +861,228 @@ void KLTWriteFeatureTable(
 
 
 
+/*********************************************************************
+ * Text reader
+ *
+ * Text files are read into memory at once and parsed from there.
+ * Every scan stops at the end of the buffer, and a mismatch is
+ * reported with its line number.
+ */
+
+typedef struct  {
+  char *buf;	/* whole file, NUL-terminated */
+  char *p;	/* current position */
+  char *fname;
+}  _TextReader;
+
+
+static void _textError(
+  _TextReader *tr,
+  char *expected)
+{
+  char *q;
+  int line = 1;
+
+  for (q = tr->buf ; q < tr->p ; q++)
+    if (*q == '\n')  line++;
+  KLTError("(_readFeatures) File '%s' is corrupted -- "
+           "(Expected %s at line %d)", tr->fname, expected, line);
+}
+
+
+/* Reads the first nhead bytes, already read from fp into head, and */
+/* the rest of fp into tr.  If fp can seek, the buffer is sized from */
+/* the file; otherwise (pipes, FIFOs) it grows as chunks are read */
+static void _loadText(
+  FILE *fp,
+  char *fname,
+  const char *head,
+  size_t nhead,
+  _TextReader *tr)
+{
+  long start = ftell(fp), end = -1;
+  size_t size = nhead, capacity = nhead + 4096;
+  char *buf;
+
+  if (start >= 0 && fseek(fp, 0, SEEK_END) == 0)  {
+    end = ftell(fp);
+    if (fseek(fp, start, SEEK_SET) != 0)
+      KLTError("(_readFeatures) Cannot seek in file '%s'", fname);
+    /* One spare byte, so that a single read reaches end of file */
+    if (end >= start)  capacity = nhead + (size_t) (end - start) + 2;
+  }
+
+  tr->buf = (char *) malloc(capacity);
+  if (tr->buf == NULL)
+    KLTError("(_readFeatures)  Out of memory");
+  memcpy(tr->buf, head, nhead);
+  for (;;)  {
+    size += fread(tr->buf + size, sizeof(char), capacity - 1 - size, fp);
+    if (size < capacity - 1 || feof(fp) || ferror(fp))  break;
+    capacity *= 2;
+    buf = (char *) realloc(tr->buf, capacity);
+    if (buf == NULL)
+      KLTError("(_readFeatures)  Out of memory");
+    tr->buf = buf;
+  }
+  tr->buf[size] = '\0';
+  tr->p = tr->buf;
+  tr->fname = fname;
+}
+
+
+static void _skipSpace(
+  _TextReader *tr)
+{
+  while (*tr->p == ' ' || *tr->p == '\t' || *tr->p == '\r' || *tr->p == '\n')
+    tr->p++;
+}
+
+
+/* Moves past the next occurrence of c */
+static void _skipPast(
+  _TextReader *tr,
+  char c,
+  char *expected)
+{
+  char *q = strchr(tr->p, c);
+  if (q == NULL)  _textError(tr, expected);
+  tr->p = q + 1;
+}
+
+
+static void _expectChar(
+  _TextReader *tr,
+  char c,
+  char *expected)
+{
+  _skipSpace(tr);
+  if (*tr->p != c)  _textError(tr, expected);
+  tr->p++;
+}
+
+
+/* Matches a whitespace-delimited word, as fscanf("%s") would read it */
+static void _expectWord(
+  _TextReader *tr,
+  char *word)
+{
+  int n = (int) strlen(word);
+
+  _skipSpace(tr);
+  if (strncmp(tr->p, word, n) != 0 ||
+      (tr->p[n] != '\0' && !isspace((unsigned char) tr->p[n])))
+    _textError(tr, word);
+  tr->p += n;
+}
+
+
+static int _readInt(
+  _TextReader *tr)
+{
+  KLT_BOOL negative = FALSE;
+  int value = 0;
+  char *start;
+
+  _skipSpace(tr);
+  if (*tr->p == '-' || *tr->p == '+')  negative = (*tr->p++ == '-');
+  start = tr->p;
+  while (*tr->p >= '0' && *tr->p <= '9')
+    value = 10 * value + (*tr->p++ - '0');
+  if (tr->p == start)  _textError(tr, "an integer");
+  return negative ? -value : value;
+}
+
+
+/*********************************************************************
+ * _readFloat
+ *
+ * Numbers of the form [-]ddd.ddd with at most seven significant
+ * digits and three decimals (all that "%5.1f"-like formats produce)
+ * are converted by a single float division of two exact values,
+ * which rounds as strtof does.  Anything else goes to strtof.
+ */
+
+static float _readFloat(
+  _TextReader *tr)
+{
+  static const float pow10[] = {1.0f, 10.0f, 100.0f, 1000.0f};
+  KLT_BOOL negative = FALSE;
+  long mantissa = 0;
+  int ndigits = 0, ndecimals = -1;
+  char *start, *end;
+  float value;
+
+  _skipSpace(tr);
+  start = tr->p;
+  if (*tr->p == '-' || *tr->p == '+')  negative = (*tr->p++ == '-');
+  for ( ; ; tr->p++)  {
+    if (*tr->p >= '0' && *tr->p <= '9')  {
+      mantissa = 10 * mantissa + (*tr->p - '0');
+      ndigits++;
+      if (ndecimals >= 0)  ndecimals++;
+    } else if (*tr->p == '.' && ndecimals < 0)
+      ndecimals = 0;
+    else  break;
+  }
+  if (ndecimals < 0)  ndecimals = 0;
+
+  if (ndigits > 0 && ndigits <= 7 && ndecimals <= 3 &&
+      *tr->p != 'e' && *tr->p != 'E')  {
+    value = (float) mantissa / pow10[ndecimals];
+    return negative ? -value : value;
+  }
+
+  /* General case */
+  value = strtof(start, &end);
+  if (end == start)  _textError(tr, "a number");
+  tr->p = end;
+  return value;
+}
+
+
+/* Reads "(x,y)=val" */
+static void _readFeatureTxt(
+  _TextReader *tr,
+  KLT_Feature feat)
+{
+  _skipPast(tr, '(', "'('");
+  feat->x = _readFloat(tr);
+  _expectChar(tr, ',', "','");
+  feat->y = _readFloat(tr);
+  _expectChar(tr, ')', "')'");
+  _expectChar(tr, '=', "'='");
+  feat->val = _readInt(tr);
+}
+
+
+/* Reads "indx |" */
+static int _readIndexTxt(
+  _TextReader *tr)
+{
+  int indx = _readInt(tr);
+  _expectChar(tr, '|', "'|'");
+  return indx;
+}
+
+
 static structureType _readHeader(
   FILE *fp,
+  char *fname,
   int *nFrames,
   int *nFeatures,
-  KLT_BOOL *binary)
+  KLT_BOOL *binary,
+  _TextReader *tr)	/* text files are loaded into this */
 {
-#define LINELENGTH 100
-  char line[LINELENGTH];
+  char line[BINHEADERLENGTH+1];
   structureType id;
+  size_t n;
+  char *q;
 	
   /* If file is binary, then read data and return */
-  fread(line, sizeof(char), BINHEADERLENGTH, fp);
-  line[BINHEADERLENGTH] = 0;
+  n = fread(line, sizeof(char), BINHEADERLENGTH, fp);
+  line[n] = 0;
+  tr->buf = NULL;
   if (strcmp(line, binheader_fl) == 0)  {
     assert(nFeatures != NULL);
     fread(nFeatures, sizeof(int), 1, fp);
@@ -476,31 +1100,42 @@ static structureType _readHeader(
     fread(nFeatures, sizeof(int), 1, fp);
     *binary = TRUE;
     return FEATURE_TABLE;
+  } else if (strcmp(line, binheader_ft2) == 0)  {
+    *binary = TRUE;
+    if (nFrames != NULL && nFeatures != NULL)
+      _readHeaderColumnar(fp, fname, nFrames, nFeatures);
+    return FEATURE_TABLE_COLUMNAR;
 
-    /* If file is NOT binary, then continue.*/
+    /* If file is NOT binary, then continue with the bytes read so */
+    /* far, rather than rewinding, which a pipe cannot do */
   } else {
-    rewind(fp);
     *binary = FALSE;
   }
-
-  /* Skip comments until warning line */
-  while (strcmp(line, warning_line) != 0)  {
-    fgets(line, LINELENGTH, fp);
-    if (feof(fp))
+  _loadText(fp, fname, line, n, tr);
+
+  /* Skip comments until warning line (ending in "\n" or "\r\n") */
+  n = strlen(warning_line) - 1;
+  q = tr->buf;
+  while (strncmp(q, warning_line, n) != 0 ||
+         (q[n] != '\n' && (q[n] != '\r' || q[n+1] != '\n')))  {
+    q = strchr(q, '\n');
+    if (q == NULL)
       KLTError("(_readFeatures) File is corrupted -- Couldn't find line:\n"
                "\t%s\n", warning_line);
+    q++;
   }
+  tr->p = q + n;
 
   /* Read 'Feature List', 'Feature History', or 'Feature Table' */
-  while (fgetc(fp) != '-');
-  while (fgetc(fp) != '\n');
-  fgets(line, LINELENGTH, fp);
-  if (strcmp(line, "KLT Feature List\n") == 0) id = FEATURE_LIST;
-  else if (strcmp(line, "KLT Feature History\n") == 0) id = FEATURE_HISTORY;
-  else if (strcmp(line, "KLT Feature Table\n") == 0) id = FEATURE_TABLE;
+  _skipPast(tr, '-', "'---'");
+  _skipPast(tr, '\n', "a new line");
+  if (strncmp(tr->p, "KLT Feature List", 16) == 0) id = FEATURE_LIST;
+  else if (strncmp(tr->p, "KLT Feature History", 19) == 0) id = FEATURE_HISTORY;
+  else if (strncmp(tr->p, "KLT Feature Table", 17) == 0) id = FEATURE_TABLE;
   else
     KLTError("(_readFeatures) File is corrupted -- (Not 'KLT Feature List', "
              "'KLT Feature History', or 'KLT Feature Table')");
+  _skipPast(tr, '\n', "a new line");
 
   /* If there's an incompatibility between the type of file */
   /* and the parameters passed, exit now before we attempt */
@@ -512,55 +1147,26 @@ static structureType _readHeader(
     return id;
 
   /* Read nFeatures and nFrames */
-  while (fgetc(fp) != '-');
-  while (fgetc(fp) != '\n');
-  fscanf(fp, "%s", line);
-  if (id == FEATURE_LIST)  {
-    if (strcmp(line, "nFeatures") != 0)
-      KLTError("(_readFeatures) File is corrupted -- "
-               "(Expected 'nFeatures', found '%s' instead)", line);
-  } else if (strcmp(line, "nFrames") != 0)
-    KLTError("(_readFeatures) File is corrupted -- "
-             "(Expected 'nFrames', found '%s' instead)", line);
-  fscanf(fp, "%s", line);
-  if (strcmp(line, "=") != 0)
-    KLTError("(_readFeatures) File is corrupted -- "
-             "(Expected '=', found '%s' instead)", line);
-  if (id == FEATURE_LIST) fscanf(fp, "%d", nFeatures);
-  else fscanf(fp, "%d", nFrames);
+  _skipPast(tr, '-', "'---'");
+  _skipPast(tr, '\n', "a new line");
+  _expectWord(tr, id == FEATURE_LIST ? "nFeatures" : "nFrames");
+  _expectWord(tr, "=");
+  if (id == FEATURE_LIST) *nFeatures = _readInt(tr);
+  else *nFrames = _readInt(tr);
 
   /* If 'Feature Table', then also get nFeatures */
   if (id == FEATURE_TABLE)  {
-    fscanf(fp, "%s", line);
-    if (strcmp(line, ",") != 0)
-      KLTError("(_readFeatures) File '%s' is corrupted -- "
-               "(Expected 'comma', found '%s' instead)", line);
-    fscanf(fp, "%s", line);
-    if (strcmp(line, "nFeatures") != 0)
-      KLTError("(_readFeatures) File '%s' is corrupted -- "
-               "(2 Expected 'nFeatures ', found '%s' instead)", line);
-    fscanf(fp, "%s", line);
-    if (strcmp(line, "=") != 0)
-      KLTError("(_readFeatures) File '%s' is corrupted -- "
-               "(2 Expected '= ', found '%s' instead)", line);
-    fscanf(fp, "%d", nFeatures);
+    _expectWord(tr, ",");
+    _expectWord(tr, "nFeatures");
+    _expectWord(tr, "=");
+    *nFeatures = _readInt(tr);
   }
 
   /* Skip junk before data */
-  while (fgetc(fp) != '-');
-  while (fgetc(fp) != '\n');
+  _skipPast(tr, '-', "'---'");
+  _skipPast(tr, '\n', "a new line");
 
   return id;
-#undef LINELENGTH
-}
-
-
-static void _readFeatureTxt(
-  FILE *fp,
-  KLT_Feature feat)
-{
-  while (fgetc(fp) != '(');
-  fscanf(fp, "%f,%f)=%d", &(feat->x), &(feat->y), &(feat->val));
 }
 
 
@@ -592,6 +1198,7 @@ KLT_FeatureList KLTReadFeatureList(
   int nFeatures;
   structureType id;
   int indx;
+  _TextReader tr;		/* text contents */
   KLT_BOOL binary; 		/* whether file is binary or text */
   int i;
 
@@ -600,7 +1207,7 @@ KLT_FeatureList KLTReadFeatureList(
                             "for reading", fname);
   if (KLT_verbose >= 1) 
     fprintf(stderr,  "(KLT) Reading feature list from '%s'\n", fname);
-  id = _readHeader(fp, NULL, &nFeatures, &binary);
+  id = _readHeader(fp, fname, NULL, &nFeatures, &binary, &tr);
   if (id != FEATURE_LIST) 
     KLTError("(KLTReadFeatureList) File '%s' does not contain "
              "a FeatureList", fname);
@@ -619,10 +1226,10 @@ KLT_FeatureList KLTReadFeatureList(
 
   if (!binary) {  /* text file */
     for (i = 0 ; i < fl->nFeatures ; i++)  {
-      fscanf(fp, "%d |", &indx);
+      indx = _readIndexTxt(&tr);
       if (indx != i) KLTError("(KLTReadFeatureList) Bad index at i = %d"
                               "-- %d", i, indx);
-      _readFeatureTxt(fp, fl->feature[i]);
+      _readFeatureTxt(&tr, fl->feature[i]);
     }
   } else {  /* binary file */
     for (i = 0 ; i < fl->nFeatures ; i++)  {
@@ -630,6 +1237,7 @@ KLT_FeatureList KLTReadFeatureList(
     }
   }
 
+  free(tr.buf);
   fclose(fp);
 
   return fl;
@@ -645,6 +1253,7 @@ KLT_FeatureHistory KLTReadFeatureHistory(
   int nFrames;
   structureType id;
   int indx;
+  _TextReader tr;		/* text contents */
   KLT_BOOL binary; 		/* whether file is binary or text */
   int i;
 
@@ -652,7 +1261,7 @@ KLT_FeatureHistory KLTReadFeatureHistory(
   if (fp == NULL)  KLTError("(KLTReadFeatureHistory) Can't open file '%s' "
                             "for reading", fname);
   if (KLT_verbose >= 1) fprintf(stderr,  "(KLT) Reading feature history from '%s'\n", fname);
-  id = _readHeader(fp, &nFrames, NULL, &binary);
+  id = _readHeader(fp, fname, &nFrames, NULL, &binary, &tr);
   if (id != FEATURE_HISTORY) KLTError("(KLTReadFeatureHistory) File '%s' does not contain "
                                       "a FeatureHistory", fname);
 
@@ -670,11 +1279,11 @@ KLT_FeatureHistory KLTReadFeatureHistory(
 
   if (!binary) {  /* text file */
     for (i = 0 ; i < fh->nFrames ; i++)  {
-      fscanf(fp, "%d |", &indx);
+      indx = _readIndexTxt(&tr);
       if (indx != i) 
         KLTError("(KLTReadFeatureHistory) Bad index at i = %d"
                  "-- %d", i, indx);
-      _readFeatureTxt(fp, fh->feature[i]);
+      _readFeatureTxt(&tr, fh->feature[i]);
     }
   } else {  /* binary file */
     for (i = 0 ; i < fh->nFrames ; i++)  {
@@ -682,6 +1291,7 @@ KLT_FeatureHistory KLTReadFeatureHistory(
     }
   }
 
+  free(tr.buf);
   fclose(fp);
 
   return fh;
@@ -698,6 +1308,7 @@ KLT_FeatureTable KLTReadFeatureTable(
   int nFeatures;
   structureType id;
   int indx;
+  _TextReader tr;		/* text contents */
   KLT_BOOL binary; 		/* whether file is binary or text */
   int i, j;
 
@@ -705,9 +1316,11 @@ KLT_FeatureTable KLTReadFeatureTable(
   if (fp == NULL)  KLTError("(KLTReadFeatureTable) Can't open file '%s' "
                             "for reading", fname);
   if (KLT_verbose >= 1) fprintf(stderr,  "(KLT) Reading feature table from '%s'\n", fname);
-  id = _readHeader(fp, &nFrames, &nFeatures, &binary);
-  if (id != FEATURE_TABLE) KLTError("(KLTReadFeatureTable) File '%s' does not contain "
-                                    "a FeatureTable", fname);
+
+  id = _readHeader(fp, fname, &nFrames, &nFeatures, &binary, &tr);
+  if (id != FEATURE_TABLE && id != FEATURE_TABLE_COLUMNAR)
+    KLTError("(KLTReadFeatureTable) File '%s' does not contain "
+             "a FeatureTable", fname);
 
   if (ft_in == NULL)  {
     ft = KLTCreateFeatureTable(nFrames, nFeatures);
@@ -723,14 +1336,16 @@ KLT_FeatureTable KLTReadFeatureTable(
                "features as the feature table in file '%s' ", fname);
   }
 
-  if (!binary) {  /* text file */
+  if (id == FEATURE_TABLE_COLUMNAR) {  /* KLTFT2 file */
+    _readFeatureTableColumnar(fp, fname, ft);
+  } else if (!binary) {  /* text file */
     for (j = 0 ; j < ft->nFeatures ; j++)  {
-      fscanf(fp, "%d |", &indx);
+      indx = _readIndexTxt(&tr);
       if (indx != j) 
         KLTError("(KLTReadFeatureTable) Bad index at j = %d"
                  "-- %d", j, indx);
       for (i = 0 ; i < ft->nFrames ; i++)
-        _readFeatureTxt(fp, ft->feature[j][i]);
+        _readFeatureTxt(&tr, ft->feature[j][i]);
     }
   } else {  /* binary file */
     for (j = 0 ; j < ft->nFeatures ; j++)  {
@@ -739,8 +1354,351 @@ KLT_FeatureTable KLTReadFeatureTable(
     }
   }
 
+  free(tr.buf);
   fclose(fp);
 
   return ft;
 }
 
+
+/*********************************************************************
+ * KLTFT2: columnar binary feature tables
+ *
+ * A 64-byte header is followed by one block per frame.  Each block
+ * holds the x, y and val columns of all features of the frame, each
+ * padded to a multiple of 64 bytes:
+ *
+ *   offset  0:  "KLTFT2\0\0"
+ *   offset  8:  nFrames      (int32)
+ *   offset 12:  nFeatures    (int32)
+ *   offset 16:  columnBytes  (int32, 4*nFeatures rounded up to 64)
+ *   offset 20:  frameBytes   (int32, 3*columnBytes)
+ *   offset 24:  zeros up to offset 64
+ *   offset 64 + frame*frameBytes:  float x[nFeatures],   padding
+ *                                  float y[nFeatures],   padding
+ *                                  int32 val[nFeatures], padding
+ *
+ * All numbers are little-endian.  Frame f starts at a fixed offset,
+ * so that a mapped file gives any frame, or any feature's history,
+ * without reading the rest.
+ */
+
+static KLT_BOOL _isLittleEndian(void)
+{
+  int one = 1;
+  return *(char *) &one == 1;
+}
+
+
+/* Copies a 4-byte number to little-endian storage and back */
+static void _storeLE32(
+  unsigned char *dst,
+  const void *src)
+{
+  const unsigned char *s = (const unsigned char *) src;
+  if (_isLittleEndian())  memcpy(dst, s, 4);
+  else  {
+    dst[0] = s[3];  dst[1] = s[2];  dst[2] = s[1];  dst[3] = s[0];
+  }
+}
+
+static void _loadLE32(
+  void *dst,
+  const unsigned char *src)
+{
+  unsigned char *d = (unsigned char *) dst;
+  if (_isLittleEndian())  memcpy(d, src, 4);
+  else  {
+    d[0] = src[3];  d[1] = src[2];  d[2] = src[1];  d[3] = src[0];
+  }
+}
+
+
+static int _columnBytes(
+  int nFeatures)
+{
+  return (4 * nFeatures + FT2ALIGNMENT - 1) / FT2ALIGNMENT * FT2ALIGNMENT;
+}
+
+
+/*********************************************************************
+ * KLTWriteFeatureTableColumnar
+ *
+ * Writes a feature table to a KLTFT2 file, one frame block per fwrite.
+ */
+
+void KLTWriteFeatureTableColumnar(
+  KLT_FeatureTable ft,
+  char *fname)
+{
+  FILE *fp;
+  unsigned char header[FT2HEADERLENGTH];
+  unsigned char *block;
+  int columnBytes = _columnBytes(ft->nFeatures);
+  int frameBytes = 3 * columnBytes;
+  KLT_Feature feat;
+  int i, j;
+
+  if (KLT_verbose >= 1)  {
+    fprintf(stderr,  
+            "(KLT) Writing feature table to columnar file: '%s'\n", fname);
+  }
+
+  fp = _printSetupBin(fname);
+
+  memset(header, 0, FT2HEADERLENGTH);
+  memcpy(header, binheader_ft2, BINHEADERLENGTH);
+  _storeLE32(header + 8, &(ft->nFrames));
+  _storeLE32(header + 12, &(ft->nFeatures));
+  _storeLE32(header + 16, &columnBytes);
+  _storeLE32(header + 20, &frameBytes);
+  fwrite(header, 1, FT2HEADERLENGTH, fp);
+
+  block = (unsigned char *) calloc(frameBytes > 0 ? frameBytes : 1, 1);
+  if (block == NULL)
+    KLTError("(KLTWriteFeatureTableColumnar)  Out of memory");
+  for (i = 0 ; i < ft->nFrames ; i++)  {
+    for (j = 0 ; j < ft->nFeatures ; j++)  {
+      feat = ft->feature[j][i];
+      _storeLE32(block + 4*j, &(feat->x));
+      _storeLE32(block + columnBytes + 4*j, &(feat->y));
+      _storeLE32(block + 2*columnBytes + 4*j, &(feat->val));
+    }
+    if (fwrite(block, 1, frameBytes, fp) != (size_t) frameBytes)
+      KLTError("(KLTWriteFeatureTableColumnar) "
+               "Can't write frame %d to file '%s'", i, fname);
+  }
+  free(block);
+
+  fclose(fp);
+}
+
+
+/*********************************************************************
+ * _readHeaderColumnar
+ * _readFeatureTableColumnar
+ *
+ * Read a KLTFT2 file from a stream, one frame block per fread, for
+ * KLTReadFeatureTable.  The first BINHEADERLENGTH bytes have already
+ * been read by _readHeader.  Unlike a mapping, this works on pipes
+ * and FIFOs.
+ */
+
+static void _readHeaderColumnar(
+  FILE *fp,
+  char *fname,
+  int *nFrames,
+  int *nFeatures)
+{
+  unsigned char header[FT2HEADERLENGTH];
+  int columnBytes, frameBytes;
+
+  if (fread(header + BINHEADERLENGTH, 1, FT2HEADERLENGTH - BINHEADERLENGTH, fp)
+      != FT2HEADERLENGTH - BINHEADERLENGTH)
+    KLTError("(KLTReadFeatureTable) File '%s' is too short", fname);
+  _loadLE32(nFrames, header + 8);
+  _loadLE32(nFeatures, header + 12);
+  _loadLE32(&columnBytes, header + 16);
+  _loadLE32(&frameBytes, header + 20);
+  if (*nFrames < 0 || *nFeatures < 0 ||
+      columnBytes != _columnBytes(*nFeatures) || frameBytes != 3 * columnBytes)
+    KLTError("(KLTReadFeatureTable) File '%s' is corrupted -- "
+             "(bad KLTFT2 header)", fname);
+}
+
+
+static void _readFeatureTableColumnar(
+  FILE *fp,
+  char *fname,
+  KLT_FeatureTable ft)
+{
+  unsigned char *block;
+  int columnBytes = _columnBytes(ft->nFeatures);
+  int frameBytes = 3 * columnBytes;
+  KLT_Feature feat;
+  int i, j;
+
+  block = (unsigned char *) malloc(frameBytes > 0 ? frameBytes : 1);
+  if (block == NULL)
+    KLTError("(KLTReadFeatureTable)  Out of memory");
+  for (i = 0 ; i < ft->nFrames ; i++)  {
+    if (fread(block, 1, frameBytes, fp) != (size_t) frameBytes)
+      KLTError("(KLTReadFeatureTable) File '%s' is corrupted -- "
+               "(frame %d is missing)", fname, i);
+    for (j = 0 ; j < ft->nFeatures ; j++)  {
+      feat = ft->feature[j][i];
+      _loadLE32(&(feat->x), block + 4*j);
+      _loadLE32(&(feat->y), block + columnBytes + 4*j);
+      _loadLE32(&(feat->val), block + 2*columnBytes + 4*j);
+    }
+  }
+  free(block);
+}
+
+
+/*********************************************************************
+ * KLTOpenFeatureTableFile
+ * KLTCloseFeatureTableFile
+ *
+ * Maps a KLTFT2 file into memory, for KLTReadFeatureTableFrame and
+ * KLTReadFeatureTableHistory.  Only the pages that are read are
+ * loaded from disk.
+ */
+
+KLT_FeatureTableFile KLTOpenFeatureTableFile(
+  char *fname)
+{
+  KLT_FeatureTableFile tf;
+  const unsigned char *data;
+  double size, expected;	/* in bytes; doubles cannot overflow */
+  int columnBytes, frameBytes;
+#ifdef _WIN32
+  HANDLE file, mapping;
+  LARGE_INTEGER filesize;
+#else
+  struct stat st;
+  int fd;
+#endif
+
+  /* Map the whole file */
+#ifdef _WIN32
+  file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL,
+                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    KLTError("(KLTOpenFeatureTableFile) Can't open file '%s' "
+             "for reading", fname);
+  if (!GetFileSizeEx(file, &filesize) || filesize.QuadPart < FT2HEADERLENGTH)
+    KLTError("(KLTOpenFeatureTableFile) File '%s' is too short", fname);
+  size = (double) filesize.QuadPart;
+  mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  data = (mapping == NULL) ? NULL :
+    (const unsigned char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (data == NULL)
+    KLTError("(KLTOpenFeatureTableFile) Can't map file '%s'", fname);
+#else
+  fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    KLTError("(KLTOpenFeatureTableFile) Can't open file '%s' "
+             "for reading", fname);
+  if (fstat(fd, &st) != 0 || st.st_size < FT2HEADERLENGTH)
+    KLTError("(KLTOpenFeatureTableFile) File '%s' is too short", fname);
+  size = (double) st.st_size;
+  data = (const unsigned char *) mmap(NULL, (size_t) st.st_size, PROT_READ,
+                                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == (const unsigned char *) MAP_FAILED)
+    KLTError("(KLTOpenFeatureTableFile) Can't map file '%s'", fname);
+#endif
+
+  tf = (KLT_FeatureTableFile) malloc(sizeof(KLT_FeatureTableFileRec));
+  if (tf == NULL)
+    KLTError("(KLTOpenFeatureTableFile)  Out of memory");
+
+  /* Check the header */
+  if (memcmp(data, binheader_ft2, BINHEADERLENGTH) != 0)
+    KLTError("(KLTOpenFeatureTableFile) File '%s' is not a "
+             "KLTFT2 feature table", fname);
+  _loadLE32(&(tf->nFrames), data + 8);
+  _loadLE32(&(tf->nFeatures), data + 12);
+  _loadLE32(&columnBytes, data + 16);
+  _loadLE32(&frameBytes, data + 20);
+  expected = FT2HEADERLENGTH + (double) tf->nFrames * frameBytes;
+  if (tf->nFrames < 0 || tf->nFeatures < 0 ||
+      columnBytes != _columnBytes(tf->nFeatures) ||
+      frameBytes != 3 * columnBytes || size < expected)
+    KLTError("(KLTOpenFeatureTableFile) File '%s' is corrupted -- "
+             "(%d frames of %d features need %.0f bytes, file has %.0f)",
+             fname, tf->nFrames, tf->nFeatures, expected, size);
+
+  tf->data = data;
+  tf->size = (size_t) size;
+  tf->columnBytes = columnBytes;
+#ifdef _WIN32
+  tf->file = file;
+  tf->mapping = mapping;
+#else
+  tf->file = NULL;
+  tf->mapping = NULL;
+#endif
+
+  return tf;
+}
+
+
+void KLTCloseFeatureTableFile(
+  KLT_FeatureTableFile tf)
+{
+#ifdef _WIN32
+  UnmapViewOfFile(tf->data);
+  CloseHandle((HANDLE) tf->mapping);
+  CloseHandle((HANDLE) tf->file);
+#else
+  munmap((void *) tf->data, tf->size);
+#endif
+  free(tf);
+}
+
+
+/*********************************************************************
+ * KLTReadFeatureTableFrame
+ *
+ * Reads all features of one frame of a mapped KLTFT2 file into fl,
+ * which must have as many features as the table.
+ */
+
+void KLTReadFeatureTableFrame(
+  KLT_FeatureTableFile tf,
+  int frame,
+  KLT_FeatureList fl)
+{
+  const unsigned char *block;
+  int j;
+
+  if (frame < 0 || frame >= tf->nFrames)
+    KLTError("(KLTReadFeatureTableFrame) Frame %d is not in the table "
+             "(%d frames)", frame, tf->nFrames);
+  if (fl->nFeatures != tf->nFeatures)
+    KLTError("(KLTReadFeatureTableFrame) The feature list passed "
+             "does not contain the same number of features as "
+             "the feature table (%d vs. %d)", fl->nFeatures, tf->nFeatures);
+
+  block = tf->data + FT2HEADERLENGTH + (size_t) frame * 3 * tf->columnBytes;
+  for (j = 0 ; j < tf->nFeatures ; j++)  {
+    _loadLE32(&(fl->feature[j]->x), block + 4*j);
+    _loadLE32(&(fl->feature[j]->y), block + tf->columnBytes + 4*j);
+    _loadLE32(&(fl->feature[j]->val), block + 2*tf->columnBytes + 4*j);
+  }
+}
+
+
+/*********************************************************************
+ * KLTReadFeatureTableHistory
+ *
+ * Reads the history of one feature from a mapped KLTFT2 file into
+ * fh, which must have as many frames as the table.
+ */
+
+void KLTReadFeatureTableHistory(
+  KLT_FeatureTableFile tf,
+  int feature,
+  KLT_FeatureHistory fh)
+{
+  const unsigned char *block;
+  size_t frameBytes = 3 * (size_t) tf->columnBytes;
+  int i;
+
+  if (feature < 0 || feature >= tf->nFeatures)
+    KLTError("(KLTReadFeatureTableHistory) Feature %d is not in the table "
+             "(%d features)", feature, tf->nFeatures);
+  if (fh->nFrames != tf->nFrames)
+    KLTError("(KLTReadFeatureTableHistory) The feature history passed "
+             "does not contain the same number of frames as "
+             "the feature table (%d vs. %d)", fh->nFrames, tf->nFrames);
+
+  block = tf->data + FT2HEADERLENGTH + 4 * (size_t) feature;
+  for (i = 0 ; i < tf->nFrames ; i++, block += frameBytes)  {
+    _loadLE32(&(fh->feature[i]->x), block);
+    _loadLE32(&(fh->feature[i]->y), block + tf->columnBytes);
+    _loadLE32(&(fh->feature[i]->val), block + 2*tf->columnBytes);
+  }
+}